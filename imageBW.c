@@ -28,14 +28,52 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_AVX2  // AVX2 kernels, used if the CPU supports them
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define IMAGE_THREADS  // Operations may run in parallel (see ImageSetThreads)
+#endif
+
 #include "instrumentation.h"
 
 // The data structure
 //
-// A BW image is stored in a structure containing 3 fields:
+// A BW image is stored in a structure containing 5 fields:
 // Two integers store the image width and height.
-// The other field is a pointer to an array that stores the pointers
-// to the RLE compressed image rows.
+// The row field points to a table of row descriptors, one per image row,
+// holding the color of the first run, the number of runs, the arena
+// holding the row runs and their offset in that arena.
+// Rows are length-prefixed by their descriptor: there is no end-of-row
+// sentinel in the arena, so the length of a row is known in O(1).
+// An arena is a single contiguous array storing the runs of many rows,
+// one row after the other, so that walking the image rows walks memory
+// sequentially and the whole image takes O(1) allocations.
+// Runs are stored with 8, 16 or 32 bits, the narrowest width that fits
+// the longest run of the row, chosen independently for each row.
+// Most rows of scanned documents only have runs below 256 pixels,
+// and take 1 byte per run.
+// Arenas are reference counted and the runs stored in them are immutable,
+// so operations that do not change the rows themselves (replicate at
+// bottom, full-width crops) share the arenas of their operands and only
+// build a new table of row descriptors.
+// Negation and mirroring do not even do that: they return views of their
+// operand, which share its table of row descriptors, with flags that say
+// how to read its pixels (see NewView).
+// Moreover, rows are interned (hash-consed): every row built by any
+// operation is looked up by content in a global table, and identical rows
+// (of the same or of different images) are stored only once.
+// Rows with many short runs (halftones, noise) are stored as packed
+// bitmaps instead, one bit per pixel, whenever that takes less memory
+// than their runs.  The representation of a row depends only on its
+// pixels, so equal rows are always stored the same way.
 //
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
@@ -44,13 +82,74 @@
 // Constant value --- Use them throughout your code
 // const uint8 BLACK = 1;  // Black pixel value, defined on .h
 // const uint8 WHITE = 0;  // White pixel value, defined on .h
-const int EOR = -1;  // Stored as the last element of a RLE row
+const int EOR = -1;  // Printed as the last element of a RLE row
+
+// Alignment of the row descriptor table (a cache line)
+#define CACHE_LINE 64
+
+// Runsize of rows stored as packed bitmaps.
+// Pixel x of such a row is bit (x % 64) of 64-bit word x / 64, XORed with
+// the color of the row (so that the first bit is always 0, and a row and
+// its negation are stored the same way).  Padding bits are 0.
+#define BITMAP_ROW 0
+
+// Number of 64-bit words of a packed row of width pixels
+#define ROW_WORDS(width) (((size_t)(width) + 63) / 64)
+
+// Descriptor of a RLE row.
+// 16 bytes each, so that 4 descriptors fit exactly in a cache line.
+typedef struct {
+    uint32 offset;  // byte offset of the first run of the row in the arena
+    uint32 nruns;   // number of runs of the row
+    uint8 color;    // color of the first run (BLACK or WHITE)
+    uint8 runsize;  // bytes per run: 1, 2 or 4, or BITMAP_ROW
+    uint16 arena;   // index of the arena of the row, in the image arena list
+    uint32 hash;    // hash of the runs (not of the color), see RowHash
+} RLERow;
+
+// Block of memory storing the runs of RLE rows, shared by images
+typedef struct Arena {
+    uint32 refs;    // number of images referencing the arena
+    uint32 hint;    // index of the arena in the list of the last image
+                    // that started referencing it (see ShareArena)
+    uint8* data;    // the runs (NULL once the arena is dead)
+    size_t used;    // number of bytes in use
+    size_t capacity;  // number of bytes allocated
+    struct Arena* next;  // next dead arena (see ReleaseArena)
+    struct MappedFile* file;  // file holding the runs, if they are in a
+                              // file (see ImageLoadRLE), or NULL
+    uint32 interned;  // number of its rows in the intern table
+} Arena;
+
+// Maximum number of arenas referenced by an image
+#define MAX_ARENAS UINT16_MAX
+
+// View flags: how the pixels of an image are read from its rows
+#define VIEW_NEG 1      // negated
+#define VIEW_FLIP_TB 2  // flipped top-bottom: rows in reverse order
+#define VIEW_FLIP_LR 4  // flipped left-right: runs of rows in reverse order
 
 // Internal structure for storing RLE BW images
 struct image {
     uint32 width;
     uint32 height;
-    int** row;  // pointer to an array of pointers referencing the compressed rows
+    RLERow* row;    // table of row descriptors (cache-aligned)
+    Arena** arena;  // arenas referenced by the rows
+    uint32 narenas; // number of arenas referenced
+    size_t bytes;   // bytes taken by the runs of all rows
+    uint64_t runs;  // number of runs of all rows
+    uint64_t black; // number of BLACK pixels
+    int mapped;     // whether the row table is in a file (see ImageLoadRLE)
+    uint64_t fingerprint;  // of the pixels, or 0 if not computed yet
+                           // (see ImageFingerprint)
+    uint32** index; // ends of the runs of each row, built only for the rows
+                    // read by ImageGetPixel (NULL: none built yet)
+    size_t index_bytes;  // bytes taken by the index
+    uint8 view;     // view flags (VIEW_NEG, etc.): the pixels of the image
+                    // are those of its rows, transformed
+    uint32* shared; // number of images sharing the row table and arena
+                    // list, which are then never changed (see NewView),
+                    // or NULL if only this one uses them
 };
 
 // This module follows "design-by-contract" principles.
@@ -67,201 +166,1023 @@ struct image {
 // Use the following function to check a condition
 // and exit if it fails.
 
+// Temporary file of the save in progress, if any (see OpenSaveFile):
+// removed when a check fails, so a failed save leaves nothing behind.
+static char* SaveInProgress = NULL;
+
 // Check a condition and if false, print failmsg and exit.
 static void check(int condition, const char* failmsg) {
     if (!condition) {
+        int error = errno;
         perror(failmsg);
-        exit(errno || 255);
+        if (SaveInProgress != NULL) remove(SaveInProgress);
+        exit(error || 255);
+    }
+}
+
+/// Check condition, as check does, when its failure is not reported in
+/// errno (invalid data, or a limit reached): error is reported instead.
+static void checkError(int condition, const char* failmsg, int error) {
+    if (!condition) {
+        errno = error;
+        check(0, failmsg);
     }
 }
 
+// Allocators of the blocks of images (see AllocBlock)
+enum { ALLOC_POOL, ALLOC_MALLOC };
+static int Allocator = ALLOC_POOL;
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and choose the
+/// allocator.
 void ImageInit(void) {  ///
     InstrCalibrate();
     InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
     InstrName[1] = "bool_op"; // InstrCount[1] counts boolean operations
+    InstrName[2] = "intern_hit";   // InstrCount[2] counts rows found interned
+    InstrName[3] = "intern_saved"; // InstrCount[3] counts bytes not stored
+    InstrName[4] = "allocs";  // InstrCount[4] counts blocks allocated
+    InstrName[5] = "frees";   // InstrCount[5] counts blocks freed
     // Name other counters here...
+
+    // Choose the allocator (see AllocBlock)
+    const char* allocator = getenv("IMAGEBW_ALLOC");
+    if (allocator != NULL && strcmp(allocator, "malloc") == 0) {
+        Allocator = ALLOC_MALLOC;
+    }
 }
 
+// Counters are incremented through Counters, which points to InstrCount,
+// except while running rows in parallel: then each thread counts on its
+// own and adds its counts to InstrCount at the end (see RunRowJob).
+static _Thread_local unsigned long* Counters = InstrCount;
+
 // Macros to simplify accessing instrumentation counters:
-#define PIXMEM InstrCount[0]
-#define BOOL_OP InstrCount[1] // Tracks boolean operations (AND)
+#define PIXMEM Counters[0]
+#define BOOL_OP Counters[1] // Tracks boolean operations (AND)
+#define INTERN_HIT Counters[2]
+#define INTERN_SAVED Counters[3]
+#define ALLOCS Counters[4]
+#define FREES Counters[5]
 
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
+/// Memory allocation
+
+// The blocks of images (headers, row tables, arena lists, arenas and
+// their runs, indices) and of expressions are allocated with AllocBlock
+// and freed with FreeBlock, giving their size, so no size is stored with
+// them.  All blocks are aligned to a cache line.
+// By default, blocks are pooled: they are rounded up to a size class (a
+// power of 2, from a cache line to the size of an intern chunk) and
+// recycled through free lists, so operations allocate no memory once
+// the pool has grown to their needs.  Each thread keeps its own free
+// lists, which it refills from (and spills to) lists shared by all
+// threads, which are carved from large slabs.  Slabs are never freed one
+// by one, only all at once (see ImageReleaseMemory).
+// Larger blocks, and all blocks if IMAGEBW_ALLOC is "malloc" when
+// ImageInit is called, come from aligned_alloc and go back to free.
+// (Temporary buffers of operations still use malloc directly.)
+
+#define BLOCK_MIN CACHE_LINE   // size of the smallest class
+#define BLOCK_CLASSES 15       // classes of 64 bytes to 1 MiB
+#define SLAB_SIZE (1 << 20)    // bytes of each slab
+#define LOCAL_BYTES (4 << 20)  // bytes kept by a thread per class, at most
+
+// A free block, linked to the next one in its free list
+typedef struct Block {
+    struct Block* next;
+} Block;
+
+// Free lists of each thread, valid while their epoch is BlockEpoch
+static _Thread_local Block* LocalBlocks[BLOCK_CLASSES];
+static _Thread_local uint32 LocalCount[BLOCK_CLASSES];
+static _Thread_local uint32 LocalEpoch = 0;
+
+// Shared free lists and slabs (accessed with BlockLock held)
+static Block* SharedBlocks[BLOCK_CLASSES];
+static void** Slabs = NULL;
+static size_t NumSlabs = 0;
+static uint32 BlockEpoch = 1;  // changed when slabs are freed
+
+#ifdef IMAGE_THREADS
+static pthread_mutex_t BlockLock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_BLOCKS() pthread_mutex_lock(&BlockLock)
+#define UNLOCK_BLOCKS() pthread_mutex_unlock(&BlockLock)
+#else
+#define LOCK_BLOCKS() ((void)0)
+#define UNLOCK_BLOCKS() ((void)0)
+#endif
+
+/// Size class of blocks of size bytes (BLOCK_CLASSES if too large)
+static inline uint32 BlockClass(size_t size) {
+    uint32 c = 0;
+    while (c < BLOCK_CLASSES && ((size_t)BLOCK_MIN << c) < size) c++;
+    return c;
+}
+
+/// Forget the free blocks of the calling thread if their slabs were freed
+static inline void CheckLocalBlocks(void) {
+    if (LocalEpoch != BlockEpoch) {
+        memset(LocalBlocks, 0, sizeof(LocalBlocks));
+        memset(LocalCount, 0, sizeof(LocalCount));
+        LocalEpoch = BlockEpoch;
+    }
+}
+
+/// Get the free list of class c of the calling thread, refilled if empty
+static Block** LocalList(uint32 c) {
+    CheckLocalBlocks();
+    if (LocalBlocks[c] != NULL) return &LocalBlocks[c];
+
+    size_t size = (size_t)BLOCK_MIN << c;
+    LOCK_BLOCKS();
+    Block* list = SharedBlocks[c];
+    SharedBlocks[c] = NULL;
+    if (list == NULL) {
+        // Carve a new slab
+        void** slabs = realloc(Slabs, (NumSlabs + 1) * sizeof(void*));
+        check(slabs != NULL, "realloc");
+        Slabs = slabs;
+        uint8* slab = aligned_alloc(CACHE_LINE, SLAB_SIZE);
+        check(slab != NULL, "aligned_alloc");
+        Slabs[NumSlabs++] = slab;
+        for (size_t pos = SLAB_SIZE; pos >= size; pos -= size) {
+            Block* block = (Block*)(slab + pos - size);
+            block->next = list;
+            list = block;
+        }
+    }
+    UNLOCK_BLOCKS();
+    uint32 count = 0;
+    for (Block* block = list; block != NULL; block = block->next) count++;
+    LocalBlocks[c] = list;
+    LocalCount[c] = count;
+    return &LocalBlocks[c];
+}
+
+/// Move the free blocks of class c of the calling thread to the shared
+/// free list
+static void SpillBlocks(uint32 c) {
+    Block* list = LocalBlocks[c];
+    if (list == NULL) return;
+    Block* last = list;
+    while (last->next != NULL) last = last->next;
+    LOCK_BLOCKS();
+    last->next = SharedBlocks[c];
+    SharedBlocks[c] = list;
+    UNLOCK_BLOCKS();
+    LocalBlocks[c] = NULL;
+    LocalCount[c] = 0;
+}
+
+/// Move all the free blocks of the calling thread to the shared lists
+/// (when it ends)
+static void SpillAllBlocks(void) {
+    CheckLocalBlocks();
+    for (uint32 c = 0; c < BLOCK_CLASSES; c++) SpillBlocks(c);
+}
+
+/// Allocate a block of size bytes, aligned to a cache line
+static void* AllocBlock(size_t size) {
+    ALLOCS++;
+    uint32 c = BlockClass(size);
+    if (Allocator == ALLOC_MALLOC || c == BLOCK_CLASSES) {
+        // (aligned_alloc requires a size multiple of the alignment)
+        size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        void* block = aligned_alloc(CACHE_LINE, size > 0 ? size : CACHE_LINE);
+        check(block != NULL, "aligned_alloc");
+        return block;
+    }
+    Block** list = LocalList(c);
+    Block* block = *list;
+    *list = block->next;
+    LocalCount[c]--;
+    return block;
+}
+
+/// Free block, of size bytes, allocated by AllocBlock (or NULL)
+static void FreeBlock(void* block, size_t size) {
+    if (block == NULL) return;
+    FREES++;
+    uint32 c = BlockClass(size);
+    if (Allocator == ALLOC_MALLOC || c == BLOCK_CLASSES) {
+        free(block);
+        return;
+    }
+    CheckLocalBlocks();
+    Block* free_block = block;
+    free_block->next = LocalBlocks[c];
+    LocalBlocks[c] = free_block;
+    if (++LocalCount[c] > LOCAL_BYTES / ((size_t)BLOCK_MIN << c)) {
+        SpillBlocks(c);
+    }
+}
+
+/// Resize block, of old_size bytes, to new_size bytes, keeping its
+/// contents (as far as they fit)
+static void* ResizeBlock(void* block, size_t old_size, size_t new_size) {
+    if (block != NULL && Allocator == ALLOC_POOL &&
+        BlockClass(old_size) == BlockClass(new_size) &&
+        BlockClass(new_size) < BLOCK_CLASSES) {
+        return block;  // the same block has room
+    }
+    void* new_block = AllocBlock(new_size);
+    if (block != NULL) {
+        memcpy(new_block, block, old_size < new_size ? old_size : new_size);
+        FreeBlock(block, old_size);
+    }
+    return new_block;
+}
+
 /// Auxiliary (static) functions
 
-/// Reverse array recursivly
-static void ReverseArray(int* arr, size_t size) {
-    if (size <= 1) return; //Base case for recursion 
-    
-    //Switch first with last element
-    int aux = arr[0];
-    arr[0] = arr[size - 1];
-    arr[size - 1] = aux;
-    
-    ReverseArray(arr + 1, size - 2);
+/// Narrowest width (in bytes) that can store a run of length max_run
+static inline uint8 RunSizeFor(uint32 max_run) {
+    if (max_run <= UINT8_MAX) return 1;
+    if (max_run <= UINT16_MAX) return 2;
+    return 4;
 }
 
-/// Copy src row into dst row until it finds EOR
-///
-/// Its the users job to garantee there is enough space
-/// in dst for all of src's content. src isn't modified
-static void CopyRLERow(int* dst, const int* src) {
-    size_t i = 0;
-    while(src[i] != -1) {
-        dst[i] = src[i]; i++;
+/// Get run k of an array of runs of runsize bytes each
+static inline uint32 GetRun(const uint8* runs, uint8 runsize, uint32 k) {
+    switch (runsize) {
+        case 1: return runs[k];
+        case 2: return ((const uint16*)runs)[k];
+        default: return ((const uint32*)runs)[k];
+    }
+}
+
+/// Number of trailing zero bits of word (which must not be 0)
+static inline uint32 TrailingZeros(uint64_t word) {
+    assert(word != 0);
+#if defined(__GNUC__)
+    return (uint32)__builtin_ctzll(word);
+#else
+    uint32 n = 0;
+    while ((word & 1) == 0) {
+        word >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/// Number of set bits of word
+static inline uint32 PopCount(uint64_t word) {
+#if defined(__GNUC__)
+    return (uint32)__builtin_popcountll(word);
+#else
+    uint32 n = 0;
+    for (; word != 0; word &= word - 1) n++;
+    return n;
+#endif
+}
+
+/// Pack num_runs runs of runsize bytes each (starting with color) into the
+/// nwords = ROW_WORDS(width) words of bits.  Padding bits are 0.
+/// Instead of filling each run, a bit is set where each run starts, and
+/// the pixels are then recovered a word at a time as the prefix XOR of
+/// those bits, so the cost does not depend on the runs being long.
+static void PackRuns(uint64_t* bits, uint32 width, const uint8* runs,
+                     uint8 runsize, uint32 num_runs, int color) {
+    size_t nwords = ROW_WORDS(width);
+    memset(bits, 0, nwords * sizeof(uint64_t));
+    // The first run starts at 0 and does not change the color.
+    // Consecutive runs usually start in the same word, so the word is
+    // kept in a register until a run starts in another one.
+    size_t x = 0, w = 0;
+    uint64_t word = 0;
+#define MARK_RUN_START(run) do {                    \
+        x += (run);                                 \
+        if (x / 64 != w) {                          \
+            bits[w] = word;                         \
+            w = x / 64;                             \
+            word = 0;                               \
+        }                                           \
+        word |= (uint64_t)1 << (x % 64);            \
+    } while (0)
+    switch (runsize) {
+        case 1:
+            for (uint32 k = 0; k + 1 < num_runs; k++) MARK_RUN_START(runs[k]);
+            break;
+        case 2:
+            for (uint32 k = 0; k + 1 < num_runs; k++)
+                MARK_RUN_START(((const uint16*)runs)[k]);
+            break;
+        default:
+            for (uint32 k = 0; k + 1 < num_runs; k++)
+                MARK_RUN_START(((const uint32*)runs)[k]);
+            break;
+    }
+#undef MARK_RUN_START
+    bits[w] = word;
+
+    uint64_t carry = -(uint64_t)color;  // color before pixel 0
+    for (w = 0; w < nwords; w++) {
+        word = bits[w];
+        word ^= word << 1;
+        word ^= word << 2;
+        word ^= word << 4;
+        word ^= word << 8;
+        word ^= word << 16;
+        word ^= word << 32;
+        word ^= carry;
+        bits[w] = word;
+        carry = -(word >> 63);
+    }
+    if (width % 64 != 0) {
+        bits[nwords - 1] &= ~(uint64_t)0 >> (64 - width % 64);
+    }
+}
+
+/// Bits of word w of a packed row of width pixels where a pixel differs
+/// from its predecessor (carry is the last pixel of word w-1).
+static inline uint64_t RunStarts(const uint64_t* bits, size_t w,
+                                 uint64_t carry, uint32 width) {
+    uint64_t change = bits[w] ^ (bits[w] << 1 | carry);
+    if (w == ROW_WORDS(width) - 1 && width % 64 != 0) {
+        change &= ~(uint64_t)0 >> (64 - width % 64);  // drop padding
+    }
+    return change;
+}
+
+/// Number of runs of the packed row of width pixels in bits
+static uint32 CountRuns(const uint64_t* bits, uint32 width) {
+    uint32 num_runs = 1;
+    uint64_t carry = bits[0] & 1;
+    for (size_t w = 0; w < ROW_WORDS(width); w++) {
+        num_runs += PopCount(RunStarts(bits, w, carry, width));
+        carry = bits[w] >> 63;
+    }
+    return num_runs;
+}
+
+/// Convert the packed row of width pixels in bits into runs, stored in
+/// runs (which must have room for all of them).
+/// Runs end where a pixel differs from its predecessor, so they are found
+/// a word at a time, by comparing each word with itself shifted by one.
+/// Returns the number of runs, and stores the longest one in *max_run.
+static uint32 UnpackRuns(int* runs, const uint64_t* bits, uint32 width,
+                         uint32* max_run) {
+    uint32 num_runs = 0;
+    size_t max = 0;
+    size_t start = 0;               // first pixel of the current run
+    uint64_t carry = bits[0] & 1;   // last pixel of the previous word
+    for (size_t w = 0; w < ROW_WORDS(width); w++) {
+        uint64_t change = RunStarts(bits, w, carry, width);
+        carry = bits[w] >> 63;
+        while (change != 0) {
+            size_t x = 64 * w + TrailingZeros(change);
+            runs[num_runs++] = (int)(x - start);
+            if (x - start > max) max = x - start;
+            start = x;
+            change &= change - 1;  // clear lowest set bit
+        }
+    }
+    runs[num_runs++] = (int)(width - start);
+    if (width - start > max) max = width - start;
+
+    *max_run = (uint32)max;
+    return num_runs;
+}
+
+/// Create an arena with room for capacity bytes, referenced once.
+static Arena* NewArena(size_t capacity) {
+    Arena* arena = AllocBlock(sizeof(Arena));
+    arena->data = AllocBlock(capacity);
+    arena->refs = 1;
+    arena->hint = 0;
+    arena->used = 0;
+    arena->capacity = capacity;
+    arena->next = NULL;
+    arena->file = NULL;
+    arena->interned = 0;
+    return arena;
+}
+
+// A file in memory, shared by the arenas of its rows (see ImageLoadRLE)
+struct MappedFile;
+static void ReleaseMappedFile(struct MappedFile* file);
+
+// Arenas no longer referenced, whose rows must still be purged from the
+// intern table before the Arena structures themselves are freed.
+static Arena* DeadArenas = NULL;
+static size_t InternDead = 0;  // number of rows of dead arenas in the table
+
+/// Drop a reference to arena.
+/// When no one references it, its runs are freed and the arena is added
+/// to the list of dead arenas (see InternPurge).
+static void ReleaseArena(Arena* arena) {
+    assert(arena->refs > 0);
+    if (--arena->refs == 0 && arena->file != NULL) {
+        // Rows in files are never interned
+        ReleaseMappedFile(arena->file);
+        FreeBlock(arena, sizeof(Arena));
+    } else if (arena->refs == 0) {
+        FreeBlock(arena->data, arena->capacity);
+        arena->data = NULL;
+        arena->next = DeadArenas;
+        DeadArenas = arena;
+        InternDead += arena->interned;
     }
-    dst[i] = -1;
 }
 
-/// Create the header of an image data structure
-/// And allocate the array of pointers to RLE rows
+/// Size of the (cache-aligned) block of the row table of an image.
+static inline size_t RowTableSize(uint32 height) {
+    size_t size = (size_t)height * sizeof(RLERow);
+    return (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+/// Size of the block of an arena list of narenas arenas.
+/// Lists grow by doubling: their capacity is the next power of 2.
+static inline size_t ArenaListSize(uint32 narenas) {
+    size_t capacity = 1;
+    while (capacity < narenas) capacity *= 2;
+    return narenas > 0 ? capacity * sizeof(Arena*) : 0;
+}
+
+/// Create the header of an image data structure and allocate the
+/// (cache-aligned) table of row descriptors.
+/// The image references no arenas yet: its rows are either built with
+/// BeginRLERow/EndRLERow or shared from other images with ShareArena.
 static Image AllocateImageHeader(uint32 width, uint32 height) {
     assert(width > 0 && height > 0);
-    Image newHeader = malloc(sizeof(struct image));
-    check(newHeader != NULL, "malloc");
+    Image newHeader = AllocBlock(sizeof(struct image));
 
     newHeader->width = width;
     newHeader->height = height;
 
-    // Allocating the array of pointers to RLE rows
-    newHeader->row = malloc(height * sizeof(int*));
-    check(newHeader->row != NULL, "malloc");
+    // Allocating the table of row descriptors
+    newHeader->row = AllocBlock(RowTableSize(height));
+
+    newHeader->arena = NULL;
+    newHeader->narenas = 0;
+    newHeader->bytes = 0;
+    newHeader->runs = 0;
+    newHeader->black = 0;
+    newHeader->mapped = 0;
+    newHeader->fingerprint = 0;
+    newHeader->index = NULL;
+    newHeader->index_bytes = 0;
+    newHeader->view = 0;
+    newHeader->shared = NULL;
 
     return newHeader;
 }
 
-/// Allocate an array to store a RLE row with n elements
-static int* AllocateRLERowArray(uint32 n) {
-    assert(n > 2);
-    int* newArray = malloc(n * sizeof(int));
-    check(newArray != NULL, "malloc");
-
-    return newArray;
+/// Make img reference arena (once) and return its index in the arena list
+/// of img.
+static uint16 ShareArena(Image img, Arena* arena) {
+    // Rows of an image usually come from the same few arenas,
+    // so first check where the arena was put last time
+    uint32 k = arena->hint;
+    if (k < img->narenas && img->arena[k] == arena) return (uint16)k;
+    for (k = 0; k < img->narenas; k++) {
+        if (img->arena[k] == arena) return (uint16)k;
+    }
+    checkError(img->narenas < MAX_ARENAS, "Too many arenas", ENOMEM);
+    if ((img->narenas & (img->narenas - 1)) == 0) {
+        // The list is full (or empty): double it
+        img->arena = ResizeBlock(img->arena, ArenaListSize(img->narenas),
+                                 ArenaListSize(img->narenas + 1));
+    }
+    img->arena[img->narenas] = arena;
+    arena->refs++;
+    arena->hint = img->narenas;
+    return (uint16)img->narenas++;
 }
 
-/// Compute the number of runs of a non-compressed (RAW) image row
-static uint32 GetNumRunsInRAWRow(uint32 image_width, const uint8* RAW_row) {
-    assert(image_width > 0);
-    assert(RAW_row != NULL);
+/// Make newImage reference all the arenas of img, with the same indices.
+/// Requires: newImage references no arenas yet.
+static void ShareAllArenas(Image newImage, const Image img) {
+    assert(newImage->narenas == 0);
+    for (uint32 k = 0; k < img->narenas; k++) {
+        ShareArena(newImage, img->arena[k]);  // same index as in img
+    }
+}
 
-    // How many runs?
-    uint32 num_runs = 1;
-    for (uint32 i = 1; i < image_width; i++) {
-        if (RAW_row[i] != RAW_row[i - 1]) {
-            num_runs++;
-        }
+/// Create a view of img: an image that shares its row table and arena
+/// list, in O(1), with the view flags of img toggled by flags.
+/// Shared tables and lists are never changed: images copy them first
+/// (see OwnRowTable), and they are freed with the last image using them.
+static Image NewView(const Image img, uint8 flags) {
+    Image newImage = AllocBlock(sizeof(struct image));
+    *newImage = *img;
+    if (img->shared == NULL) {
+        img->shared = AllocBlock(sizeof(uint32));
+        *img->shared = 1;
     }
+    (*img->shared)++;
+    newImage->shared = img->shared;
+    newImage->view = img->view ^ flags;
+    newImage->index = NULL;  // each image builds its own
+    newImage->index_bytes = 0;
+    if (flags != 0) newImage->fingerprint = 0;
+    if (flags & VIEW_NEG) {
+        newImage->black = (uint64_t)img->width * img->height - img->black;
+    }
+    return newImage;
+}
 
-    return num_runs;
+/// Create a copy of img that shares its rows (and arenas).
+static Image ShareImage(const Image img) {
+    return NewView(img, 0);
 }
 
-/// Get the number of runs of a compressed RLE image row
-static uint32 GetNumRunsInRLERow(const int* RLE_row) {
-    assert(RLE_row != NULL);
 
-    // go through the rle_row until eor is found
-    // discard rle_row[0], since it is a pixel color
+// Growable buffer
+typedef struct {
+    void* data;
+    size_t size;  // bytes allocated
+} Scratch;
+
+/// Get the address of scratch, making sure it has at least size bytes
+static inline void* GrowScratch(Scratch* scratch, size_t size) {
+    if (size > scratch->size) {
+        // Old contents are not needed, so avoid copying them
+        free(scratch->data);
+        scratch->data = malloc(size);
+        check(scratch->data != NULL, "malloc");
+        scratch->size = size;
+    }
+    return scratch->data;
+}
 
-    uint32 num_runs = 0;
-    uint32 i = 1;
-    while (RLE_row[i] != EOR) {
-        num_runs++;
-        i++;
+// Buffers where rows are built, encoded, decoded or packed.
+// Each thread builds one row at a time, so one of each per thread is
+// enough.
+static _Thread_local Scratch RowScratch;     // runs being built
+static _Thread_local Scratch EncodeScratch;  // row being interned
+static _Thread_local Scratch DecodeScratch;  // runs of operand rows
+static _Thread_local Scratch BitsScratch;    // packed operand rows
+static _Thread_local Scratch ExprScratch;    // rows of expression nodes
+static _Thread_local Scratch ViewScratch;    // rows flipped left-right
+static _Thread_local Scratch MirrorScratch;  // rows interned, mirrored
+
+/// Free the buffers of the calling thread
+static void FreeScratch(void) {
+    Scratch* all[] = {&RowScratch, &EncodeScratch, &DecodeScratch,
+                      &BitsScratch, &ExprScratch, &ViewScratch,
+                      &MirrorScratch};
+    for (size_t k = 0; k < sizeof(all) / sizeof(all[0]); k++) {
+        free(all[k]->data);
+        all[k]->data = NULL;
+        all[k]->size = 0;
     }
+}
 
-    return num_runs;
+/// Row interning
+
+// Global table of interned rows, with open addressing (linear probing).
+// Rows are keyed by their content: the width of their runs (or BITMAP_ROW),
+// their number of runs and the runs (or bits) themselves (the first color
+// is kept in the row descriptor, so a row and its negation are the same
+// interned row), and by their width in pixels (the same bits are a
+// different row, once mirrored, with another width).
+// Rows may be built by several threads at once, so the table, the intern
+// chunk and the arena lists of images being built are only accessed with
+// InternLock held.
+// Interned rows are stored in intern chunks, which are ordinary arenas
+// shared by the images that use their rows. The table only references the
+// chunk where new rows are appended, so a chunk is freed as soon as no
+// image uses it. Its rows stay in the table, never matched, until enough
+// rows are dead for a rebuild of the table to pay off (see InternPurge).
+typedef struct {
+    uint64_t hash;
+    Arena* arena;   // intern chunk holding the row (NULL for empty slots)
+    uint32 offset;  // byte offset of the row in the chunk
+    uint32 size;    // bytes of the row
+    uint32 width;   // pixels of the row
+    uint32 nruns;
+    uint32 count;   // pixels of the color of the first run (see CountFirst)
+    uint8 runsize;
+    uint32 row_hash;  // kept in the row descriptors (see RowHash)
+} InternEntry;
+
+#define INTERN_CHUNK_SIZE (1 << 20)  // Bytes of a new intern chunk
+#define INTERN_MIN_SLOTS 1024
+
+static InternEntry* InternTable = NULL;
+static size_t InternSlots = 0;   // capacity (a power of 2)
+static size_t InternCount = 0;   // number of rows interned (even dead)
+static Arena* InternChunk = NULL;  // chunk where new rows are appended
+
+#ifdef IMAGE_THREADS
+static pthread_mutex_t InternLock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_INTERN() pthread_mutex_lock(&InternLock)
+#define UNLOCK_INTERN() pthread_mutex_unlock(&InternLock)
+#else
+#define LOCK_INTERN() ((void)0)
+#define UNLOCK_INTERN() ((void)0)
+#endif
+
+/// Hash the size bytes of the runs of a row with num_runs runs
+static uint64_t HashRow(const uint8* runs, size_t size, uint32 num_runs,
+                        uint8 runsize) {
+    const uint64_t mul = 0x9E3779B97F4A7C15ull;
+    uint64_t h = ((uint64_t)num_runs << 8 | runsize) * mul;
+    size_t k = 0;
+    for (; k + sizeof(uint64_t) <= size; k += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, runs + k, sizeof(uint64_t));
+        h = (h ^ word) * mul;
+        h ^= h >> 32;
+    }
+    uint64_t word = 0;
+    memcpy(&word, runs + k, size - k);
+    h = (h ^ word) * mul;
+    return h ^ (h >> 29);
+}
+
+static void MirrorBits(uint64_t* dst, const uint64_t* src, uint32 width);
+static inline void ClearPadding(uint64_t* bits, uint32 width);
+
+/// Mirror (flip left-right) the row of width pixels with num_runs runs of
+/// runsize bytes (or packed bitmap), of size bytes at runs: returns the
+/// row as it would be stored if built mirrored, in a buffer of the calling
+/// thread.
+static const uint8* MirrorRow(uint32 width, const uint8* runs, size_t size,
+                              uint32 num_runs, uint8 runsize) {
+    uint8* mirrored = GrowScratch(&MirrorScratch, size);
+    switch (runsize) {
+        case BITMAP_ROW: {
+            // Stored relative to the first color, which becomes the last
+            uint64_t* bits = (uint64_t*)mirrored;
+            MirrorBits(bits, (const uint64_t*)runs, width);
+            if (num_runs % 2 == 0) {
+                for (size_t w = 0; w < ROW_WORDS(width); w++) bits[w] ^= ~0ull;
+                ClearPadding(bits, width);
+            }
+            break;
+        }
+        case 1:
+            for (uint32 k = 0; k < num_runs; k++)
+                mirrored[k] = runs[num_runs - 1 - k];
+            break;
+        case 2: {
+            const uint16* src = (const uint16*)runs;
+            for (uint32 k = 0; k < num_runs; k++)
+                ((uint16*)mirrored)[k] = src[num_runs - 1 - k];
+            break;
+        }
+        default: {
+            const uint32* src = (const uint32*)runs;
+            for (uint32 k = 0; k < num_runs; k++)
+                ((uint32*)mirrored)[k] = src[num_runs - 1 - k];
+            break;
+        }
+    }
+    return mirrored;
+}
+
+/// Count the pixels of the first color of a row of width pixels, with
+/// num_runs runs of runsize bytes at runs (or a packed bitmap).
+/// (The count does not depend on the color, so rows shared by images with
+/// different colors share it.)
+static uint32 CountFirst(uint32 width, const uint8* runs, uint32 num_runs,
+                         uint8 runsize) {
+    uint32 count = 0;
+    if (runsize == BITMAP_ROW) {
+        // Stored relative to the first color: its pixels are the 0 bits
+        const uint64_t* bits = (const uint64_t*)runs;
+        for (size_t w = 0; w < ROW_WORDS(width); w++) {
+            count += PopCount(bits[w]);
+        }
+        return width - count;
+    }
+    // Runs alternate colors: the even ones have the first color
+    for (uint32 k = 0; k < num_runs; k += 2) {
+        count += GetRun(runs, runsize, k);
+    }
+    return count;
 }
 
-/// Get the number of elements of an array storing a compressed RLE image row
-static uint32 GetSizeRLERowArray(const int* RLE_row) {
-    assert(RLE_row != NULL);
+/// Insert entry in the intern table (which must have a free slot)
+static void InternInsert(const InternEntry* entry) {
+    size_t mask = InternSlots - 1;
+    size_t k = entry->hash & mask;
+    while (InternTable[k].arena != NULL) k = (k + 1) & mask;
+    InternTable[k] = *entry;
+    InternCount++;
+}
 
-    // Go through the array until EOR is found
-    uint32 i = 0;
-    while (RLE_row[i] != EOR) {
-        i++;
+/// Free the Arena structures of the dead arenas, once their rows are no
+/// longer in the intern table
+static void FreeDeadArenas(void) {
+    while (DeadArenas != NULL) {
+        Arena* next = DeadArenas->next;
+        FreeBlock(DeadArenas, sizeof(Arena));
+        DeadArenas = next;
     }
+    InternDead = 0;
+}
 
-    return (i + 1);
+/// Rebuild the intern table, dropping the rows of dead arenas, with a
+/// quarter to a half of its slots used by the rows left (but at least
+/// INTERN_MIN_SLOTS slots).
+static void InternRehash(void) {
+    size_t live = InternCount - InternDead;
+    size_t slots = INTERN_MIN_SLOTS;
+    while (slots < 4 * (live + 1)) slots *= 2;
+    InternEntry* old = InternTable;
+    size_t old_slots = InternSlots;
+    InternTable = calloc(slots, sizeof(InternEntry));
+    check(InternTable != NULL, "calloc");
+    InternSlots = slots;
+    InternCount = 0;
+    for (size_t k = 0; k < old_slots; k++) {
+        if (old[k].arena != NULL && old[k].arena->refs > 0) {
+            InternInsert(&old[k]);
+        }
+    }
+    free(old);
+    FreeDeadArenas();
 }
 
-/// Compress into RLE format a RAW image row
-/// Allocates and returns the array storing the image row in RLE format
-static int* CompressRow(uint32 image_width, const uint8* RAW_row) {
-    assert(image_width > 0);
-    assert(RAW_row != NULL);
+/// Purge the rows of dead arenas from the intern table, and free them,
+/// once they are at least a quarter of its rows.
+/// As the table has at most 8 slots per row interned since it was last
+/// rebuilt, its rebuilds take O(1) amortized time per dead row.
+static void InternPurge(void) {
+    if (InternTable == NULL) {
+        FreeDeadArenas();
+    } else if (4 * InternDead >= InternCount && InternDead > 0) {
+        InternRehash();
+    }
+}
 
-    // How many runs?
-    uint32 num_runs = GetNumRunsInRAWRow(image_width, RAW_row);
+/// Reserve room for size bytes, aligned to align, at the end of the
+/// current intern chunk, starting a new chunk if it does not fit.
+/// Returns the address of the reserved bytes.
+static uint8* InternReserve(size_t size, size_t align) {
+    size_t offset = 0;
+    if (InternChunk != NULL) {
+        offset = (InternChunk->used + align - 1) / align * align;
+    }
+    if (InternChunk == NULL || offset + size > InternChunk->capacity) {
+        if (InternChunk != NULL) ReleaseArena(InternChunk);
+        InternPurge();
+        InternChunk = NewArena(size > INTERN_CHUNK_SIZE ? size
+                                                        : INTERN_CHUNK_SIZE);
+        offset = 0;
+    }
+    assert(offset + size <= UINT32_MAX);  // offsets are 32-bit
+    InternChunk->used = offset + size;
+    return InternChunk->data + offset;
+}
 
-    // Allocate the RLE row array
-    int* RLE_row = malloc((num_runs + 2) * sizeof(int));
-    check(RLE_row != NULL, "malloc");
-    
-    PIXMEM++;
-    // Go through the RAW_row
-    RLE_row[0] = (int)RAW_row[0];  // Initial pixel value
-    uint32 index = 1;
-    int num_pixels = 1;
-    for (uint32 i = 1; i < image_width; i++) {
-        if (RAW_row[i] != RAW_row[i - 1]) {
-            PIXMEM++;
-            RLE_row[index++] = num_pixels;
-            num_pixels = 0;
+/// Intern the row of width pixels, with num_runs runs of runsize bytes
+/// (or packed bitmap), of size bytes at data, with hash hash (see HashRow).
+/// If no identical row was interned yet, the row is copied to the intern
+/// chunk (and its pixels are counted).
+/// Returns the entry of the interned row.
+/// Requires: InternLock held.
+static InternEntry InternRow(uint32 width, const uint8* data, size_t size,
+                             uint32 num_runs, uint8 runsize, uint64_t hash) {
+    if (InternTable == NULL) InternRehash();
+    size_t mask = InternSlots - 1;
+    for (size_t k = hash & mask; InternTable[k].arena != NULL;
+         k = (k + 1) & mask) {
+        const InternEntry* entry = &InternTable[k];
+        if (entry->hash == hash && entry->nruns == num_runs &&
+            entry->runsize == runsize && entry->size == size &&
+            entry->width == width && entry->arena->refs > 0 &&
+            memcmp(entry->arena->data + entry->offset, data, size) == 0) {
+            INTERN_HIT++;
+            INTERN_SAVED += size;
+            return *entry;
         }
-        PIXMEM+=2;
-        num_pixels++;
-        
     }
-    RLE_row[index++] = num_pixels;
-    RLE_row[index] = EOR;  // Reached the end of the row
-    PIXMEM+=2;
-    return RLE_row;
+
+    // Not found: store a copy
+    // (bitmaps are aligned to words, runs to their width)
+    size_t align = runsize == BITMAP_ROW ? sizeof(uint64_t) : runsize;
+    uint8* copy = InternReserve(size, align);
+    memcpy(copy, data, size);
+    // The row descriptors keep the high bits of the hashes of both
+    // orientations of the row (see RowHash)
+    uint64_t mirrored = HashRow(MirrorRow(width, data, size, num_runs,
+                                          runsize), size, num_runs, runsize);
+    InternEntry entry = {hash, InternChunk,
+                         (uint32)(copy - InternChunk->data), (uint32)size,
+                         width, num_runs,
+                         CountFirst(width, data, num_runs, runsize), runsize,
+                         (uint32)(hash >> 48 << 16 | mirrored >> 48)};
+    // Rebuilt (grown, or just purged of dead rows) when half full
+    if (2 * (InternCount + 1) > InternSlots) InternRehash();
+    InternInsert(&entry);
+    InternChunk->interned++;
+    return entry;
+}
+
+/// Get the array of runs of row i of img
+/// (runs are img->row[i].runsize bytes each, or a packed bitmap)
+static inline const uint8* RowRuns(const Image img, uint32 i) {
+    return img->arena[img->row[i].arena]->data + img->row[i].offset;
 }
 
-static uint8* UncompressRow(uint32 image_width, const int* RLE_row) {
-    assert(image_width > 0);
-    assert(RLE_row != NULL);
+/// Index of the row of img stored for row i, as seen through its view
+static inline uint32 StoredRow(const Image img, uint32 i) {
+    return img->view & VIEW_FLIP_TB ? img->height - 1 - i : i;
+}
 
-    // The uncompressed row
-    uint8* row = (uint8*)malloc(image_width * sizeof(uint8));
-    check(row != NULL, "malloc");
+/// Get the descriptor of row i of img, as seen through its view
+/// (that of the row stored for it: its color is given by RowColor)
+static inline const RLERow* RowOf(const Image img, uint32 i) {
+    return &img->row[StoredRow(img, i)];
+}
 
-    // Go through the RLE_row until EOR is found
-    PIXMEM++;
-    int pixel_value = RLE_row[0];
-    uint32 i = 1;
-    uint32 dest_i = 0;
-    while (RLE_row[i] != EOR) {
-        PIXMEM++;
-        // For each run
-        for (int aux = 0; aux < RLE_row[i]; aux++) {
-            row[dest_i++] = (uint8)pixel_value;
-            PIXMEM +=2;
+/// Color of the first pixel of row i of img, as seen through its view
+static inline int RowColor(const Image img, uint32 i) {
+    const RLERow* row = RowOf(img, i);
+    int color = row->color ^ (img->view & VIEW_NEG);
+    if (img->view & VIEW_FLIP_LR) color ^= (row->nruns - 1) & 1;  // last run
+    return color;
+}
+
+/// Hash of the runs of row i of img, as seen through its view.
+/// The hash of a row descriptor has the high 16 bits of the hash of its
+/// runs (see HashRow) and, in its low half, those of the row mirrored:
+/// flipping left-right swaps the halves, without reading the runs.
+static inline uint32 RowHash(const Image img, uint32 i) {
+    uint32 hash = RowOf(img, i)->hash;
+    return img->view & VIEW_FLIP_LR ? hash >> 16 | hash << 16 : hash;
+}
+
+/// Get the packed bitmap of row i of img (a BITMAP_ROW)
+static inline const uint64_t* RowBits(const Image img, uint32 i) {
+    assert(img->row[i].runsize == BITMAP_ROW);
+    return (const uint64_t*)RowRuns(img, i);
+}
+
+/// Bytes taken by the runs (or bitmap) of row of an image with width pixels
+static inline size_t RowBytes(uint32 width, const RLERow* row) {
+    if (row->runsize == BITMAP_ROW) return ROW_WORDS(width) * sizeof(uint64_t);
+    return (size_t)row->nruns * row->runsize;
+}
+
+/// A row of width pixels and num_runs runs, the longest being max_run,
+/// is stored as a packed bitmap when that takes less memory than its runs
+static inline int UseBitmap(uint32 width, uint32 num_runs, uint32 max_run) {
+    return ROW_WORDS(width) * sizeof(uint64_t) <
+           (size_t)num_runs * RunSizeFor(max_run);
+}
+
+/// Intern the row of size bytes at data and make it row i of img.
+/// The color of the row was already set by BeginRLERow.
+static void StoreRow(Image img, uint32 i, const uint8* data, size_t size,
+                     uint32 num_runs, uint8 runsize) {
+    uint64_t hash = HashRow(data, size, num_runs, runsize);
+
+    LOCK_INTERN();
+    InternEntry entry = InternRow(img->width, data, size, num_runs, runsize,
+                                  hash);
+    uint16 arena = ShareArena(img, entry.arena);
+    img->bytes += size;
+    img->runs += num_runs;
+    uint32 first = entry.count;
+    img->black += img->row[i].color == BLACK ? first : img->width - first;
+    UNLOCK_INTERN();
+
+    img->row[i].offset = entry.offset;
+    img->row[i].nruns = num_runs;
+    img->row[i].runsize = runsize;
+    img->row[i].arena = arena;
+    img->row[i].hash = entry.row_hash;
+}
+
+// The runs of the row being built by the calling thread
+#define RowBuffer ((int*)RowScratch.data)
+
+/// Start writing row i of img, with first color color and at most
+/// max_runs runs.  Returns the address where the runs should be written,
+/// as plain ints.
+/// Rows must be written one at a time (by each thread), each one closed
+/// with EndRLERow, which encodes and interns them.
+static int* BeginRLERow(Image img, uint32 i, int color, uint32 max_runs) {
+    assert(i < img->height);
+    assert(max_runs > 0);
+    img->row[i].color = (uint8)color;
+    return GrowScratch(&RowScratch, max_runs * sizeof(int));
+}
+
+/// Finish writing row i of img, which ended up with num_runs runs,
+/// the longest being max_run.
+/// The runs are stored with the narrowest width that fits them all
+/// (or as a packed bitmap, if smaller), in the intern chunk holding the
+/// identical row, if there is one.
+static void EndRLERowMax(Image img, uint32 i, uint32 num_runs,
+                         uint32 max_run) {
+    assert(num_runs > 0);
+    if (UseBitmap(img->width, num_runs, max_run)) {
+        size_t size = ROW_WORDS(img->width) * sizeof(uint64_t);
+        uint64_t* bits = GrowScratch(&EncodeScratch, size);
+        // Stored relative to the first color, so the first bit is 0
+        PackRuns(bits, img->width, (const uint8*)RowBuffer, sizeof(int),
+                 num_runs, WHITE);
+        StoreRow(img, i, (const uint8*)bits, size, num_runs, BITMAP_ROW);
+        return;
+    }
+    uint8 runsize = RunSizeFor(max_run);
+
+    uint8* runs = GrowScratch(&EncodeScratch, (size_t)num_runs * runsize);
+    switch (runsize) {
+        case 1:
+            for (uint32 k = 0; k < num_runs; k++) runs[k] = (uint8)RowBuffer[k];
+            break;
+        case 2:
+            for (uint32 k = 0; k < num_runs; k++)
+                ((uint16*)runs)[k] = (uint16)RowBuffer[k];
+            break;
+        default:
+            memcpy(runs, RowBuffer, num_runs * sizeof(uint32));
+            break;
+    }
+    StoreRow(img, i, runs, (size_t)num_runs * runsize, num_runs, runsize);
+}
+
+/// Finish writing row i of img, which ended up with num_runs runs.
+static void EndRLERow(Image img, uint32 i, uint32 num_runs) {
+    uint32 max_run = 0;
+    for (uint32 k = 0; k < num_runs; k++) {
+        if ((uint32)RowBuffer[k] > max_run) max_run = (uint32)RowBuffer[k];
+    }
+    EndRLERowMax(img, i, num_runs, max_run);
+}
+
+/// Store the packed row of pixels in bits as row i of img.
+/// Dense rows are stored directly as bitmaps, others are converted to runs.
+static void EndBitmapRow(Image img, uint32 i, const uint64_t* bits) {
+    assert(i < img->height);
+    uint32 width = img->width;
+    size_t nwords = ROW_WORDS(width);
+    uint32 num_runs = CountRuns(bits, width);
+    int color = (int)(bits[0] & 1);
+    if (nwords * sizeof(uint64_t) < num_runs) {
+        // Smaller than even 1-byte runs: no need to find the runs
+        uint64_t* row = GrowScratch(&EncodeScratch,
+                                    nwords * sizeof(uint64_t));
+        uint64_t mask = -(uint64_t)color;
+        for (size_t w = 0; w < nwords; w++) row[w] = bits[w] ^ mask;
+        if (width % 64 != 0) {
+            row[nwords - 1] &= ~(uint64_t)0 >> (64 - width % 64);
         }
-        // Next run
-        i++;
-        pixel_value ^= 1;
+        img->row[i].color = (uint8)color;
+        StoreRow(img, i, (const uint8*)row, nwords * sizeof(uint64_t),
+                 num_runs, BITMAP_ROW);
+        return;
     }
-    PIXMEM++;
+    int* runs = BeginRLERow(img, i, color, num_runs);
+    uint32 max_run;
+    UnpackRuns(runs, bits, width, &max_run);
+    EndRLERowMax(img, i, num_runs, max_run);
+}
 
-    return row;
+/// Decode the runs of row i of img into dst, as plain ints (as seen
+/// through the view of img: the first one has color RowColor(img, i)).
+/// Its the users job to garantee there is enough space in dst.
+static void DecodeRLERow(int* dst, const Image img, uint32 i) {
+    i = StoredRow(img, i);
+    const uint8* runs = RowRuns(img, i);
+    uint32 num_runs = img->row[i].nruns;
+    uint32 max_run;
+    switch (img->row[i].runsize) {
+        case BITMAP_ROW:
+            UnpackRuns(dst, RowBits(img, i), img->width, &max_run);
+            break;
+        case 1:
+            for (uint32 k = 0; k < num_runs; k++) dst[k] = runs[k];
+            break;
+        case 2:
+            for (uint32 k = 0; k < num_runs; k++)
+                dst[k] = ((const uint16*)runs)[k];
+            break;
+        default:
+            memcpy(dst, runs, num_runs * sizeof(uint32));
+            break;
+    }
+    if (img->view & VIEW_FLIP_LR) {
+        for (uint32 k = 0, j = num_runs - 1; k < j; k++, j--) {
+            int run = dst[k];
+            dst[k] = dst[j];
+            dst[j] = run;
+        }
+    }
 }
 
 // Add your auxiliary functions here...
 
 /// Figures out what should be the last pixel of an uncompressed row
-/// if it is in its RLE compressed state. row isn't modified.
+/// if it is in its RLE compressed state, given the color of its first run.
 ///
 /// Implementation note: when the number of runs is odd the last pixel has the
 /// same color as the first one.
-int LastPixelRLE(const int* row, const int runs) {
-    assert(row != NULL); assert(runs > 0);
+int LastPixelRLE(const int color, const int runs) {
+    assert(runs > 0);
 
-    int lpixel = row[0];
+    int lpixel = color;
     if (runs % 2 == 0) {
         return ! lpixel;
     }
@@ -275,7 +1196,471 @@ int LastPixelRLE(const int* row, const int runs) {
 /// DEPRECATED.
 int ImageSizeChessBoard(const Image img) {
     assert(img != NULL);
-    return ((int) img->height) * (GetSizeRLERowArray(img->row[0])) * (sizeof(int)); 
+    return ((int) img->height) * (int)RowBytes(img->width, &img->row[0]);
+}
+
+/// Value of the boolean function op for pixel values p1 and p2.
+/// op is a truth table (see BOOL_AND, etc. in imageBW.h): bit (2*p1 + p2)
+/// of op is the result.
+static inline int BoolValue(uint8 op, int p1, int p2) {
+    return (op >> (p1 << 1 | p2)) & 1;
+}
+
+/// Apply the boolean function op to the rows row1 and row2 (of num_runs1
+/// and num_runs2 runs, with first colors color1 and color2), storing the
+/// result as row i of result.
+/// Works directly on the runs, in O(num_runs1 + num_runs2): the rows are
+/// merged into segments where both colors are constant, and consecutive
+/// segments with the same result are joined into a single run.
+static void BoolMergeRows(Image result, uint32 i, uint8 op,
+                          const int* row1, uint32 num_runs1, int color1,
+                          const int* row2, uint32 num_runs2, int color2) {
+    // A result row never has more runs than both operand rows together
+    int value = BoolValue(op, color1, color2);
+    int* result_row = BeginRLERow(result, i, value, num_runs1 + num_runs2);
+
+    PIXMEM += 2;
+    int run1 = row1[0], run2 = row2[0];
+    uint32 idx1 = 1, idx2 = 1;
+    uint32 res_index = 0;
+    result_row[0] = 0;
+    for (;;) {
+        int min_run = run1 < run2 ? run1 : run2;
+
+        BOOL_OP++;
+        int current = BoolValue(op, color1, color2);
+        if (current == value) {
+            result_row[res_index] += min_run;
+        } else {
+            result_row[++res_index] = min_run;
+            value = current;
+        }
+        PIXMEM++;
+
+        run1 -= min_run;
+        run2 -= min_run;
+
+        // Both rows have the same width, so they end together
+        if (run1 == 0) {
+            if (idx1 == num_runs1) break;
+            color1 ^= 1;
+            run1 = row1[idx1++];
+            PIXMEM++;
+        }
+        if (run2 == 0) {
+            color2 ^= 1;
+            run2 = row2[idx2++];
+            PIXMEM++;
+        }
+    }
+    assert(run2 == 0 && idx2 == num_runs2);
+
+    EndRLERow(result, i, res_index + 1);
+}
+
+/// Packed bitmap rows
+///
+/// Rows with many short runs (halftones, noise, fine chessboards) are
+/// handled faster as packed bitmaps: boolean operations process 64 pixels
+/// (or 256, with AVX2) at a time, with no branches.
+
+// A pair of rows is processed as bitmaps when one of them is stored as a
+// bitmap, or when they have more than width / DENSE_RUN_FACTOR runs
+// (measured: below that, merging the runs is faster)
+#define DENSE_RUN_FACTOR 8
+
+/// Clear the padding bits of the packed row of width pixels in bits
+static inline void ClearPadding(uint64_t* bits, uint32 width) {
+    if (width % 64 != 0) {
+        bits[ROW_WORDS(width) - 1] &= ~(uint64_t)0 >> (64 - width % 64);
+    }
+}
+
+/// Reverse the order of the bits of each byte of word
+static inline uint64_t ReverseByteBits(uint64_t word) {
+    word = (word >> 1 & 0x5555555555555555ull) |
+           (word & 0x5555555555555555ull) << 1;
+    word = (word >> 2 & 0x3333333333333333ull) |
+           (word & 0x3333333333333333ull) << 2;
+    word = (word >> 4 & 0x0F0F0F0F0F0F0F0Full) |
+           (word & 0x0F0F0F0F0F0F0F0Full) << 4;
+    return word;
+}
+
+/// Reverse the order of the bits of word
+static inline uint64_t ReverseBits(uint64_t word) {
+    word = ReverseByteBits(word);
+    word = (word >> 8 & 0x00FF00FF00FF00FFull) |
+           (word & 0x00FF00FF00FF00FFull) << 8;
+    word = (word >> 16 & 0x0000FFFF0000FFFFull) |
+           (word & 0x0000FFFF0000FFFFull) << 16;
+    return word >> 32 | word << 32;
+}
+
+/// Mirror the packed row of width pixels in src into dst (flip left-right).
+/// Requires: the padding bits of src are 0.
+static void MirrorBits(uint64_t* dst, const uint64_t* src, uint32 width) {
+    size_t nwords = ROW_WORDS(width);
+    uint32 pad = (uint32)(64 * nwords - width);
+    // Pixel x goes to 64 * nwords - 1 - x, then down by the padding
+    for (size_t w = 0; w < nwords; w++) {
+        uint64_t low = ReverseBits(src[nwords - 1 - w]);
+        uint64_t high = w + 1 < nwords ? ReverseBits(src[nwords - 2 - w]) : 0;
+        dst[w] = pad == 0 ? low : low >> pad | high << (64 - pad);
+    }
+}
+
+/// Pack the pixels of row i of img into the ROW_WORDS(width) words of bits
+/// (as seen through the view of img).
+/// Padding bits are WHITE (0).
+static void PackRow(uint64_t* bits, const Image img, uint32 i) {
+    uint32 width = img->width;
+    size_t nwords = ROW_WORDS(width);
+    uint64_t* dst = bits;
+    if (img->view & VIEW_FLIP_LR) {
+        // Packed as stored, then mirrored into bits
+        dst = GrowScratch(&ViewScratch, nwords * sizeof(uint64_t));
+    }
+    i = StoredRow(img, i);
+    int color = img->row[i].color ^ (img->view & VIEW_NEG);
+    if (img->row[i].runsize == BITMAP_ROW) {
+        // Stored relative to the first color
+        const uint64_t* row = RowBits(img, i);
+        uint64_t mask = -(uint64_t)color;
+        for (size_t w = 0; w < nwords; w++) dst[w] = row[w] ^ mask;
+        ClearPadding(dst, width);
+    } else {
+        PackRuns(dst, width, RowRuns(img, i), img->row[i].runsize,
+                 img->row[i].nruns, color);
+    }
+    if (dst != bits) MirrorBits(bits, dst, width);
+}
+
+#ifdef IMAGE_AVX2
+/// The first words of BoolWords, 4 at a time, with AVX2 (compiled for it,
+/// whatever the target of the rest, and only called if the CPU has it).
+/// m0..m3 are the masks of the minterms of the operation.
+/// Returns the number of words done.
+__attribute__((target("avx2")))
+static size_t BoolWordsAVX2(uint64_t* dst, const uint64_t* a,
+                            const uint64_t* b, size_t nwords, uint64_t m0,
+                            uint64_t m1, uint64_t m2, uint64_t m3) {
+    __m256i v0 = _mm256_set1_epi64x((long long)m0);
+    __m256i v1 = _mm256_set1_epi64x((long long)m1);
+    __m256i v2 = _mm256_set1_epi64x((long long)m2);
+    __m256i v3 = _mm256_set1_epi64x((long long)m3);
+    size_t w = 0;
+    for (; w + 4 <= nwords; w += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + w));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + w));
+        __m256i r = _mm256_or_si256(
+            _mm256_or_si256(_mm256_andnot_si256(_mm256_or_si256(x, y), v0),
+                            _mm256_and_si256(_mm256_andnot_si256(x, y), v1)),
+            _mm256_or_si256(_mm256_and_si256(_mm256_andnot_si256(y, x), v2),
+                            _mm256_and_si256(_mm256_and_si256(x, y), v3)));
+        _mm256_storeu_si256((__m256i*)(dst + w), r);
+    }
+    return w;
+}
+#endif
+
+/// dst = op(a, b), for nwords words of packed pixels
+static void BoolWords(uint64_t* dst, const uint64_t* a, const uint64_t* b,
+                      size_t nwords, uint8 op) {
+    // Select the minterms of the truth table with all-ones masks
+    uint64_t m0 = -(uint64_t)(op & 1);          // not a and not b
+    uint64_t m1 = -(uint64_t)((op >> 1) & 1);   // not a and b
+    uint64_t m2 = -(uint64_t)((op >> 2) & 1);   // a and not b
+    uint64_t m3 = -(uint64_t)((op >> 3) & 1);   // a and b
+    size_t w = 0;
+#ifdef IMAGE_AVX2
+    if (nwords >= 4 && __builtin_cpu_supports("avx2")) {
+        w = BoolWordsAVX2(dst, a, b, nwords, m0, m1, m2, m3);
+    }
+#endif
+    for (; w < nwords; w++) {
+        uint64_t x = a[w], y = b[w];
+        dst[w] = (m0 & ~(x | y)) | (m1 & ~x & y) | (m2 & x & ~y) |
+                 (m3 & x & y);
+    }
+}
+
+/// Parallel execution of rows
+
+// Rows of the result of most operations are computed independently, so
+// they may be split among several threads: a pool of NumThreads - 1
+// workers, plus the thread calling the operation, which takes part.
+// The library is still meant to be called from a single thread: only the
+// rows of one operation at a time run in parallel.
+
+// Function computing row i of the result of a job
+typedef void (*RowFunc)(void* job, uint32 i);
+
+// Estimated cost of a row, besides its runs (or words)
+#define ROW_COST 8
+
+// Rows not yet taken by any thread, from next to end (exclusive)
+typedef struct {
+#ifdef IMAGE_THREADS
+    pthread_mutex_t lock;
+#endif
+    uint32 next;
+    uint32 end;
+} RowRange;
+
+// Rows of an operation being run by the pool
+typedef struct {
+    RowFunc func;
+    void* job;
+    const uint64_t* weight;  // weight[i]: cost of rows 0 to i-1
+    RowRange* range;         // the rows of each thread
+    int nthreads;
+} RowJob;
+
+static int NumThreads = 1;  // threads running rows, including the caller
+
+/// Estimated cost of row i of img
+static inline uint64_t RowWeight(const Image img, uint32 i) {
+    const RLERow* row = RowOf(img, i);
+    if (row->runsize == BITMAP_ROW) return ROW_WORDS(img->width);
+    return row->nruns;
+}
+
+/// First row j in [lo, hi] such that the rows before j weigh at least
+/// target (hi if none).
+static uint32 WeightedRow(const uint64_t* weight, uint32 lo, uint32 hi,
+                          uint64_t target) {
+    while (lo < hi) {
+        uint32 mid = lo + (hi - lo) / 2;
+        if (weight[mid] < target) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+#ifdef IMAGE_THREADS
+
+static pthread_t* Workers = NULL;  // the NumThreads - 1 workers
+static pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t PoolWake = PTHREAD_COND_INITIALIZER;  // new job
+static pthread_cond_t PoolDone = PTHREAD_COND_INITIALIZER;  // job done
+static RowJob* PoolJob = NULL;           // current job
+static unsigned long PoolGeneration = 0; // number of jobs started
+static int PoolBusy = 0;                 // workers still in PoolJob
+static int PoolStop = 0;                 // whether workers must exit
+
+/// Take the next rows of range, [*first, *last), for the calling thread.
+/// Rows are taken in chunks of 1/8 of the remaining weight, so that there
+/// are few chunks, but the last ones are small.
+/// Returns 0 if there are none left.
+static int TakeRows(RowRange* range, const uint64_t* weight,
+                    uint32* first, uint32* last) {
+    pthread_mutex_lock(&range->lock);
+    int found = range->next < range->end;
+    if (found) {
+        uint64_t left = weight[range->end] - weight[range->next];
+        uint64_t target = weight[range->next] + (left + 7) / 8;
+        uint32 j = WeightedRow(weight, range->next + 1, range->end, target);
+        *first = range->next;
+        *last = range->next = j;
+    }
+    pthread_mutex_unlock(&range->lock);
+    return found;
+}
+
+/// Move to the range of thread self the second half (by weight) of the rows
+/// left in the range of the thread with the most weight left.
+/// Returns 0 if there are no rows left in any range.
+static int StealRows(RowJob* job, int self) {
+    const uint64_t* weight = job->weight;
+    for (;;) {
+        int victim = -1;
+        uint64_t most = 0;
+        for (int t = 0; t < job->nthreads; t++) {
+            RowRange* range = &job->range[t];
+            pthread_mutex_lock(&range->lock);
+            uint64_t left = weight[range->end] - weight[range->next];
+            if (range->next < range->end && (victim < 0 || left > most)) {
+                victim = t;
+                most = left;
+            }
+            pthread_mutex_unlock(&range->lock);
+        }
+        if (victim < 0) return 0;
+
+        // The victim may have taken rows meanwhile: look again
+        RowRange* range = &job->range[victim];
+        pthread_mutex_lock(&range->lock);
+        uint32 next = range->next, end = range->end;
+        uint32 mid = end;
+        if (next < end) {
+            uint64_t half = weight[next] + (weight[end] - weight[next]) / 2;
+            mid = WeightedRow(weight, next, end - 1, half);
+            range->end = mid;
+        }
+        pthread_mutex_unlock(&range->lock);
+        if (mid == end) continue;
+
+        RowRange* own = &job->range[self];
+        pthread_mutex_lock(&own->lock);
+        own->next = mid;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        return 1;
+    }
+}
+
+/// Run rows of job as thread self until there are none left,
+/// first from its own range, then stolen from others.
+static void RunRowJob(RowJob* job, int self) {
+    // Count on our own, to avoid contention on InstrCount
+    unsigned long counts[NUMCOUNTERS] = {0};
+    Counters = counts;
+
+    uint32 first, last;
+    do {
+        while (TakeRows(&job->range[self], job->weight, &first, &last)) {
+            for (uint32 i = first; i < last; i++) job->func(job->job, i);
+        }
+    } while (StealRows(job, self));
+
+    Counters = InstrCount;
+    pthread_mutex_lock(&PoolLock);
+    for (int k = 0; k < NUMCOUNTERS; k++) InstrCount[k] += counts[k];
+    pthread_mutex_unlock(&PoolLock);
+}
+
+/// Main function of a worker of the pool: run the rows of every new job,
+/// until told to stop.
+static void* WorkerMain(void* arg) {
+    int self = (int)(intptr_t)arg;
+    unsigned long seen = 0;  // jobs seen (PoolGeneration is reset to 0)
+    for (;;) {
+        pthread_mutex_lock(&PoolLock);
+        while (!PoolStop && PoolGeneration == seen) {
+            pthread_cond_wait(&PoolWake, &PoolLock);
+        }
+        if (PoolStop) {
+            pthread_mutex_unlock(&PoolLock);
+            break;
+        }
+        seen = PoolGeneration;
+        RowJob* job = PoolJob;
+        pthread_mutex_unlock(&PoolLock);
+
+        RunRowJob(job, self);
+
+        pthread_mutex_lock(&PoolLock);
+        if (--PoolBusy == 0) pthread_cond_signal(&PoolDone);
+        pthread_mutex_unlock(&PoolLock);
+    }
+    FreeScratch();
+    SpillAllBlocks();
+    return NULL;
+}
+
+#endif  // IMAGE_THREADS
+
+/// Compute rows 0 to height-1 of the result of an operation,
+/// calling func(job, i) for each row i, in parallel if there are threads.
+/// The rows are split in contiguous ranges of about the same cost, one
+/// for each thread, estimated from the runs (or words) of the rows of the
+/// noperands images in operands, and threads that finish their range
+/// steal the rows left by others.
+static void ParallelRows(uint32 height, const Image* operands,
+                         int noperands, RowFunc func, void* job) {
+#ifdef IMAGE_THREADS
+    if (NumThreads > 1 && height > 1) {
+        int nthreads = NumThreads;
+        uint64_t* weight = malloc(((size_t)height + 1) * sizeof(uint64_t));
+        check(weight != NULL, "malloc");
+        RowRange* range = malloc(nthreads * sizeof(RowRange));
+        check(range != NULL, "malloc");
+
+        weight[0] = 0;
+        for (uint32 i = 0; i < height; i++) {
+            weight[i + 1] = weight[i] + ROW_COST;
+            for (int k = 0; k < noperands; k++) {
+                weight[i + 1] += RowWeight(operands[k], i);
+            }
+        }
+        uint32 first = 0;
+        for (int t = 0; t < nthreads; t++) {
+            uint64_t target = weight[height] * (t + 1) / nthreads;
+            uint32 last = WeightedRow(weight, first, height, target);
+            pthread_mutex_init(&range[t].lock, NULL);
+            range[t].next = first;
+            range[t].end = last;
+            first = last;
+        }
+
+        RowJob rows = {func, job, weight, range, nthreads};
+        pthread_mutex_lock(&PoolLock);
+        PoolJob = &rows;
+        PoolBusy = nthreads - 1;
+        PoolGeneration++;
+        pthread_cond_broadcast(&PoolWake);
+        pthread_mutex_unlock(&PoolLock);
+
+        RunRowJob(&rows, 0);
+
+        pthread_mutex_lock(&PoolLock);
+        while (PoolBusy > 0) pthread_cond_wait(&PoolDone, &PoolLock);
+        PoolJob = NULL;
+        pthread_mutex_unlock(&PoolLock);
+
+        for (int t = 0; t < nthreads; t++) {
+            pthread_mutex_destroy(&range[t].lock);
+        }
+        free(range);
+        free(weight);
+        return;
+    }
+#else
+    (void)operands;
+    (void)noperands;
+#endif
+    for (uint32 i = 0; i < height; i++) func(job, i);
+}
+
+/// Set the number of threads used by operations (see imageBW.h)
+void ImageSetThreads(int nthreads) {
+    assert(nthreads >= 1);
+#ifdef IMAGE_THREADS
+    // Stop the current workers
+    pthread_mutex_lock(&PoolLock);
+    PoolStop = 1;
+    pthread_cond_broadcast(&PoolWake);
+    pthread_mutex_unlock(&PoolLock);
+    for (int t = 1; t < NumThreads; t++) pthread_join(Workers[t - 1], NULL);
+    free(Workers);
+    Workers = NULL;
+    PoolStop = 0;
+    PoolGeneration = 0;
+
+    // Start the new ones
+    NumThreads = 1;
+    if (nthreads > 1) {
+        Workers = malloc((nthreads - 1) * sizeof(pthread_t));
+        check(Workers != NULL, "malloc");
+        for (int t = 1; t < nthreads; t++) {
+            errno = pthread_create(&Workers[t - 1], NULL, WorkerMain,
+                                   (void*)(intptr_t)t);
+            check(errno == 0, "pthread_create");
+            NumThreads++;
+        }
+    }
+#else
+    (void)nthreads;
+#endif
+}
+
+/// Get the number of threads used by operations
+int ImageGetThreads(void) {
+    return NumThreads;
 }
 
 /// Image management functions
@@ -292,18 +1677,17 @@ Image ImageCreate(uint32 width, uint32 height, uint8 val) {
     assert(width > 0 && height > 0);
     assert(val == WHITE || val == BLACK);
 
+    // Each row has a single run [length], all rows are the same interned row
     Image newImage = AllocateImageHeader(width, height);
 
     // All image pixels have the same value
     int pixel_value = (int)val;
 
     // Creating the image rows, each row has just 1 run of pixels
-    // Each row is represented by an array of 3 elements [value,length,EOR]
     for (uint32 i = 0; i < height; i++) {
-        newImage->row[i] = AllocateRLERowArray(3);
-        newImage->row[i][0] = pixel_value;
-        newImage->row[i][1] = (int)width;
-        newImage->row[i][2] = EOR;
+        int* runs = BeginRLERow(newImage, i, pixel_value, 1);
+        runs[0] = (int)width;
+        EndRLERow(newImage, i, 1);
     }
 
     return newImage;
@@ -330,40 +1714,43 @@ Image ImageCreateChessboard(uint32 width, uint32 height, uint32 square_edge,
     assert(height % square_edge == 0 && width % square_edge == 0);
     assert(first_value == WHITE || first_value == BLACK);
 
-    Image chessImage = AllocateImageHeader(width, height);
-
     // Number of runs
     uint32 n_runs = width / square_edge;
 
+    // Each row takes n_runs runs, but there are only two distinct rows,
+    // and they are interned
+    Image chessImage = AllocateImageHeader(width, height);
+
     // Each line
     for (uint32 i = 0; i < height; i++) {
-        uint32 rle_row_size = n_runs + 2;
-        chessImage->row[i] = AllocateRLERowArray(rle_row_size);
-
         // First Value
+        int color;
         if ((i / square_edge) % 2 == 0) {
-            chessImage->row[i][0] = first_value;  
+            color = first_value;
         } else {
             
             if (first_value == WHITE) {
-                chessImage->row[i][0] = BLACK;
+                color = BLACK;
             } else {
-                chessImage->row[i][0] = WHITE;
+                color = WHITE;
             }
         }
+        int* runs = BeginRLERow(chessImage, i, color, n_runs);
 
         // Fill the lengths of the squares
         for (uint32 j = 0; j < n_runs; j++) {
-            chessImage->row[i][j + 1] = square_edge;
+            runs[j] = square_edge;
         }
 
         // The end of the line
-        chessImage->row[i][n_runs + 1] = EOR;
+        EndRLERow(chessImage, i, n_runs);
     }
 
     return chessImage;
 }
 
+static void DropPixelIndex(Image img);
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -373,16 +1760,48 @@ void ImageDestroy(Image* imgp) {
     assert(imgp != NULL);
 
     Image img = *imgp;
-
-    for (uint32 i = 0; i < img->height; i++) {
-        free(img->row[i]);
+    if (img == NULL) return;
+
+    DropPixelIndex(img);
+    // The row table is a single block, and the arenas may still be
+    // referenced by other images (the table and arena list too, if they
+    // are shared with views)
+    if (img->shared == NULL || --*img->shared == 0) {
+        FreeBlock(img->shared, sizeof(uint32));
+        for (uint32 k = 0; k < img->narenas; k++) {
+            ReleaseArena(img->arena[k]);
+        }
+        FreeBlock(img->arena, ArenaListSize(img->narenas));
+        if (!img->mapped) FreeBlock(img->row, RowTableSize(img->height));
     }
-    free(img->row);
-    free(img);
+    FreeBlock(img, sizeof(struct image));
+    // Forget the interned rows no longer used by any image
+    InternPurge();
 
     *imgp = NULL;
 }
 
+void ImageReleaseMemory(void) {
+    // The current intern chunk is the only arena left
+    if (InternChunk != NULL) ReleaseArena(InternChunk);
+    InternChunk = NULL;
+    free(InternTable);
+    InternTable = NULL;
+    InternSlots = 0;
+    InternCount = 0;
+    FreeDeadArenas();
+    FreeScratch();
+
+    LOCK_BLOCKS();
+    for (size_t k = 0; k < NumSlabs; k++) free(Slabs[k]);
+    free(Slabs);
+    Slabs = NULL;
+    NumSlabs = 0;
+    memset(SharedBlocks, 0, sizeof(SharedBlocks));
+    BlockEpoch++;  // the free lists of every thread are now invalid
+    UNLOCK_BLOCKS();
+}
+
 /// Printing on the console
 
 /// Output the raw BW image
@@ -392,13 +1811,18 @@ void ImageRAWPrint(const Image img) {
     printf("width = %d height = %d\n", img->width, img->height);
     printf("RAW image:\n");
 
+    // A row has at most width runs
+    int* runs = malloc((size_t)img->width * sizeof(int));
+    check(runs != NULL, "malloc");
+
     // Print the pixels of each image row
     for (uint32 i = 0; i < img->height; i++) {
+        DecodeRLERow(runs, img, i);
         // The value of the first pixel in the current row
-        int pixel_value = img->row[i][0];
-        for (uint32 j = 1; img->row[i][j] != EOR; j++) {
+        int pixel_value = RowColor(img, i);
+        for (uint32 j = 0; j < RowOf(img, i)->nruns; j++) {
             // Print the current run of pixels
-            for (int k = 0; k < img->row[i][j]; k++) {
+            for (int k = 0; k < runs[j]; k++) {
                 printf("%d", pixel_value);
             }
             // Switch (XOR) to the pixel value for the next run, if any
@@ -408,6 +1832,7 @@ void ImageRAWPrint(const Image img) {
         printf("\n");
     }
     printf("\n");
+    free(runs);
 }
 
 /// Output the compressed RLE image
@@ -417,100 +1842,491 @@ void ImageRLEPrint(const Image img) {
     printf("width = %d height = %d\n", img->width, img->height);
     printf("RLE encoding:\n");
 
+    // A row has at most width runs
+    int* runs = malloc((size_t)img->width * sizeof(int));
+    check(runs != NULL, "malloc");
+
     // Print the compressed rows information
     for (uint32 i = 0; i < img->height; i++) {
-        uint32 j;
-        for (j = 0; img->row[i][j] != EOR; j++) {
-            printf("%d ", img->row[i][j]);
+        DecodeRLERow(runs, img, i);
+        printf("%d ", RowColor(img, i));
+        for (uint32 j = 0; j < RowOf(img, i)->nruns; j++) {
+            printf("%d ", runs[j]);
         }
-        printf("%d\n", img->row[i][j]);
+        printf("%d\n", EOR);
     }
     printf("\n");
+    free(runs);
 }
 
 /// PBM BW file operations
 
 // See PBM format specification: http://netpbm.sourceforge.net/doc/pbm.html
 
-// Auxiliary function
-static void unpackBits(int nbytes, const uint8 bytes[], uint8 raw_row[]) {
-    // bitmask starts at top bit
-    int offset = 0;
-    uint8 mask = 1 << (7 - offset);
-    while (offset < 8) {  // or (mask > 0)
-        for (int b = 0; b < nbytes; b++) {
-            raw_row[8 * b + offset] = (bytes[b] & mask) != 0;
-        }
-        mask >>= 1;
-        offset++;
-    }
+// Contents of a whole file, in memory
+typedef struct {
+    const uint8* data;
+    size_t size;
+    int mapped;  // whether data is mapped (or was read into a buffer)
+} FileData;
+
+/// Whether the file named filename can be read at any position (otherwise,
+/// e.g. for a pipe or a terminal, it can only be read in order).
+static int IsSeekableFile(const char* filename) {
+#if defined(__linux__) || defined(__APPLE__)
+    struct stat st;
+    check(stat(filename, &st) == 0, "Open failed");
+    return S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+#else
+    (void)filename;
+    return 1;
+#endif
 }
 
-// Auxiliary function
-static void packBits(int nbytes, uint8 bytes[], const uint8 raw_row[]) {
-    // bitmask starts at top bit
-    int offset = 0;
-    uint8 mask = 1 << (7 - offset);
-    while (offset < 8) {  // or (mask > 0)
-        for (int b = 0; b < nbytes; b++) {
-            if (offset == 0) bytes[b] = 0;
-            bytes[b] |= raw_row[8 * b + offset] ? mask : 0;
-        }
-        mask >>= 1;
-        offset++;
+/// Map the file named filename into memory, if possible.
+/// Returns whether it was mapped (otherwise, *file is not modified).
+static int MapFileData(const char* filename, FileData* file) {
+#if defined(__linux__) || defined(__APPLE__)
+    // (Pipes are not opened here, as they could be opened only once)
+    if (!IsSeekableFile(filename)) return 0;
+    int fd = open(filename, O_RDONLY);
+    check(fd >= 0, "Open failed");
+    struct stat st;
+    check(fstat(fd, &st) == 0, "Open failed");
+    size_t size = (size_t)st.st_size;
+    void* data = MAP_FAILED;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
     }
+    close(fd);
+    if (data == MAP_FAILED) return 0;
+    madvise(data, size, MADV_SEQUENTIAL);
+    file->data = data;
+    file->size = size;
+    file->mapped = 1;
+    return 1;
+#else
+    (void)filename;
+    (void)file;
+    return 0;
+#endif
 }
 
-// Match and skip 0 or more comment lines in file f.
-// Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE* f) {
-    char c;
-    int i = 0;
-    while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-        i++;
+// Bytes read at first from files of unknown size (e.g., pipes)
+#define READ_CHUNK_SIZE (1 << 16)
+
+/// Read file f from its current position to its end, after the nhead
+/// bytes in head (already read from it).
+/// If its size is known (it can be seeked), it is read in a single block;
+/// otherwise (e.g., a pipe), it is read in order into a growing buffer.
+static FileData ReadStream(FILE* f, const uint8* head, size_t nhead) {
+    size_t capacity = nhead + READ_CHUNK_SIZE;
+    long here = ftell(f);
+    if (here >= 0 && fseek(f, 0, SEEK_END) == 0) {
+        long end = ftell(f);
+        check(end >= here && fseek(f, here, SEEK_SET) == 0, "Reading file");
+        // +1: the end is seen at once
+        capacity = nhead + (size_t)(end - here) + 1;
+    } else {
+        check(errno == ESPIPE, "Reading file");
+        clearerr(f);
     }
-    return i;
+    uint8* data = malloc(capacity);
+    check(data != NULL, "malloc");
+    memcpy(data, head, nhead);
+    size_t size = nhead;
+    for (;;) {
+        size += fread(data + size, 1, capacity - size, f);
+        if (size < capacity) break;
+        capacity *= 2;
+        uint8* grown = realloc(data, capacity);
+        check(grown != NULL, "realloc");
+        data = grown;
+    }
+    check(!ferror(f), "Reading file");
+    FileData file = {data, size, 0};
+    return file;
 }
 
-/// Load a raw PBM file.
-/// Only binary PBM files are accepted.
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-Image ImageLoad(const char* filename) {  ///
-    int w, h;
-    char c;
+/// Get the contents of the file named filename.
+/// The file is mapped into memory where possible, otherwise it is read
+/// (see ReadStream).
+static FileData ReadFileData(const char* filename) {
+    FileData file = {NULL, 0, 0};
+    if (MapFileData(filename, &file)) return file;
+    // Not mappable: read it
     FILE* f = NULL;
-    Image img = NULL;
+    check((f = fopen(filename, "rb")) != NULL, "Open failed");
+    file = ReadStream(f, NULL, 0);
+    fclose(f);
+    return file;
+}
+
+/// Release the contents of a file obtained with ReadFileData
+static void ReleaseFileData(FileData file) {
+#if defined(__linux__) || defined(__APPLE__)
+    if (file.mapped) {
+        munmap((void*)file.data, file.size);
+        return;
+    }
+#endif
+    free((void*)file.data);
+}
+
+// Native RLE files (see ImageLoadRLE)
+static int IsRLEFile(FileData file);
+static Image MapRLEImage(FileData file);
+
+// Match and skip whitespace and 0 or more comment lines in file.
+// Comments start with a # and continue until the end-of-line, inclusive.
+static void skipComments(FileData file, size_t* pos) {
+    for (;;) {
+        while (*pos < file.size && isspace(file.data[*pos])) (*pos)++;
+        if (*pos == file.size || file.data[*pos] != '#') return;
+        while (*pos < file.size && file.data[*pos] != '\n') (*pos)++;
+    }
+}
+
+// Parse a non-negative decimal number at *pos of file.
+// Returns -1 if there is none (or it is too large).
+static int parseNumber(FileData file, size_t* pos) {
+    if (*pos == file.size || !isdigit(file.data[*pos])) return -1;
+    long value = 0;
+    while (*pos < file.size && isdigit(file.data[*pos])) {
+        value = 10 * value + (file.data[(*pos)++] - '0');
+        if (value > INT32_MAX) return -1;
+    }
+    return (int)value;
+}
+
+// Parse the header of the PBM file in file, storing its width and height
+// in *w and *h.
+// Returns the position of the first row of pixels, or 0 if the header does
+// not end in file (file may be its beginning only).
+static size_t parsePBMHeader(FileData file, int* w, int* h) {
+    if (file.size < 2) return 0;
+    checkError(file.data[0] == 'P' && file.data[1] == '4',
+               "Invalid file format", EINVAL);
+    size_t pos = 2;
+    skipComments(file, &pos);
+    *w = parseNumber(file, &pos);
+    if (pos == file.size) return 0;
+    checkError(*w >= 0, "Invalid width", EINVAL);
+    skipComments(file, &pos);
+    *h = parseNumber(file, &pos);
+    if (pos == file.size) return 0;
+    checkError(*h >= 0, "Invalid height", EINVAL);
+    checkError(isspace(file.data[pos]), "Whitespace expected", EINVAL);
+    return pos + 1;
+}
+
+/// Load little-endian 64-bit word from bytes
+static inline uint64_t LoadLE64(const uint8* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/// Store 64-bit word in bytes, little-endian
+static inline void StoreLE64(uint8* bytes, uint64_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(bytes, &word, sizeof(word));
+}
+
+/// Convert the nbytes bytes of a PBM row (first pixel in the top bit of
+/// each byte) into a packed row, in bits (first pixel in bit 0).
+/// bits must have room for ROW_WORDS(8 * nbytes) words.
+static void PBMRowToBits(uint64_t* bits, const uint8* bytes, size_t nbytes) {
+    size_t w = 0;
+    for (; 8 * (w + 1) <= nbytes; w++) {
+        bits[w] = ReverseByteBits(LoadLE64(bytes + 8 * w));
+    }
+    if (8 * w < nbytes) {
+        // Last partial word
+        uint8 tail[8] = {0};
+        memcpy(tail, bytes + 8 * w, nbytes - 8 * w);
+        PBMRowToBits(bits + w, tail, 8);
+    }
+}
+
+/// Convert a packed row (first pixel in bit 0) into the nbytes bytes of a
+/// PBM row (first pixel in the top bit of each byte).
+static void BitsToPBMRow(uint8* bytes, const uint64_t* bits, size_t nbytes) {
+    size_t w = 0;
+    for (; 8 * (w + 1) <= nbytes; w++) {
+        StoreLE64(bytes + 8 * w, ReverseByteBits(bits[w]));
+    }
+    if (8 * w < nbytes) {
+        // Last partial word
+        uint8 tail[8];
+        StoreLE64(tail, ReverseByteBits(bits[w]));
+        memcpy(bytes + 8 * w, tail, nbytes - 8 * w);
+    }
+}
+
+/// Read size bytes at position pos of file f into buffer.
+/// May be called by several threads at once, for the same file.
+static void ReadAt(FILE* f, void* buffer, size_t size, size_t pos) {
+#if defined(__linux__) || defined(__APPLE__)
+    uint8* bytes = buffer;
+    while (size > 0) {
+        ssize_t n = pread(fileno(f), bytes, size, (off_t)pos);
+        checkError(n > 0, "Reading pixels", n == 0 ? ENODATA : errno);
+        bytes += n;
+        pos += (size_t)n;
+        size -= (size_t)n;
+    }
+#else
+    check(fseek(f, (long)pos, SEEK_SET) == 0, "Reading pixels");
+    checkError(fread(buffer, 1, size, f) == size, "Reading pixels",
+               ferror(f) ? errno : ENODATA);
+#endif
+}
+
+// Bytes read with the header of a PBM file by OpenPBMFile
+// (twice as many are read while a longer header does not end)
+#define PBM_HEADER_SIZE 4096
 
+// Bytes of rows read at a time from files that can only be read in order
+#define LOAD_BUFFER_SIZE (1 << 20)
+
+// A PBM file whose rows are read from the file (not mapped), see
+// OpenPBMFile
+typedef struct {
+    FILE* f;
+    int w, h;
+    size_t pixels;     // position of the first row in the file
+    int in_order;      // whether the file can only be read in order (e.g.,
+                       // a pipe): then its rows are read with ReadInOrder
+    uint8* head;       // bytes read with the header
+    size_t head_size;  // (some of them may be of the rows)
+    size_t next;       // position in head of the next byte to read
+} PBMFile;
+
+/// Open the file named filename and parse its header, without reading the
+/// pixels (but those read with the header).
+/// Returns whether it is a PBM file, then open in *pbm, with all the pixels
+/// there (if the size of the file is known).
+/// Otherwise, it is a native RLE file, and its contents are in *rle.
+static int OpenPBMFile(const char* filename, PBMFile* pbm, FileData* rle) {
+    FILE* f = NULL;
     check((f = fopen(filename, "rb")) != NULL, "Open failed");
+    pbm->f = f;
+    pbm->in_order = !IsSeekableFile(filename);
+
     // Parse PBM header
-    check(fscanf(f, "P%c ", &c) == 1 && c == '4', "Invalid file format");
-    skipComments(f);
-    check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width");
-    skipComments(f);
-    check(fscanf(f, "%d", &h) == 1 && h >= 0, "Invalid height");
-    check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected");
+    pbm->head = NULL;
+    pbm->head_size = 0;
+    size_t capacity = PBM_HEADER_SIZE;
+    size_t pos;
+    for (;;) {
+        uint8* grown = realloc(pbm->head, capacity);
+        check(grown != NULL, "realloc");
+        pbm->head = grown;
+        pbm->head_size += fread(pbm->head + pbm->head_size, 1,
+                                capacity - pbm->head_size, f);
+        FileData file = {pbm->head, pbm->head_size, 0};
+        if (IsRLEFile(file)) {
+            // Mapped, if possible (otherwise read, and the file is in order)
+            *rle = pbm->in_order ? ReadStream(f, pbm->head, pbm->head_size)
+                                 : ReadFileData(filename);
+            fclose(f);
+            free(pbm->head);
+            return 0;
+        }
+        pos = parsePBMHeader(file, &pbm->w, &pbm->h);
+        if (pos > 0 || pbm->head_size < capacity) break;  // or file ended
+        capacity *= 2;
+    }
+    checkError(pos > 0, "Invalid file format", EINVAL);
+    pbm->pixels = pos;
+    pbm->next = pos;
+
+    if (!pbm->in_order) {
+        // Check that all the pixels are there
+        size_t nbytes = ((size_t)pbm->w + 8 - 1) / 8;  // bytes of each row
+        check(fseek(f, 0, SEEK_END) == 0, "Reading file");
+        long size = ftell(f);
+        check(size >= 0, "Reading file");
+        checkError((size_t)size - pos >= nbytes * (size_t)pbm->h,
+                   "Reading pixels", ENODATA);
+    }
+    return 1;
+}
+
+/// Read the next size bytes of the rows of pbm, which is read in order,
+/// into buffer.
+static void ReadInOrder(PBMFile* pbm, uint8* buffer, size_t size) {
+    size_t n = pbm->head_size - pbm->next;  // read with the header
+    if (n > size) n = size;
+    memcpy(buffer, pbm->head + pbm->next, n);
+    pbm->next += n;
+    checkError(fread(buffer + n, 1, size - n, pbm->f) == size - n,
+               "Reading pixels", ferror(pbm->f) ? errno : ENODATA);
+}
+
+// Pixels of a PBM file being loaded, see ImageLoad
+typedef struct {
+    Image img;
+    const uint8* pixels;  // the bytes of row first, if in memory
+    uint32 first;
+    size_t nbytes;        // bytes of each row
+    FILE* file;           // otherwise, the file, read a row at a time
+    size_t pos;           // and the position of the first row in it
+} LoadJob;
+
+/// Load row first + i of the image of job
+static void LoadRow(void* job, uint32 i) {
+    const LoadJob* load_job = job;
+    Image img = load_job->img;
+    uint64_t* bits = GrowScratch(&BitsScratch,
+                                 ROW_WORDS(img->width) * sizeof(uint64_t));
+    size_t nbytes = load_job->nbytes;
+    if (load_job->pixels != NULL) {
+        PBMRowToBits(bits, load_job->pixels + i * nbytes, nbytes);
+    } else {
+        // Rows have a fixed size, so each thread reads its own rows
+        ReadAt(load_job->file, bits, nbytes, load_job->pos + i * nbytes);
+        PBMRowToBits(bits, (const uint8*)bits, nbytes);  // in place
+    }
+    EndBitmapRow(img, load_job->first + i, bits);
+}
 
-    // Allocate image
-    img = AllocateImageHeader(w, h);
+/// Load the image of the PBM file pbm, and close it.
+static Image LoadPBMFile(PBMFile* pbm) {
+    // Allocate image (rows are interned as they are loaded)
+    Image img = AllocateImageHeader(pbm->w, pbm->h);
 
     // Read pixels
-    int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-    // using VLAs...
-    uint8 bytes[nbytes];
-    uint8 raw_row[nbytes * 8];
-    for (uint32 i = 0; i < img->height; i++) {
-        check(fread(bytes, sizeof(uint8), nbytes, f) == (size_t)nbytes,
-              "Reading pixels");
-        unpackBits(nbytes, bytes, raw_row);
-        img->row[i] = CompressRow(w, raw_row);
+    size_t nbytes = ((size_t)pbm->w + 8 - 1) / 8;  // bytes of each row
+    LoadJob job = {img, NULL, 0, nbytes, pbm->f, pbm->pixels};
+    if (!pbm->in_order) {
+        ParallelRows(img->height, NULL, 0, LoadRow, &job);
+    } else {
+        // A band of rows at a time: read in order, then converted
+        size_t band = nbytes > 0 && LOAD_BUFFER_SIZE / nbytes > 0
+                      ? LOAD_BUFFER_SIZE / nbytes : 1;
+        uint8* buffer = malloc(band * nbytes + 1);  // (+1: no 0 size)
+        check(buffer != NULL, "malloc");
+        job.pixels = buffer;
+        for (; job.first < img->height; job.first += band) {
+            uint32 rows = img->height - job.first < band
+                          ? img->height - job.first : (uint32)band;
+            ReadInOrder(pbm, buffer, rows * nbytes);
+            ParallelRows(rows, NULL, 0, LoadRow, &job);
+        }
+        free(buffer);
     }
 
-    fclose(f);
+    fclose(pbm->f);
+    free(pbm->head);
+    return img;
+}
+
+/// Load a raw PBM file.
+/// Only binary PBM files are accepted.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+///
+/// Implementation note: the whole file is mapped into memory, and each row
+/// is turned into a packed bitmap a word at a time, from which the runs
+/// are found with word operations (see EndBitmapRow), without ever
+/// expanding it to a pixel per byte.
+/// Rows are converted in parallel, if there are threads, each thread
+/// taking bands of rows (their positions are known, as all rows have the
+/// same size).  Files that cannot be mapped are not read into memory:
+/// threads read their own rows from the file (unless it can only be read
+/// in order, like a pipe: then bands of rows are read in order, and the
+/// rows of each band are converted in parallel).
+/// Files in the native RLE format are mapped (see ImageLoadRLE).
+Image ImageLoad(const char* filename) {  ///
+    FileData file = {NULL, 0, 0};
+    if (!MapFileData(filename, &file)) {
+        PBMFile pbm;
+        if (OpenPBMFile(filename, &pbm, &file)) return LoadPBMFile(&pbm);
+        return MapRLEImage(file);
+    }
+    if (IsRLEFile(file)) return MapRLEImage(file);
+    int w, h;
+    size_t pos = parsePBMHeader(file, &w, &h);
+    checkError(pos > 0, "Invalid file format", EINVAL);
+
+    // Allocate image (rows are interned as they are loaded)
+    Image img = AllocateImageHeader(w, h);
+
+    // Convert pixels
+    size_t nbytes = ((size_t)w + 8 - 1) / 8;  // number of bytes for each row
+    checkError(file.size - pos >= nbytes * (size_t)h, "Reading pixels",
+               ENODATA);
+    LoadJob job = {img, file.data + pos, 0, nbytes, NULL, 0};
+    ParallelRows(img->height, NULL, 0, LoadRow, &job);
+
+    ReleaseFileData(file);
     return img;
 }
 
+// Bytes of pixels written at a time by ImageSave
+#define SAVE_BUFFER_SIZE (1 << 20)
+
+// A file being saved.
+// An existing regular file is not written in place: it may be the file of
+// an image that is still in use (mapped, or read a row at a time), so the
+// new contents are written to a temporary file in the same directory,
+// which is then renamed to it (it is removed if the save fails, see
+// check). Other files (new ones, devices, pipes), and files in
+// directories where no file can be created, are written directly.
+typedef struct {
+    FILE* f;
+    char* path;     // of the file replaced (symbolic links resolved), or NULL
+    char* tmpname;  // of the temporary file, or NULL
+} SaveFile;
+
+static SaveFile OpenSaveFile(const char* filename) {
+    SaveFile save = {NULL, NULL, NULL};
+#if defined(__linux__) || defined(__APPLE__)
+    struct stat st;
+    if (stat(filename, &st) == 0 && S_ISREG(st.st_mode)) {
+        check((save.path = realpath(filename, NULL)) != NULL, "Open failed");
+        size_t len = strlen(save.path);
+        save.tmpname = malloc(len + sizeof(".XXXXXX"));
+        check(save.tmpname != NULL, "malloc");
+        memcpy(save.tmpname, save.path, len);
+        memcpy(save.tmpname + len, ".XXXXXX", sizeof(".XXXXXX"));
+        int fd = mkstemp(save.tmpname);
+        if (fd >= 0) {
+            SaveInProgress = save.tmpname;
+            // Permissions as the file replaced
+            check(fchmod(fd, st.st_mode & 07777) == 0, "Open failed");
+            check((save.f = fdopen(fd, "wb")) != NULL, "Open failed");
+            return save;
+        }
+        // The directory cannot be written (the file may): written in place
+        check(errno == EACCES || errno == EPERM, "Open failed");
+        free(save.tmpname);
+        free(save.path);
+        save.tmpname = save.path = NULL;
+    }
+#endif
+    check((save.f = fopen(filename, "wb")) != NULL, "Open failed");
+    return save;
+}
+
+/// Close the file, and put it in place of the file replaced, if any.
+static void CloseSaveFile(SaveFile* save, const char* failed) {
+    check(fclose(save->f) == 0, failed);
+    if (save->tmpname != NULL) {
+        check(rename(save->tmpname, save->path) == 0, failed);
+        SaveInProgress = NULL;
+    }
+    free(save->tmpname);
+    free(save->path);
+}
+
 /// Save image to PBM file.
 /// On success, returns unspecified integer. (No need to check!)
 /// On failure, does not return, EXITS program!
@@ -518,29 +2334,346 @@ int ImageSave(const Image img, const char* filename) {  ///
     assert(img != NULL);
     int w = img->width;
     int h = img->height;
-    FILE* f = NULL;
+    SaveFile save = OpenSaveFile(filename);
+    FILE* f = save.f;
 
-    check((f = fopen(filename, "wb")) != NULL, "Open failed");
     check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
 
-  // Write pixels
-  int nbytes = (w + 8 - 1) / 8;  // number of bytes for each row
-  // using VLAs...
-  uint8 bytes[nbytes];
-  // unit8 raw_row[nbytes*8];
-  for (uint32 i = 0; i < img->height; i++) {
-    // UncompressRow...
-    uint8* raw_row = UncompressRow(nbytes * 8, img->row[i]);
-    // Fill padding pixels with WHITE
-    memset(raw_row + w, WHITE, nbytes * 8 - w);
-    packBits(nbytes, bytes, raw_row);
-    size_t written = fwrite(bytes, sizeof(uint8), nbytes, f);
-    check(written == (size_t)nbytes, "Writing pixels failed");
-    free(raw_row);
-  }
+    // Write pixels
+    // Each row is packed from its runs (or copied, for bitmap rows) into
+    // words, converted to PBM bytes and appended to a large buffer, which
+    // is written when full, so there are few writes and no allocations
+    // per row.
+    size_t nbytes = ((size_t)w + 8 - 1) / 8;  // number of bytes for each row
+    size_t buffer_rows = SAVE_BUFFER_SIZE / nbytes > 0
+                         ? SAVE_BUFFER_SIZE / nbytes : 1;
+    uint8* buffer = malloc(buffer_rows * nbytes);
+    check(buffer != NULL, "malloc");
+    uint64_t* bits = malloc(ROW_WORDS(w) * sizeof(uint64_t));
+    check(bits != NULL, "malloc");
+    size_t used = 0;  // rows in the buffer
+    for (uint32 i = 0; i < img->height; i++) {
+        PackRow(bits, img, i);  // padding pixels are WHITE
+        BitsToPBMRow(buffer + used * nbytes, bits, nbytes);
+        if (++used == buffer_rows || i + 1 == img->height) {
+            size_t written = fwrite(buffer, nbytes, used, f);
+            check(written == used, "Writing pixels failed");
+            used = 0;
+        }
+    }
+    free(bits);
+    free(buffer);
 
     // Cleanup
-    fclose(f);
+    CloseSaveFile(&save, "Writing pixels failed");
+    return 0;
+}
+
+/// Native RLE file operations
+
+// Images can also be saved in their own representation: the table of row
+// descriptors and the arenas holding the runs of the rows, so that they
+// are loaded by mapping the file into memory, in O(1), with no decoding
+// or copying.
+//
+// File layout (fields in the byte order of the machine that wrote it):
+//   RLEFileHeader (64 bytes)
+//   narenas RLEFileArena entries: where the arenas are in the file
+//   the table of row descriptors (RLERow), at header.table, cache-aligned,
+//   with the arena indices of the file (and the hashes of the rows)
+//   the arenas, each one cache-aligned, with rows aligned to their runs
+//   (to 8 bytes for bitmaps), as in memory
+// Rows used several times by the image are saved only once.
+
+#define RLE_FILE_MAGIC "AEDRLE4\n"  // version 4: hashes of mirrored rows
+#define RLE_FILE_ORDER 0x01020304u  // to detect files of other byte orders
+
+typedef struct {
+    char magic[8];      // RLE_FILE_MAGIC
+    uint32 order;       // RLE_FILE_ORDER
+    uint32 width;
+    uint32 height;
+    uint32 narenas;
+    uint64_t bytes;     // bytes of the runs of all rows (as in the image)
+    uint64_t table;     // position of the row table in the file
+    uint64_t runs;      // runs of all rows
+    uint64_t black;     // BLACK pixels
+    uint64_t unused;
+} RLEFileHeader;
+
+typedef struct {
+    uint64_t offset;    // position of the arena in the file
+    uint64_t size;      // bytes of the arena
+} RLEFileArena;
+
+// A file in memory, shared by the arenas of its rows
+struct MappedFile {
+    FileData contents;
+    uint32 refs;        // number of arenas in the file still referenced
+};
+
+/// Drop a reference to file, unmapping it if it was the last one
+static void ReleaseMappedFile(struct MappedFile* file) {
+    assert(file->refs > 0);
+    if (--file->refs == 0) {
+        ReleaseFileData(file->contents);
+        FreeBlock(file, sizeof(struct MappedFile));
+    }
+}
+
+/// Whether file is in the native RLE format (otherwise, it may be PBM)
+static int IsRLEFile(FileData file) {
+    return file.size >= sizeof(RLEFileHeader) &&
+           memcmp(file.data, RLE_FILE_MAGIC, 8) == 0;
+}
+
+/// Whether the runs (or bitmap) at data of row, of an image with width
+/// pixels, are well formed: runs of at least 1 pixel adding up to width,
+/// or a bitmap with as many runs as row says, starting with bit 0 (it is
+/// stored relative to the first color) and with its padding bits 0.
+static int ValidRowData(uint32 width, const uint8* data, const RLERow* row) {
+    if (row->runsize == BITMAP_ROW) {
+        const uint64_t* bits = (const uint64_t*)data;
+        size_t last = ROW_WORDS(width) - 1;
+        if (width % 64 != 0 && bits[last] >> (width % 64) != 0) return 0;
+        return (bits[0] & 1) == 0 && CountRuns(bits, width) == row->nruns;
+    }
+    uint64_t x = 0;
+    for (uint32 k = 0; k < row->nruns; k++) {
+        uint32 run = GetRun(data, row->runsize, k);
+        if (run == 0) return 0;
+        x += run;
+    }
+    return x == width;
+}
+
+/// Create an image with the rows of the native RLE file in file, without
+/// copying them: the row table and the arenas of the image are in file,
+/// which is released when no image uses its rows.
+/// Every row is checked (it must be in its arena, and its runs must be
+/// well formed), as are the totals of the header, in a single pass over
+/// the runs.
+static Image MapRLEImage(FileData file) {
+#if defined(__linux__) || defined(__APPLE__)
+    if (file.mapped) madvise((void*)file.data, file.size, MADV_NORMAL);
+#endif
+    RLEFileHeader header;
+    memcpy(&header, file.data, sizeof(header));
+    checkError(header.order == RLE_FILE_ORDER, "Invalid file format", EINVAL);
+    checkError(header.width > 0 && header.height > 0, "Invalid file format",
+               EINVAL);
+    size_t list = sizeof(RLEFileHeader);
+    size_t table_size = (size_t)header.height * sizeof(RLERow);
+    checkError(header.narenas > 0 && header.narenas <= MAX_ARENAS &&
+               list + header.narenas * sizeof(RLEFileArena) <= file.size,
+               "Invalid file format", EINVAL);
+    checkError(header.table % CACHE_LINE == 0 && header.table <= file.size &&
+               table_size <= file.size - header.table,
+               "Invalid file format", EINVAL);
+
+    Image img = AllocBlock(sizeof(struct image));
+    img->width = header.width;
+    img->height = header.height;
+    img->row = (RLERow*)(file.data + header.table);
+    img->mapped = 1;
+    img->fingerprint = 0;
+    img->index = NULL;
+    img->index_bytes = 0;
+    img->view = 0;
+    img->shared = NULL;
+    img->bytes = header.bytes;
+    img->runs = header.runs;
+    img->black = header.black;
+    img->arena = AllocBlock(ArenaListSize(header.narenas));
+    img->narenas = header.narenas;
+
+    struct MappedFile* mapped = AllocBlock(sizeof(struct MappedFile));
+    mapped->contents = file;
+    mapped->refs = header.narenas;
+    for (uint32 k = 0; k < header.narenas; k++) {
+        RLEFileArena place;
+        memcpy(&place, file.data + list + k * sizeof(place), sizeof(place));
+        checkError(place.offset % CACHE_LINE == 0 &&
+                   place.offset <= file.size &&
+                   place.size <= file.size - place.offset &&
+                   place.size <= UINT32_MAX, "Invalid file format", EINVAL);
+        Arena* arena = AllocBlock(sizeof(Arena));
+        arena->refs = 1;
+        arena->hint = k;
+        arena->data = (uint8*)file.data + place.offset;  // never written
+        arena->used = place.size;
+        arena->capacity = place.size;
+        arena->next = NULL;
+        arena->file = mapped;
+        img->arena[k] = arena;
+    }
+
+    uint64_t bytes = 0, runs = 0, black = 0;  // totals of the rows
+    for (uint32 i = 0; i < img->height; i++) {
+        const RLERow* row = &img->row[i];
+        checkError(row->arena < img->narenas && row->color <= 1 &&
+                   row->nruns > 0 && row->nruns <= img->width &&
+                   (row->runsize == BITMAP_ROW || row->runsize == 1 ||
+                    row->runsize == 2 || row->runsize == 4),
+                   "Invalid file format", EINVAL);
+        size_t align = row->runsize == BITMAP_ROW ? sizeof(uint64_t)
+                                                  : row->runsize;
+        size_t used = img->arena[row->arena]->used;
+        size_t size = RowBytes(img->width, row);
+        checkError(row->offset % align == 0 && row->offset <= used &&
+                   size <= used - row->offset, "Invalid file format", EINVAL);
+        const uint8* data = RowRuns(img, i);
+        checkError(ValidRowData(img->width, data, row), "Invalid file format",
+                   EINVAL);
+        uint32 first = CountFirst(img->width, data, row->nruns,
+                                  row->runsize);
+        bytes += size;
+        runs += row->nruns;
+        black += row->color == BLACK ? first : img->width - first;
+    }
+    checkError(bytes == img->bytes && runs == img->runs && black == img->black,
+               "Invalid file format", EINVAL);
+
+    return img;
+}
+
+Image ImageLoadRLE(const char* filename) {
+    FileData file = ReadFileData(filename);
+    checkError(IsRLEFile(file), "Invalid file format", EINVAL);
+    return MapRLEImage(file);
+}
+
+/// Round pos up to a multiple of align
+static inline size_t AlignUp(size_t pos, size_t align) {
+    return (pos + align - 1) / align * align;
+}
+
+/// Save img in the native RLE format (see ImageLoadRLE).
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveRLE(const Image img, const char* filename) {
+    assert(img != NULL);
+    uint32 height = img->height;
+    // The rows are saved as seen through the view of img: negating and
+    // flipping top-bottom only change their descriptors, and the rows of
+    // a view flipped left-right are mirrored as they are written
+    int mirrored = (img->view & VIEW_FLIP_LR) != 0;
+
+    // Place the rows in the arenas of the file: each row the first time
+    // it is found (by its place in memory, so the rows shared by
+    // interning are found)
+    RLERow* table = malloc((size_t)height * sizeof(RLERow));
+    check(table != NULL, "malloc");
+    uint8* first = malloc(height);  // whether row i is placed there
+    check(first != NULL, "malloc");
+    size_t slots = 1;
+    while (slots < 2 * (size_t)height) slots *= 2;
+    uint64_t* keys = calloc(slots, sizeof(uint64_t));  // 0: free slot
+    uint32* rows = malloc(slots * sizeof(uint32));
+    check(keys != NULL && rows != NULL, "malloc");
+    RLEFileArena* places = NULL;  // size of the arenas, for now
+    uint32 narenas = 0;
+    size_t used = 0;  // bytes of the last arena
+    for (uint32 i = 0; i < height; i++) {
+        const RLERow* row = RowOf(img, i);
+        uint64_t key = ((uint64_t)row->arena << 32 | row->offset) + 1;
+        size_t k = (size_t)(key * 0x9E3779B97F4A7C15ull >> 32) & (slots - 1);
+        while (keys[k] != 0 && keys[k] != key) k = (k + 1) & (slots - 1);
+        if (keys[k] == key && RowOf(img, rows[k])->nruns == row->nruns &&
+            RowOf(img, rows[k])->runsize == row->runsize) {
+            table[i] = table[rows[k]];
+            table[i].color = (uint8)RowColor(img, i);
+            first[i] = 0;
+            continue;
+        }
+        keys[k] = key;
+        rows[k] = i;
+
+        size_t size = RowBytes(img->width, row);
+        size_t align = row->runsize == BITMAP_ROW ? sizeof(uint64_t)
+                                                  : row->runsize;
+        size_t offset = AlignUp(used, align);
+        if (narenas == 0 || offset + size > UINT32_MAX) {
+            checkError(narenas < MAX_ARENAS, "Too many arenas", ENOMEM);
+            RLEFileArena* list = realloc(places,
+                                         (narenas + 1) * sizeof(*places));
+            check(list != NULL, "realloc");
+            places = list;
+            if (narenas > 0) places[narenas - 1].size = used;
+            narenas++;
+            offset = 0;
+        }
+        table[i] = *row;
+        table[i].color = (uint8)RowColor(img, i);
+        table[i].hash = RowHash(img, i);
+        table[i].offset = (uint32)offset;
+        table[i].arena = (uint16)(narenas - 1);
+        first[i] = 1;
+        used = offset + size;
+    }
+    places[narenas - 1].size = used;
+    free(keys);
+    free(rows);
+
+    RLEFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RLE_FILE_MAGIC, 8);
+    header.order = RLE_FILE_ORDER;
+    header.width = img->width;
+    header.height = height;
+    header.narenas = narenas;
+    header.bytes = img->bytes;
+    header.runs = img->runs;
+    header.black = img->black;
+    size_t pos = sizeof(header) + narenas * sizeof(RLEFileArena);
+    header.table = AlignUp(pos, CACHE_LINE);
+    pos = header.table + (size_t)height * sizeof(RLERow);
+    for (uint32 k = 0; k < narenas; k++) {
+        places[k].offset = AlignUp(pos, CACHE_LINE);
+        pos = places[k].offset + places[k].size;
+    }
+
+    SaveFile save = OpenSaveFile(filename);
+    FILE* f = save.f;
+    setvbuf(f, NULL, _IOFBF, SAVE_BUFFER_SIZE);
+    static const uint8 zeros[CACHE_LINE];
+    pos = 0;  // bytes written
+    check(fwrite(&header, sizeof(header), 1, f) == 1, "Writing file failed");
+    check(fwrite(places, sizeof(RLEFileArena), narenas, f) == narenas,
+          "Writing file failed");
+    pos = sizeof(header) + narenas * sizeof(RLEFileArena);
+    check(fwrite(zeros, 1, header.table - pos, f) == header.table - pos,
+          "Writing file failed");
+    check(fwrite(table, sizeof(RLERow), height, f) == height,
+          "Writing file failed");
+    pos = header.table + (size_t)height * sizeof(RLERow);
+
+    // The rows, in the order they were placed
+    uint32 arena = UINT32_MAX;
+    size_t base = 0;  // position of the current arena
+    for (uint32 i = 0; i < height; i++) {
+        if (!first[i]) continue;
+        if (table[i].arena != arena) {
+            arena = table[i].arena;
+            base = places[arena].offset;
+        }
+        size_t offset = base + table[i].offset;
+        check(fwrite(zeros, 1, offset - pos, f) == offset - pos,
+              "Writing file failed");
+        size_t size = RowBytes(img->width, &table[i]);
+        const uint8* runs = RowRuns(img, StoredRow(img, i));
+        if (mirrored) {
+            runs = MirrorRow(img->width, runs, size, table[i].nruns,
+                             table[i].runsize);
+        }
+        check(fwrite(runs, 1, size, f) == size, "Writing file failed");
+        pos = offset + size;
+    }
+    free(places);
+    free(first);
+    free(table);
+
+    CloseSaveFile(&save, "Writing file failed");
     return 0;
 }
 
@@ -558,23 +2691,198 @@ int ImageHeight(const Image img) {
     return img->height;
 }
 
+/// Get the number of runs of all rows of img
+uint64_t ImageRuns(const Image img) {
+    assert(img != NULL);
+    return img->runs;
+}
+
+/// Get the number of BLACK pixels of img
+uint64_t ImageBlackPixels(const Image img) {
+    assert(img != NULL);
+    return img->black;
+}
+
 /// Get size in bytes occupied by img
 int ImageSize(const Image img) {
-    int size = 0;
-    
+    assert(img != NULL);
+
+    // Header, row descriptors and the runs of the rows
+    // (rows shared with other images, or within the image, are accounted
+    // for every time they are used)
+    size_t size = sizeof(struct image);
+    size += RowTableSize(img->height);
+    size += img->narenas * sizeof(Arena*);
+    size += img->bytes;
+    size += img->index_bytes;
+
+    return (int)size; 
+};
+
+/// Pixel access
+
+// Rows with fewer runs than this are scanned, instead of indexed
+#define INDEX_MIN_RUNS 16
+
+/// Build the index of row i of img: the position where each of its runs
+/// ends, so the run of a pixel is found by binary search.
+static void BuildRowIndex(Image img, uint32 i) {
+    if (img->index == NULL) {
+        img->index = AllocBlock(img->height * sizeof(uint32*));
+        memset(img->index, 0, img->height * sizeof(uint32*));
+        img->index_bytes += img->height * sizeof(uint32*);
+    }
+    const RLERow* row = &img->row[i];
+    uint32* ends = AllocBlock(row->nruns * sizeof(uint32));
+    const uint8* runs = RowRuns(img, i);
+    uint32 end = 0;
+    for (uint32 k = 0; k < row->nruns; k++) {
+        end += GetRun(runs, row->runsize, k);
+        ends[k] = end;
+    }
+    img->index[i] = ends;
+    img->index_bytes += row->nruns * sizeof(uint32);
+}
+
+/// Free the index of img (see BuildRowIndex).
+/// Must be called whenever the rows of img change.
+static void DropPixelIndex(Image img) {
+    if (img->index == NULL) return;
     for (uint32 i = 0; i < img->height; i++) {
-        size += (GetSizeRLERowArray(img->row[i]) + 2) * sizeof(int);
+        FreeBlock(img->index[i], img->row[i].nruns * sizeof(uint32));
     }
+    FreeBlock(img->index, img->height * sizeof(uint32*));
+    img->index = NULL;
+    img->index_bytes = 0;
+}
 
-    return size; 
-};
+/// Whether row i of img is indexed
+static inline int RowIndexed(const Image img, uint32 i) {
+    return img->index != NULL && img->index[i] != NULL;
+}
+
+/// Find the run of row i of img (not a bitmap) holding pixel x, by binary
+/// search if the row is indexed, otherwise by scanning its runs.
+/// Returns the number of the run, and the pixel where it starts in *start.
+static uint32 FindRun(const Image img, uint32 i, uint32 x, uint32* start) {
+    const RLERow* row = &img->row[i];
+    assert(row->runsize != BITMAP_ROW && x < img->width);
+    if (!RowIndexed(img, i)) {
+        const uint8* runs = RowRuns(img, i);
+        uint32 k = 0;
+        uint32 pos = 0;
+        for (uint32 run; pos + (run = GetRun(runs, row->runsize, k)) <= x;) {
+            pos += run;
+            k++;
+        }
+        *start = pos;
+        return k;
+    }
+    // First run ending after x
+    const uint32* ends = img->index[i];
+    uint32 lo = 0;
+    uint32 hi = row->nruns - 1;
+    while (lo < hi) {
+        uint32 mid = lo + (hi - lo) / 2;
+        if (ends[mid] <= x) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *start = lo > 0 ? ends[lo - 1] : 0;
+    return lo;
+}
+
+/// Get the pixel at column x of row i of img
+static inline uint8 RowPixel(const Image img, uint32 i, uint32 x) {
+    const RLERow* row = &img->row[i];
+    if (row->runsize == BITMAP_ROW) {
+        return row->color ^ ((RowBits(img, i)[x / 64] >> (x % 64)) & 1);
+    }
+    if (row->nruns >= INDEX_MIN_RUNS && !RowIndexed(img, i)) {
+        BuildRowIndex(img, i);
+    }
+    uint32 start;
+    uint32 k = FindRun(img, i, x, &start);  // the run of the pixel
+    return row->color ^ (k & 1);  // runs alternate colors
+}
+
+/// Get the pixel of img at column x, row y, as seen through its view
+static inline uint8 ViewPixel(const Image img, uint32 x, uint32 y) {
+    if (img->view & VIEW_FLIP_LR) x = img->width - 1 - x;
+    return RowPixel(img, StoredRow(img, y), x) ^ (img->view & VIEW_NEG);
+}
+
+/// Get the pixel of img at column x, row y
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y) {
+    assert(img != NULL);
+    assert(x < img->width && y < img->height);
+    return ViewPixel(img, x, y);
+}
+
+/// Get the n pixels of img at columns x[j], rows y[j] into pixels[j]
+void ImageGetPixels(const Image img, int n, const uint32 x[],
+                    const uint32 y[], uint8 pixels[]) {
+    assert(img != NULL);
+    assert(n >= 0);
+    assert(n == 0 || (x != NULL && y != NULL && pixels != NULL));
+    for (int j = 0; j < n; j++) {
+        assert(x[j] < img->width && y[j] < img->height);
+        pixels[j] = ViewPixel(img, x[j], y[j]);
+    }
+}
+
+/// Get the bytes taken by the index of img
+int ImageIndexSize(const Image img) {
+    assert(img != NULL);
+    return (int)img->index_bytes;
+}
 
 /// Image comparison
 
-int ImageIsEqual(const Image img1, const Image img2) {
-    assert(img1 != NULL && img2 != NULL);
+/// Get the fingerprint of img (see ImageFingerprint).
+/// The rows are not read, whatever the view of img: their hashes, in
+/// both orientations, are in their descriptors (see RowHash).
+uint64_t ImageFingerprint(const Image img) {
+    assert(img != NULL);
+    if (img->fingerprint != 0) return img->fingerprint;
+
+    const uint64_t mul = 0x9E3779B97F4A7C15ull;
+    uint64_t h = ((uint64_t)img->width << 32 | img->height) * mul;
+    for (uint32 i = 0; i < img->height; i++) {
+        uint64_t hash = RowHash(img, i);
+        h = (h ^ (hash << 32 | (uint64_t)RowColor(img, i))) * mul;
+        h ^= h >> 29;
+    }
+    img->fingerprint = h != 0 ? h : 1;  // 0 is for not computed yet
+    return img->fingerprint;
+}
+
+/// Whether row i of img1 and row i of img2, with the same first colors and
+/// stored the same way, but one flipped left-right by its view, have the
+/// same pixels: the runs are compared in opposite orders (and bitmaps
+/// packed as seen).
+static int SameMirroredRow(const Image img1, const Image img2, uint32 i) {
+    const RLERow* row1 = RowOf(img1, i);
+    if (row1->runsize == BITMAP_ROW) {
+        size_t nwords = ROW_WORDS(img1->width);
+        uint64_t* bits = GrowScratch(&BitsScratch,
+                                     2 * nwords * sizeof(uint64_t));
+        PackRow(bits, img1, i);
+        PackRow(bits + nwords, img2, i);
+        return memcmp(bits, bits + nwords, nwords * sizeof(uint64_t)) == 0;
+    }
+    const uint8* runs1 = RowRuns(img1, StoredRow(img1, i));
+    const uint8* runs2 = RowRuns(img2, StoredRow(img2, i));
+    for (uint32 k = 0, j = row1->nruns - 1; k < row1->nruns; k++, j--) {
+        uint32 run = GetRun(runs1, row1->runsize, k);
+        if (run != GetRun(runs2, row1->runsize, j)) return 0;
+    }
+    return 1;
+}
 
-    // Check if both images are valid
+int ImageIsEqual(const Image img1, const Image img2) {
     assert(img1 != NULL && img2 != NULL);
 
     // Check if dimensions are equal
@@ -582,23 +2890,40 @@ int ImageIsEqual(const Image img1, const Image img2) {
         return 0;  // Images with different dimensions are not equal
     }
 
+    // Images with different fingerprints are different (computed once per
+    // image, in O(height), then compared in O(1))
+    if (ImageFingerprint(img1) != ImageFingerprint(img2)) return 0;
+
+    // Rows are compared as stored, unless only one of the images is
+    // flipped left-right
+    int mirrored = ((img1->view ^ img2->view) & VIEW_FLIP_LR) != 0;
+
     // Check the content row by row
     for (uint32 i = 0; i < img1->height; i++) {
-        const int* row1 = img1->row[i];
-        const int* row2 = img2->row[i];
-
-        // Check if the RLE arrays are identical
-        uint32 j = 0;
-        while (row1[j] != EOR && row2[j] != EOR) {
-            if (row1[j] != row2[j]) {
-                return 0;  // Found a difference
-            }
-            j++;
+        const RLERow* row1 = RowOf(img1, i);
+        const RLERow* row2 = RowOf(img2, i);
+        // Run widths (and the choice of bitmaps) depend only on the
+        // pixels, so equal rows are stored the same way (but for their
+        // orientation)
+        if (RowColor(img1, i) != RowColor(img2, i) ||
+            row1->nruns != row2->nruns || row1->runsize != row2->runsize ||
+            RowHash(img1, i) != RowHash(img2, i)) {
+            return 0;
         }
+        if (mirrored) {
+            if (!SameMirroredRow(img1, img2, i)) return 0;
+            continue;
+        }
+
+        // Rows built by this module are interned, so equal rows are
+        // usually the same row
+        const uint8* runs1 = RowRuns(img1, StoredRow(img1, i));
+        const uint8* runs2 = RowRuns(img2, StoredRow(img2, i));
+        if (runs1 == runs2) continue;
 
-        // Check if both reached EOR at the same time
-        if (row1[j] != EOR || row2[j] != EOR) {
-            return 0;  // One ended before the other
+        // Check if the RLE arrays (or bitmaps) are identical
+        if (memcmp(runs1, runs2, RowBytes(img1->width, row1)) != 0) {
+            return 0;  // Found a difference
         }
     }
 
@@ -611,6 +2936,108 @@ int ImageIsDifferent(const Image img1, const Image img2) {
     return !ImageIsEqual(img1, img2);
 }
 
+/// In-place operations
+
+// Negating and mirroring in place only change the view flags of the
+// image, in O(1).  Other operations done in place change the row
+// descriptors of the image in its own row table, so rows only need to be
+// (re)built if their runs change.
+// The rows of an image loaded from a native RLE file are in the file,
+// which is never written, and those of views are shared: they are copied
+// to a table of its own first.
+
+/// Make the row table (and arena list) of img its own, so it can be
+/// changed: copies of them, if they are in a file (see MapRLEImage) or
+/// shared with other images (see NewView).
+static void OwnRowTable(Image img) {
+    int copy = img->mapped;  // whether the table must be copied
+    if (img->shared != NULL && *img->shared > 1) {
+        // The others keep using the table and list
+        (*img->shared)--;
+        Arena** list = AllocBlock(ArenaListSize(img->narenas));
+        for (uint32 k = 0; k < img->narenas; k++) {
+            list[k] = img->arena[k];
+            list[k]->refs++;
+        }
+        img->arena = list;
+        copy = 1;
+    } else if (img->shared != NULL) {
+        FreeBlock(img->shared, sizeof(uint32));  // the others are gone
+    }
+    img->shared = NULL;
+    if (!copy) return;
+    RLERow* table = AllocBlock(RowTableSize(img->height));
+    memcpy(table, img->row, img->height * sizeof(RLERow));
+    img->row = table;
+    img->mapped = 0;
+}
+
+static void MirrorRowsInPlace(Image img);
+
+/// Store the rows of img as seen through its view, and clear its view
+/// flags (its pixels do not change).
+/// Negating and flipping top-bottom change only the row descriptors, in
+/// O(height); flipping left-right rebuilds the rows.
+static void MaterializeView(Image img) {
+    if (img->view == 0) return;
+    uint8 view = img->view;
+    uint64_t fingerprint = img->fingerprint;
+    OwnRowTable(img);
+    img->view = 0;
+    if (view & VIEW_NEG) {
+        for (uint32 i = 0; i < img->height; i++) img->row[i].color ^= 1;
+    }
+    if (view & VIEW_FLIP_TB) {
+        // Swap the row descriptors (and the indices of the rows, if any)
+        for (uint32 i = 0, j = img->height - 1; i < j; i++, j--) {
+            RLERow row = img->row[i];
+            img->row[i] = img->row[j];
+            img->row[j] = row;
+            if (img->index != NULL) {
+                uint32* index = img->index[i];
+                img->index[i] = img->index[j];
+                img->index[j] = index;
+            }
+        }
+    }
+    if (view & VIEW_FLIP_LR) MirrorRowsInPlace(img);
+    img->fingerprint = fingerprint;
+}
+
+/// Start an operation on img that rebuilds its rows in place, into
+/// *result: a header that takes over the row table of img (so each row
+/// of the result must only be written after reading the same row of img),
+/// with arenas of its own.
+static void BeginInPlace(Image img, struct image* result) {
+    MaterializeView(img);
+    DropPixelIndex(img);
+    OwnRowTable(img);
+    *result = *img;
+    result->arena = NULL;
+    result->narenas = 0;
+    result->bytes = 0;
+    result->runs = 0;
+    result->black = 0;
+    result->fingerprint = 0;
+}
+
+/// Finish an operation on img started with BeginInPlace: the rows of img
+/// are now those of result, in their arenas.
+static void EndInPlace(Image img, struct image* result) {
+    for (uint32 k = 0; k < img->narenas; k++) {
+        ReleaseArena(img->arena[k]);
+    }
+    FreeBlock(img->arena, ArenaListSize(img->narenas));
+    img->arena = result->arena;
+    img->narenas = result->narenas;
+    img->bytes = result->bytes;
+    img->runs = result->runs;
+    img->black = result->black;
+    img->fingerprint = 0;
+    // Forget the interned rows no longer used by any image
+    InternPurge();
+}
+
 /// Boolean Operations on image pixels
 
 /// These functions apply boolean operations to images,
@@ -621,224 +3048,462 @@ int ImageIsDifferent(const Image img1, const Image img2) {
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 
-Image ImageNEG(const Image img) {
+void ImageNEGInPlace(Image img) {
     assert(img != NULL);
 
-    uint32 width = img->width;
-    uint32 height = img->height;
+    // The rows do not change: they are read negated
+    img->view ^= VIEW_NEG;
+    img->fingerprint = 0;
+    img->black = (uint64_t)img->width * img->height - img->black;
+}
 
-    Image newImage = AllocateImageHeader(width, height);
+Image ImageNEG(const Image img) {
+    assert(img != NULL);
 
-    // Directly copying the rows, one by one
-    // And changing the value of row[i][0]
+    // The rows do not change: a view of img, read negated
+    return NewView(img, VIEW_NEG);
+}
 
-    for (uint32 i = 0; i < height; i++) {
-        uint32 num_elems = GetSizeRLERowArray(img->row[i]);
-        newImage->row[i] = AllocateRLERowArray(num_elems);
-        memcpy(newImage->row[i], img->row[i], num_elems * sizeof(int));
-        newImage->row[i][0] ^= 1;  // Just negate the value of the first pixel run
+// Operands of a boolean operation, see ImageBoolean
+typedef struct {
+    Image result;
+    Image img1;
+    Image img2;
+    uint8 op;
+} BooleanJob;
+
+/// Apply the boolean function op to row r1 of img1 and row r2 of img2,
+/// storing the result as row i of result.
+static void BooleanRowsOf(Image result, uint32 i, uint8 op,
+                          const Image img1, uint32 r1,
+                          const Image img2, uint32 r2) {
+    uint32 width = img1->width;
+    const RLERow* row1 = RowOf(img1, r1);
+    const RLERow* row2 = RowOf(img2, r2);
+    uint32 num_runs1 = row1->nruns;
+    uint32 num_runs2 = row2->nruns;
+    if (row1->runsize == BITMAP_ROW || row2->runsize == BITMAP_ROW ||
+        (size_t)(num_runs1 + num_runs2) * DENSE_RUN_FACTOR > width) {
+        // Dense rows: operate on packed bits
+        size_t nwords = ROW_WORDS(width);
+        uint64_t* bits1 = GrowScratch(&BitsScratch,
+                                      3 * nwords * sizeof(uint64_t));
+        uint64_t* bits2 = bits1 + nwords;
+        uint64_t* bits = bits2 + nwords;
+        PackRow(bits1, img1, r1);
+        PackRow(bits2, img2, r2);
+        BoolWords(bits, bits1, bits2, nwords, op);
+        BOOL_OP += nwords;
+        EndBitmapRow(result, i, bits);
+    } else {
+        // Buffers for the operand rows (a row has at most width runs)
+        int color1 = RowColor(img1, r1);
+        int color2 = RowColor(img2, r2);
+        int* runs1 = GrowScratch(&DecodeScratch,
+                                 2 * (size_t)width * sizeof(int));
+        int* runs2 = runs1 + width;
+        DecodeRLERow(runs1, img1, r1);
+        DecodeRLERow(runs2, img2, r2);
+        BoolMergeRows(result, i, op,
+                      runs1, num_runs1, color1, runs2, num_runs2, color2);
     }
+}
 
-    return newImage;
+/// Compute row i of the boolean operation job
+static void BooleanRow(void* job, uint32 i) {
+    const BooleanJob* bool_job = job;
+    BooleanRowsOf(bool_job->result, i, bool_job->op,
+                  bool_job->img1, i, bool_job->img2, i);
 }
 
-Image ImageAND(const Image img1, const Image img2) {
+/// Apply any boolean function of two pixels to img1 and img2.
+/// op is the truth table of the function (see BOOL_AND, etc. in imageBW.h).
+/// Rows are merged directly in RLE form, in O(runs1 + runs2) per row,
+/// unless they have many short runs (or are stored as bitmaps): then they
+/// are packed into bitmaps and combined a word at a time.
+Image ImageBoolean(const Image img1, const Image img2, uint8 op) {
     assert(img1 != NULL && img2 != NULL);
-
-    // Check if the dimensions of the images are equal
     assert(img1->width == img2->width && img1->height == img2->height);
+    assert(op <= 0xF);
 
-    // Allocate a new image to store the result
     Image result = AllocateImageHeader(img1->width, img1->height);
+    BooleanJob job = {result, img1, img2, op};
+    Image operands[] = {img1, img2};
+    ParallelRows(result->height, operands, 2, BooleanRow, &job);
 
-    // Iterate through each row of the images
-    for (uint32 i = 0; i < img1->height; i++) {
-        // Uncompress the rows of the images
-        uint8* raw_row1 = UncompressRow(img1->width, img1->row[i]);
-        uint8* raw_row2 = UncompressRow(img2->width, img2->row[i]);
-
-        // Allocate a RAW row for the result
-        uint8* raw_result_row = malloc(img1->width * sizeof(uint8));
-        assert(raw_result_row != NULL);
+    return result;
+}
 
-        // Perform the AND operation pixel by pixel
-        for (uint32 j = 0; j < img1->width; j++) {
-            raw_result_row[j] = raw_row1[j] & raw_row2[j];
-            PIXMEM+=3;
-            BOOL_OP++;  // Increment boolean operation counter for each AND
-        }
+Image ImageAND(const Image img1, const Image img2) {
+    return ImageBoolean(img1, img2, BOOL_AND);
+}
 
-        // Compress the resulting row to RLE format
-        result->row[i] = CompressRow(img1->width, raw_result_row);
-        
+void ImageBooleanInPlace(Image img1, const Image img2, uint8 op) {
+    assert(img1 != NULL && img2 != NULL);
+    assert(img1->width == img2->width && img1->height == img2->height);
+    assert(op <= 0xF);
+
+    // Each row of img1 is read (as is the same row of img2, which may be
+    // img1 itself) before the row of the result replaces it
+    struct image result;
+    BeginInPlace(img1, &result);
+    BooleanJob job = {&result, img1, img2, op};
+    Image operands[] = {img1, img2};
+    ParallelRows(img1->height, operands, 2, BooleanRow, &job);
+    EndInPlace(img1, &result);
+}
 
-        // Free the temporary RAW rows
-        free(raw_row1);
-        free(raw_row2);
-        free(raw_result_row);
-    }
+void ImageANDInPlace(Image img1, const Image img2) {
+    ImageBooleanInPlace(img1, img2, BOOL_AND);
+}
 
-    return result;
+void ImageORInPlace(Image img1, const Image img2) {
+    ImageBooleanInPlace(img1, img2, BOOL_OR);
 }
 
+void ImageXORInPlace(Image img1, const Image img2) {
+    ImageBooleanInPlace(img1, img2, BOOL_XOR);
+}
 
-Image ImageAND2(const Image img1, const Image img2) {
-    assert(img1 != NULL && img2 != NULL);
-    assert(img1->width == img2->width && img1->height == img2->height);
 
-    Image result = AllocateImageHeader(img1->width, img1->height);
+/// Compute row i of the AND of the operands of job (a BooleanJob)
+static void AND2Row(void* job, uint32 i) {
+    const BooleanJob* and_job = job;
+    Image result = and_job->result;
+    const Image img1 = and_job->img1;
+    const Image img2 = and_job->img2;
 
-    for (uint32 i = 0; i < img1->height; i++) {
-        const int* row1 = img1->row[i];
-        const int* row2 = img2->row[i];
+    // Buffers for the operand rows, decoded on the fly, one row at a time
+    // (a row has at most width runs)
+    int* row1 = GrowScratch(&DecodeScratch,
+                            2 * (size_t)img1->width * sizeof(int));
+    int* row2 = row1 + img1->width;
 
-        // Allocate space for the result row
-        int max_size = GetNumRunsInRLERow(row1) + GetNumRunsInRLERow(row2)+2;
-        int* result_row = AllocateRLERowArray(max_size);
-        
-        PIXMEM+=4;
-        int res_index = 0;
-        int color1 = row1[0], color2 = row2[0];
-        int run1 = row1[1], run2 = row2[1];
-        int idx1 = 2, idx2 = 2;
+    DecodeRLERow(row1, img1, i);
+    DecodeRLERow(row2, img2, i);
+    uint32 num_runs1 = RowOf(img1, i)->nruns;
+    uint32 num_runs2 = RowOf(img2, i)->nruns;
 
-        PIXMEM++;
-        BOOL_OP++;
-        // Determine the first color of the result row
-        int result_color = color1 & color2;
-        result_row[res_index++] = result_color;
+    PIXMEM+=4;
+    int res_index = 0;
+    int color1 = RowColor(img1, i), color2 = RowColor(img2, i);
+    int run1 = row1[0], run2 = row2[0];
+    uint32 idx1 = 1, idx2 = 1;
 
-        while (run1 > 0 || run2 > 0) {
-            BOOL_OP++;
-            int min_run;
-            if (run1 < run2) {
-                min_run = run1;
-            } else {
-                min_run = run2;
-            }
-            
-            BOOL_OP++;
-            // Perform AND operation between the current colors
-            int current_color = color1 && color2;
+    PIXMEM++;
+    BOOL_OP++;
+    // Determine the first color of the result row
+    int result_color = color1 & color2;
 
-            BOOL_OP++;
-            // Append the run length to the result
-            if (result_color !=current_color  || res_index == 1){
+    // Reserve space for the result row
+    uint32 max_runs = num_runs1 + num_runs2;
+    int* result_row = BeginRLERow(result, i, result_color, max_runs);
 
-              result_row[res_index++] = min_run;
+    while (run1 > 0 || run2 > 0) {
+        BOOL_OP++;
+        int min_run;
+        if (run1 < run2) {
+            min_run = run1;
+        } else {
+            min_run = run2;
+        }
+        
+        BOOL_OP++;
+        // Perform AND operation between the current colors
+        int current_color = color1 && color2;
 
-              result_color = current_color;
+        BOOL_OP++;
+        // Append the run length to the result
+        if (result_color !=current_color  || res_index == 0){
 
-            }else{
+          result_row[res_index++] = min_run;
 
-              result_row[res_index-1] += min_run;
+          result_color = current_color;
 
-            }
+        }else{
 
-            // Decrease runs by the minimum run length
-            run1 -= min_run;
-            run2 -= min_run;
+          result_row[res_index-1] += min_run;
 
-            BOOL_OP++;
-            // Move to the next run in row1, if necessary
-            if (run1 == 0 && row1[idx1] != EOR) {
-                color1 ^= 1; // Alternate pixel color
-                run1 = row1[idx1++];
-                PIXMEM+=2;
-            }
-            
-            BOOL_OP++;
-            // Move to the next run in row2, if necessary
-            if (run2 == 0 && row2[idx2] != EOR) {
-                color2 ^= 1; // Alternate pixel color 
-                run2 = row2[idx2++];
-                PIXMEM+=2;
-            }
         }
 
-        PIXMEM++;
-        // Mark the end of the result row
-        result_row[res_index++] = EOR;
-        result->row[i] = result_row;
-    }
+        // Decrease runs by the minimum run length
+        run1 -= min_run;
+        run2 -= min_run;
 
-    return result;
-}
+        BOOL_OP++;
+        // Move to the next run in row1, if necessary
+        if (run1 == 0 && idx1 < num_runs1) {
+            color1 ^= 1; // Alternate pixel color
+            run1 = row1[idx1++];
+            PIXMEM+=2;
+        }
+        
+        BOOL_OP++;
+        // Move to the next run in row2, if necessary
+        if (run2 == 0 && idx2 < num_runs2) {
+            color2 ^= 1; // Alternate pixel color 
+            run2 = row2[idx2++];
+            PIXMEM+=2;
+        }
+    }
 
+    PIXMEM++;
+    // Mark the end of the result row
+    EndRLERow(result, i, res_index);
+}
 
-Image ImageOR(const Image img1, const Image img2) {
+Image ImageAND2(const Image img1, const Image img2) {
     assert(img1 != NULL && img2 != NULL);
-
-    // Check if the dimensions of the images are equal
     assert(img1->width == img2->width && img1->height == img2->height);
 
-    // Allocate a new image to store the result
     Image result = AllocateImageHeader(img1->width, img1->height);
+    BooleanJob job = {result, img1, img2, BOOL_AND};
+    Image operands[] = {img1, img2};
+    ParallelRows(result->height, operands, 2, AND2Row, &job);
 
-    // Iterate through each row of the images
-    for (uint32 i = 0; i < img1->height; i++) {
-        // Uncompress the rows of the images
-        uint8* raw_row1 = UncompressRow(img1->width, img1->row[i]);
-        uint8* raw_row2 = UncompressRow(img2->width, img2->row[i]);
+    return result;
+}
 
-        // Allocate a RAW row for the result
-        uint8* raw_result_row = malloc(img1->width * sizeof(uint8));
-        assert(raw_result_row != NULL);
 
-        // Perform the OR operation pixel by pixel
-        for (uint32 j = 0; j < img1->width; j++) {
-            raw_result_row[j] = raw_row1[j] | raw_row2[j];
-        }
+Image ImageOR(const Image img1, const Image img2) {
+    return ImageBoolean(img1, img2, BOOL_OR);
+}
 
-        // Compress the resulting row to RLE format
-        result->row[i] = CompressRow(img1->width, raw_result_row);
 
-        // Free the temporary RAW rows
-        free(raw_row1);
-        free(raw_row2);
-        free(raw_result_row);
-    }
+Image ImageXOR(const Image img1, const Image img2) {
+    return ImageBoolean(img1, img2, BOOL_XOR);
+}
 
-    return result;
+Image ImageANDNOT(const Image img1, const Image img2) {
+    return ImageBoolean(img1, img2, BOOL_ANDNOT);
 }
 
+Image ImageNAND(const Image img1, const Image img2) {
+    return ImageBoolean(img1, img2, BOOL_NAND);
+}
 
-Image ImageXOR(const Image img1, const Image img2) {
-    assert(img1 != NULL && img2 != NULL);
+Image ImageNOR(const Image img1, const Image img2) {
+    return ImageBoolean(img1, img2, BOOL_NOR);
+}
 
-    // Check if the dimensions of the images are equal
-    assert(img1->width == img2->width && img1->height == img2->height);
+Image ImageXNOR(const Image img1, const Image img2) {
+    return ImageBoolean(img1, img2, BOOL_XNOR);
+}
 
-    // Allocate a new image to store the result
-    Image result = AllocateImageHeader(img1->width, img1->height);
+/// N-ary operations
 
-    // Iterate through each row of the images
-    for (uint32 i = 0; i < img1->height; i++) {
-        // Uncompress the rows of the images
-        uint8* raw_row1 = UncompressRow(img1->width, img1->row[i]);
-        uint8* raw_row2 = UncompressRow(img2->width, img2->row[i]);
+// Each pixel of the result of an n-ary operation depends only on how many
+// of the n operands are BLACK there: at least k of them, or an odd number.
+
+// Operands of an n-ary operation, see CountImages
+typedef struct {
+    Image result;
+    const Image* imgs;
+    int n;
+    int k;       // least number of BLACK operands for a BLACK result
+    int parity;  // whether an odd number of BLACK operands is required
+} CountJob;
+
+/// Color of the pixels of the result of job with count BLACK operands
+static inline int CountValue(const CountJob* job, int count) {
+    return job->parity ? count & 1 : count >= job->k;
+}
+
+// Next run boundary of an operand row, in the heap of CountMergeRow
+typedef struct {
+    uint32 x;    // first pixel after the current run of the operand
+    uint32 img;  // index of the operand
+} Boundary;
+
+/// Move heap[k] down to its place in the min-heap (by x) of size entries
+static void SiftDown(Boundary* heap, uint32 size, uint32 k) {
+    Boundary entry = heap[k];
+    for (;;) {
+        uint32 child = 2 * k + 1;
+        if (child >= size) break;
+        if (child + 1 < size && heap[child + 1].x < heap[child].x) child++;
+        if (heap[child].x >= entry.x) break;
+        heap[k] = heap[child];
+        k = child;
+    }
+    heap[k] = entry;
+}
 
-        // Allocate a RAW row for the result
-        uint8* raw_result_row = malloc(img1->width * sizeof(uint8));
-        assert(raw_result_row != NULL);
+/// Compute row i of the result of job, whose operand rows have total_runs
+/// runs, merging the runs of all the operands at once.
+/// The next run boundary of each operand is kept in a min-heap, so each
+/// boundary costs O(log n): O(total_runs log n) for the row.
+static void CountMergeRow(const CountJob* job, uint32 i, uint32 total_runs) {
+    int n = job->n;
+    uint32 width = job->result->width;
+
+    // The runs of all the operand rows, one after the other, and for each
+    // operand: its current color, the index of its next run, and of its
+    // last run
+    size_t size = total_runs * sizeof(int) + n * sizeof(Boundary) +
+                  3 * n * sizeof(uint32);
+    int* runs = GrowScratch(&DecodeScratch, size);
+    Boundary* heap = (Boundary*)(runs + total_runs);
+    uint32* color = (uint32*)(heap + n);
+    uint32* next = color + n;
+    uint32* last = next + n;
+
+    int count = 0;       // BLACK operands
+    uint32 nheap = 0;    // operands with boundaries left
+    uint32 pos = 0;
+    for (int j = 0; j < n; j++) {
+        const Image img = job->imgs[j];
+        uint32 num_runs = RowOf(img, i)->nruns;
+        DecodeRLERow(runs + pos, img, i);
+        color[j] = (uint32)RowColor(img, i);
+        count += (int)color[j];
+        next[j] = pos + 1;
+        last[j] = pos + num_runs - 1;
+        if (num_runs > 1) {
+            heap[nheap].x = (uint32)runs[pos];
+            heap[nheap].img = (uint32)j;
+            nheap++;
+        }
+        pos += num_runs;
+    }
+    for (uint32 k = nheap / 2; k-- > 0;) SiftDown(heap, nheap, k);
+
+    // The result has a boundary only where some operand has one
+    int value = CountValue(job, count);
+    int* result_row = BeginRLERow(job->result, i, value, total_runs - n + 1);
+    uint32 res_index = 0;
+    uint32 start = 0;  // first pixel of the current result run
+    while (nheap > 0) {
+        // All the operands with a boundary at x change color
+        uint32 x = heap[0].x;
+        do {
+            uint32 j = heap[0].img;
+            color[j] ^= 1;
+            count += color[j] ? 1 : -1;
+            if (next[j] < last[j]) {
+                heap[0].x = x + (uint32)runs[next[j]++];
+                PIXMEM++;
+            } else {
+                heap[0] = heap[--nheap];
+            }
+            if (nheap > 0) SiftDown(heap, nheap, 0);
+            BOOL_OP++;
+        } while (nheap > 0 && heap[0].x == x);
+
+        int current = CountValue(job, count);
+        if (current != value) {
+            result_row[res_index++] = (int)(x - start);
+            start = x;
+            value = current;
+        }
+    }
+    result_row[res_index++] = (int)(width - start);
+
+    EndRLERow(job->result, i, res_index);
+}
 
-        // Perform the XOR operation pixel by pixel
-        for (uint32 j = 0; j < img1->width; j++) {
-            raw_result_row[j] = raw_row1[j] ^ raw_row2[j];
+/// Compute row i of the result of job from the operand rows packed into
+/// bitmaps, counting the BLACK operands of 64 pixels at a time with
+/// bit-sliced counters: bit c of the count of pixel x is bit x of counter
+/// word c, and each operand is added with a ripple carry.
+static void CountWordsRow(const CountJob* job, uint32 i) {
+    int n = job->n;
+    uint32 width = job->result->width;
+    size_t nwords = ROW_WORDS(width);
+    int nbits = 1;  // bits of the counters (n < 2^nbits)
+    while (n >> nbits != 0) nbits++;
+
+    uint64_t* counter = GrowScratch(&BitsScratch,
+                                    (nbits + 2) * nwords * sizeof(uint64_t));
+    uint64_t* bits = counter + nbits * nwords;
+    uint64_t* result = bits + nwords;
+    memset(counter, 0, nbits * nwords * sizeof(uint64_t));
+
+    for (int j = 0; j < n; j++) {
+        PackRow(bits, job->imgs[j], i);
+        for (size_t w = 0; w < nwords; w++) {
+            uint64_t carry = bits[w];
+            for (int c = 0; carry != 0 && c < nbits; c++) {
+                uint64_t sum = counter[c * nwords + w];
+                counter[c * nwords + w] = sum ^ carry;
+                carry &= sum;
+            }
+        }
+    }
+    BOOL_OP += n * nwords;
+
+    if (job->parity) {
+        memcpy(result, counter, nwords * sizeof(uint64_t));
+    } else {
+        // Compare the counts with k (k <= n < 2^nbits), from the top bit
+        for (size_t w = 0; w < nwords; w++) {
+            uint64_t greater = 0, equal = ~(uint64_t)0;
+            for (int c = nbits - 1; c >= 0; c--) {
+                uint64_t bit = counter[c * nwords + w];
+                if (job->k >> c & 1) {
+                    equal &= bit;
+                } else {
+                    greater |= equal & bit;
+                    equal &= ~bit;
+                }
+            }
+            result[w] = greater | equal;
         }
+    }
+    EndBitmapRow(job->result, i, result);
+}
 
-        // Compress the resulting row to RLE format
-        result->row[i] = CompressRow(img1->width, raw_result_row);
+/// Compute row i of the result of the n-ary operation job
+static void CountRow(void* job, uint32 i) {
+    const CountJob* count_job = job;
+    uint32 total_runs = 0;
+    for (int j = 0; j < count_job->n; j++) {
+        total_runs += RowOf(count_job->imgs[j], i)->nruns;
+    }
+    // As for pairs of rows (see ImageBoolean), many short runs are better
+    // handled as bitmaps
+    size_t width = count_job->result->width;
+    if ((size_t)total_runs * DENSE_RUN_FACTOR > count_job->n * width / 2) {
+        CountWordsRow(count_job, i);
+    } else {
+        CountMergeRow(count_job, i, total_runs);
+    }
+}
 
-        // Free the temporary RAW rows
-        free(raw_row1);
-        free(raw_row2);
-        free(raw_result_row);
+/// Apply the n-ary operation given by k and parity (see CountJob) to the
+/// n images in imgs.
+static Image CountImages(const Image imgs[], int n, int k, int parity) {
+    assert(imgs != NULL && n >= 1);
+    for (int j = 0; j < n; j++) {
+        assert(imgs[j] != NULL);
+        assert(imgs[j]->width == imgs[0]->width &&
+               imgs[j]->height == imgs[0]->height);
     }
 
+    Image result = AllocateImageHeader(imgs[0]->width, imgs[0]->height);
+    CountJob job = {result, imgs, n, k, parity};
+    ParallelRows(result->height, imgs, n, CountRow, &job);
+
     return result;
 }
 
+Image ImageANDN(const Image imgs[], int n) {
+    return CountImages(imgs, n, n, 0);
+}
+
+Image ImageORN(const Image imgs[], int n) {
+    return CountImages(imgs, n, 1, 0);
+}
+
+Image ImageXORN(const Image imgs[], int n) {
+    return CountImages(imgs, n, 0, 1);
+}
+
+Image ImageThreshold(const Image imgs[], int n, int k) {
+    assert(0 <= k && k <= n);
+    return CountImages(imgs, n, k, 0);
+}
+
 
 /// Geometric transformations
 
@@ -857,28 +3522,48 @@ Image ImageXOR(const Image img1, const Image img2) {
 Image ImageHorizontalMirror(const Image img) {
     assert(img != NULL);
 
-    uint32 width = img->width;
-    uint32 height = img->height;
+    // The rows themselves are unchanged: a view of img, with its rows read
+    // in reverse order
+    return NewView(img, VIEW_FLIP_TB);
+}
 
-    Image newImage = AllocateImageHeader(width, height);
-    
-    int* newRow;
-    uint32 size;
-    for (uint32 i = 0; i < height; i++) {
-        //Get row size
-        size = GetSizeRLERowArray(img->row[i]); 
-        
-        //Allocate row
-        newRow = AllocateRLERowArray(size);
-        
-        //Copy row
-        CopyRLERow(newRow, img->row[i]);
-        
-        //Update newImage row pointer
-        newImage->row[height - (i + 1)] = newRow;
+void ImageHorizontalMirrorInPlace(Image img) {
+    assert(img != NULL);
+    img->view ^= VIEW_FLIP_TB;
+    img->fingerprint = 0;
+}
+
+// Operands of a geometric transformation, see ImageVerticalMirror and
+// ImageReplicateAtRight
+typedef struct {
+    Image newImage;
+    Image img1;
+    Image img2;  // NULL if there is a single operand
+} TransformJob;
+
+/// Compute row i of the vertical mirror of the image of job
+static void VerticalMirrorRow(void* job, uint32 i) {
+    const TransformJob* mirror_job = job;
+    Image newImage = mirror_job->newImage;
+    const Image img = mirror_job->img1;
+
+    int color = img->row[i].color;
+    uint32 runs = img->row[i].nruns;
+
+    //Flip first pixel if necessary
+    int newColor = LastPixelRLE(color, runs);
+
+    // Buffer for the runs of a row (at most width)
+    int* row = GrowScratch(&DecodeScratch, (size_t)img->width * sizeof(int));
+
+    //Copy runs in reverse order
+    DecodeRLERow(row, img, i);
+    int* newRow = BeginRLERow(newImage, i, newColor, runs);
+    for (uint32 j = 0; j < runs; j++) {
+        newRow[j] = row[runs - (j + 1)];
     }
 
-    return newImage;
+    EndRLERow(newImage, i, runs);
 }
 
 /// Mirror an image = flip left-right.
@@ -890,35 +3575,48 @@ Image ImageHorizontalMirror(const Image img) {
 Image ImageVerticalMirror(const Image img) {
     assert(img != NULL);
 
-    uint32 width = img->width;
-    uint32 height = img->height;
-
-    Image newImage = AllocateImageHeader(width, height);
-
-    for (uint32 i = 0; i < height; i++) {
-        int* row = img->row[i];
-        uint32 rowSize = GetSizeRLERowArray(row);
-        uint32 runs = rowSize - 2;
-        
-        //Allocate row
-        int* newRow = AllocateRLERowArray(rowSize);
-        
-        //Copy row
-        CopyRLERow(newRow, img->row[i]);
+    // A view of img, with the runs of its rows read in reverse order
+    // (the rows are only mirrored if needed, see MaterializeView)
+    return NewView(img, VIEW_FLIP_LR);
+}
 
-        //Reverse runs 
-        ReverseArray(&newRow[1], (size_t) runs);
-        
-        //Flip first pixel if necessary
-        if (LastPixelRLE(row, runs) != row[0]) {
-            newRow[0] = ! row[0]; // ! 0 = 1
-        }
+void ImageVerticalMirrorInPlace(Image img) {
+    assert(img != NULL);
+    img->view ^= VIEW_FLIP_LR;
+    img->fingerprint = 0;
+}
 
-        //Update newImage row pointer
-        newImage->row[i] = newRow;
-    }
+/// Mirror the rows of img (flip left-right), as stored, in place.
+/// Requires: img is not a view (its flags are clear).
+static void MirrorRowsInPlace(Image img) {
+    assert(img->view == 0);
+
+    // Each row is decoded before its mirror replaces it
+    struct image result;
+    BeginInPlace(img, &result);
+    TransformJob job = {&result, img, NULL};
+    Image operands[] = {img};
+    ParallelRows(img->height, operands, 1, VerticalMirrorRow, &job);
+    EndInPlace(img, &result);
+}
 
-    return newImage;
+// Rows of an operand of ImageReplicateAtBottom that are rebuilt (as seen
+// through its view), from row first of the result on
+typedef struct {
+    Image newImage;
+    Image img;
+    uint32 first;
+} CopyJob;
+
+/// Rebuild row i of the image of job as row first + i of the result
+static void CopyRow(void* job, uint32 i) {
+    const CopyJob* copy_job = job;
+    const Image img = copy_job->img;
+    uint32 r = copy_job->first + i;
+    uint32 num_runs = RowOf(img, i)->nruns;
+    int* row = BeginRLERow(copy_job->newImage, r, RowColor(img, i), num_runs);
+    DecodeRLERow(row, img, i);
+    EndRLERow(copy_job->newImage, r, num_runs);
 }
 
 /// Replicate img2 at the bottom of imag1, creating a larger image
@@ -935,41 +3633,78 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2) {
     uint32 new_width = img1->width;
     uint32 new_height = img1->height + img2->height;
 
+    // The rows do not change, so they are shared with img1 and img2, as
+    // seen through their views: negating and flipping top-bottom only
+    // change the row descriptors.  The result is flipped left-right if
+    // both are; otherwise the rows of the one that is are rebuilt.
     Image newImage = AllocateImageHeader(new_width, new_height);
-    
-    uint32 i;
-    uint32 rowSize;
-    int* newRow;
-    int* row;
-    for (i = 0; i < img1->height ; i++) {
-        row = img1->row[i];
-        rowSize = GetSizeRLERowArray(row);
-        
-        //Allocate row
-        newRow = AllocateRLERowArray(rowSize);
-
-        //Copy row
-        CopyRLERow(newRow, img1->row[i]);
-        
-        newImage->row[i] = newRow;
-    }
-    
-    for (i = 0; i < img2->height; i++) {
-        row = img2->row[i];
-        rowSize = GetSizeRLERowArray(row);
-        
-        //Allocate row
-        newRow = AllocateRLERowArray(rowSize);
-
-        //Copy row
-        CopyRLERow(newRow, img2->row[i]);
-        
-        newImage->row[i + img1->height] = newRow;
+    newImage->view = img1->view & img2->view & VIEW_FLIP_LR;
+    const Image parts[] = {img1, img2};
+    uint32 first = 0;  // row of the result for the first row of the part
+    for (int p = 0; p < 2; p++) {
+        const Image img = parts[p];
+        if ((img->view & VIEW_FLIP_LR) != newImage->view) {
+            CopyJob job = {newImage, img, first};
+            Image operands[] = {img};
+            ParallelRows(img->height, operands, 1, CopyRow, &job);
+        } else {
+            // The arenas of img may get other indices (or be shared with
+            // the other part)
+            uint16* index = malloc(img->narenas * sizeof(uint16));
+            check(index != NULL, "malloc");
+            for (uint32 k = 0; k < img->narenas; k++) {
+                index[k] = ShareArena(newImage, img->arena[k]);
+            }
+            for (uint32 i = 0; i < img->height; i++) {
+                RLERow* row = &newImage->row[first + i];
+                *row = *RowOf(img, i);
+                row->color ^= img->view & VIEW_NEG;
+                row->arena = index[row->arena];
+            }
+            free(index);
+            newImage->bytes += img->bytes;
+            newImage->runs += img->runs;
+            newImage->black += img->black;
+        }
+        first += img->height;
     }
 
     return newImage;
 }
 
+/// Compute row i of the images of job, side by side
+static void ReplicateAtRightRow(void* job, uint32 i) {
+    const TransformJob* replicate_job = job;
+    Image newImage = replicate_job->newImage;
+    const Image img1 = replicate_job->img1;
+    const Image img2 = replicate_job->img2;
+
+    int color1 = RowColor(img1, i);
+    int color2 = RowColor(img2, i);
+
+    uint32 numRuns1 = RowOf(img1, i)->nruns;
+    uint32 numRuns2 = RowOf(img2, i)->nruns;
+    uint32 numRunsNew = numRuns1 + numRuns2;
+
+    int joinRuns = LastPixelRLE(color1, numRuns1) == color2; //Bool
+    if (joinRuns) numRunsNew--;
+
+    // Reserve row
+    int* newRow = BeginRLERow(newImage, i, color1, numRunsNew);
+    
+    DecodeRLERow(newRow, img1, i);
+    if (joinRuns) {
+        // Sum last run of 1st row with 1st run of last row
+        int last = newRow[numRuns1 - 1];
+        DecodeRLERow(&newRow[numRuns1 - 1], img2, i);
+        newRow[numRuns1 - 1] += last;
+    } else {
+        DecodeRLERow(&newRow[numRuns1], img2, i);
+    }
+    
+    EndRLERow(newImage, i, numRunsNew);
+}
+
 /// Replicate img2 to the right of imag1, creating a larger image
 /// Requires: the height of the two images must be the same.
 /// Returns the new larger image.
@@ -985,33 +3720,1371 @@ Image ImageReplicateAtRight(const Image img1, const Image img2) {
     uint32 new_height = img1->height;
 
     Image newImage = AllocateImageHeader(new_width, new_height);
-    
-    for (uint32 i = 0; i < new_height; i++) {
-        
-        uint32 numRuns1 = GetNumRunsInRLERow(img1->row[i]);
-        uint32 numRuns2 = GetNumRunsInRLERow(img2->row[i]);
-        uint32 numRunsNew = numRuns1 + numRuns2;
+    TransformJob job = {newImage, img1, img2};
+    Image operands[] = {img1, img2};
+    ParallelRows(new_height, operands, 2, ReplicateAtRightRow, &job);
 
-        int* row1 = img1->row[i];
-        int* row2 = img2->row[i];
-        
-        int joinRuns = LastPixelRLE(row1, numRuns1) == row2[0]; //Bool
-        if (joinRuns) numRunsNew--;
+    return newImage;
+}
 
-        // Allocate row
-        int* newRow = AllocateRLERowArray(numRunsNew + 2);
-        
-        CopyRLERow(newRow, row1);
-        if (joinRuns) {
-            // Sum last run of 1st row with 1st run of last row
-            newRow[numRuns1] += row2[1]; 
-            CopyRLERow(&newRow[numRuns1 + 1], &row2[2]);
+/// Copy the width pixels of the packed row in src from pixel x on into the
+/// packed row in dst.
+static void ExtractBits(uint64_t* dst, const uint64_t* src, uint32 x,
+                        uint32 width) {
+    size_t first = x / 64;
+    uint32 shift = x % 64;
+    size_t last = (x + width - 1) / 64;  // last word of src read
+    for (size_t w = 0; w < ROW_WORDS(width); w++) {
+        uint64_t word = src[first + w] >> shift;
+        if (shift != 0 && first + w + 1 <= last) {
+            word |= src[first + w + 1] << (64 - shift);
+        }
+        dst[w] = word;
+    }
+    ClearPadding(dst, width);
+}
+
+// Operands of a crop, see ImageCrop
+typedef struct {
+    Image newImage;
+    Image img;
+    uint32 x;
+    uint32 y;
+} CropJob;
+
+/// Compute row i of the crop of job.
+/// The window is taken from the row of img as stored: for a view flipped
+/// left-right, that is the mirrored window, whose runs are then reversed.
+static void CropRow(void* job, uint32 i) {
+    const CropJob* crop_job = job;
+    Image newImage = crop_job->newImage;
+    const Image img = crop_job->img;
+    uint32 r = StoredRow(img, crop_job->y + i);  // the row of img
+    const RLERow* row = &img->row[r];
+    int flip = (img->view & VIEW_FLIP_LR) != 0;
+    int color = row->color ^ (img->view & VIEW_NEG);
+    uint32 width = newImage->width;
+    uint32 x = flip ? img->width - crop_job->x - width : crop_job->x;
+    uint32 end = x + width;  // pixel after the window
+
+    if (row->runsize == BITMAP_ROW) {
+        size_t nwords = ROW_WORDS(width);
+        uint64_t* bits = GrowScratch(&BitsScratch,
+                                     2 * nwords * sizeof(uint64_t));
+        ExtractBits(bits, RowBits(img, r), x, width);
+        // Stored relative to the first color
+        uint64_t mask = -(uint64_t)color;
+        for (size_t w = 0; w < nwords; w++) bits[w] ^= mask;
+        ClearPadding(bits, width);
+        if (flip) {
+            MirrorBits(bits + nwords, bits, width);
+            bits += nwords;
+        }
+        EndBitmapRow(newImage, i, bits);
+        return;
+    }
+
+    // Clip the runs of the window: the first one starts at x and the last
+    // one ends at end
+    uint32 start;
+    uint32 k = FindRun(img, r, x, &start);
+    uint32 max_runs = row->nruns - k;
+    if (max_runs > width) max_runs = width;
+    int* newRow = BeginRLERow(newImage, i, color ^ (k & 1), max_runs);
+    const uint8* runs = RowRuns(img, r);
+    uint32 num_runs = 0;
+    uint32 max_run = 0;
+    for (uint32 pos = x; pos < end; k++) {
+        start += GetRun(runs, row->runsize, k);  // end of run k
+        uint32 stop = start < end ? start : end;
+        uint32 run = stop - pos;
+        newRow[num_runs++] = (int)run;
+        if (run > max_run) max_run = run;
+        pos = stop;
+    }
+    if (flip) {
+        // The first run is the last one clipped
+        for (uint32 lo = 0, hi = num_runs - 1; lo < hi; lo++, hi--) {
+            int run = newRow[lo];
+            newRow[lo] = newRow[hi];
+            newRow[hi] = run;
+        }
+        newImage->row[i].color ^= (num_runs - 1) & 1;
+    }
+    EndRLERowMax(newImage, i, num_runs, max_run);
+}
+
+/// Crop img: get its width x height pixels from column x, row y on.
+/// Requires: the window must be inside img (and not empty).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+///
+/// Implementation note: the rows with many runs are indexed (see
+/// ImageGetPixel), so each row of a crop takes O(log runs) to find the
+/// window, and then O(runs in the window): only the first crop of a row
+/// goes through all its runs.
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 width,
+                uint32 height) {
+    assert(img != NULL);
+    assert(width > 0 && height > 0);
+    assert(x <= img->width - width && y <= img->height - height);
+
+    Image newImage = AllocateImageHeader(width, height);
+    if (width == img->width) {
+        // The rows do not change, so they are shared with img, as seen
+        // through its view (the crop is flipped left-right if img is)
+        ShareAllArenas(newImage, img);
+        newImage->view = img->view & VIEW_FLIP_LR;
+        for (uint32 i = 0; i < height; i++) {
+            RLERow* row = &newImage->row[i];
+            *row = *RowOf(img, y + i);
+            row->color ^= img->view & VIEW_NEG;
+            newImage->bytes += RowBytes(width, row);
+            newImage->runs += row->nruns;
+            uint32 first = CountFirst(width,
+                                      RowRuns(img, StoredRow(img, y + i)),
+                                      row->nruns, row->runsize);
+            newImage->black += row->color == BLACK ? first : width - first;
+        }
+        return newImage;
+    }
+
+    // Indexed here, as rows are cropped in parallel
+    for (uint32 i = y; i < y + height; i++) {
+        uint32 r = StoredRow(img, i);
+        if (img->row[r].runsize != BITMAP_ROW &&
+            img->row[r].nruns >= INDEX_MIN_RUNS && !RowIndexed(img, r)) {
+            BuildRowIndex(img, r);
+        }
+    }
+    CropJob job = {newImage, img, x, y};
+    ParallelRows(height, NULL, 0, CropRow, &job);
+
+    return newImage;
+}
+
+/// Pixel after the run holding pixel x of the packed row of width pixels
+/// in bits (whose padding bits are 0)
+static uint32 BitsRunEnd(const uint64_t* bits, uint32 width, uint32 x) {
+    size_t w = x / 64;
+    uint64_t fill = -((bits[w] >> (x % 64)) & 1);  // pixel x, everywhere
+    uint64_t diff = (bits[w] ^ fill) & (~(uint64_t)0 << (x % 64));
+    while (diff == 0) {
+        if (++w == ROW_WORDS(width)) return width;
+        diff = bits[w] ^ fill;
+    }
+    uint32 end = (uint32)(64 * w) + TrailingZeros(diff);
+    return end < width ? end : width;
+}
+
+// Where a sweep of TransposeImage is in a row of an image, as stored: the
+// run holding the first column of the band being swept
+typedef struct {
+    const uint8* runs;  // of the row (or its packed bitmap)
+    uint32 k;           // number of the run (not used for bitmap rows)
+    uint32 end;         // pixel after the run
+    uint8 color;        // of the run
+    uint8 runsize;      // of the row
+} RunCursor;
+
+/// Put cursor c at the first run of row r of img (as stored, but negated
+/// if img is)
+static void FirstRun(const Image img, uint32 r, RunCursor* c) {
+    const RLERow* row = &img->row[r];
+    c->runs = RowRuns(img, r);
+    c->k = 0;
+    c->color = row->color ^ (img->view & VIEW_NEG);
+    c->runsize = row->runsize;
+    c->end = row->runsize == BITMAP_ROW
+             ? BitsRunEnd((const uint64_t*)c->runs, img->width, 0)
+             : GetRun(c->runs, row->runsize, 0);
+}
+
+/// Move cursor c of a row of width pixels to the next run
+static inline void NextRun(RunCursor* c, uint32 width) {
+    c->color ^= 1;
+    if (c->runsize == BITMAP_ROW) {
+        c->end = BitsRunEnd((const uint64_t*)c->runs, width, c->end);
+    } else {
+        c->end += GetRun(c->runs, c->runsize, ++c->k);
+    }
+}
+
+/// Get the runs of columns x0 to x1 - 1 of a row of width pixels, from its
+/// cursor c (at the run holding x0), into runs: the first one starting at
+/// x0 (with color *color) and the last one ending at x1.  c is left at the
+/// run holding x1 - 1.
+/// Returns the number of runs.
+static uint32 BandRuns(int* runs, int* color, RunCursor* c, uint32 width,
+                       uint32 x0, uint32 x1) {
+    *color = c->color;
+    uint32 n = 0;
+    uint32 pos = x0;
+    for (;;) {
+        uint32 end = c->end < x1 ? c->end : x1;
+        runs[n++] = (int)(end - pos);
+        pos = end;
+        if (pos == x1) return n;
+        NextRun(c, width);
+    }
+}
+
+/// Find the columns from x0 to x1 - 1 where two rows differ: runs1, with
+/// first color color1, and runs2, with first color color2.
+/// Stores them as intervals [bounds[2j], bounds[2j+1]) (at most
+/// (x1 - x0 + 1) / 2 of them, as they are not adjacent) and returns how
+/// many there are.
+static uint32 DiffRuns(uint32* bounds, const int* runs1, int color1,
+                       const int* runs2, int color2, uint32 x0, uint32 x1) {
+    uint32 k1 = 0, k2 = 0;
+    uint32 end1 = (uint32)runs1[0], end2 = (uint32)runs2[0];
+    // Skip the runs before x0
+    for (; end1 <= x0; color1 ^= 1) end1 += (uint32)runs1[++k1];
+    for (; end2 <= x0; color2 ^= 1) end2 += (uint32)runs2[++k2];
+
+    uint32 n = 0;
+    uint32 pos = x0;
+    while (pos < x1) {
+        uint32 next = end1 < end2 ? end1 : end2;
+        if (next > x1) next = x1;
+        if (color1 != color2) {
+            if (n > 0 && bounds[2 * n - 1] == pos) {
+                bounds[2 * n - 1] = next;  // extends the previous one
+            } else {
+                bounds[2 * n] = pos;
+                bounds[2 * n + 1] = next;
+                n++;
+            }
+        }
+        pos = next;
+        if (pos == x1) break;
+        if (end1 == pos) {
+            end1 += (uint32)runs1[++k1];
+            color1 ^= 1;
+        }
+        if (end2 == pos) {
+            end2 += (uint32)runs2[++k2];
+            color2 ^= 1;
+        }
+    }
+    return n;
+}
+
+// Most changes of color of the columns of an image recorded at once by
+// TransposeImage (16 MiB)
+#define TRANSPOSE_CHANGES (1u << 22)
+
+/// Sweep the rows of img as stored (negated if img is), top to bottom
+/// (bottom to top if reverse), comparing each one with the previous one
+/// (a WHITE row, for the first one): a column changes color where they
+/// differ.
+/// Only columns x0 to x1 - 1 are looked at, from the cursors of the rows
+/// in cursor (which are then moved to column x1), or from their first
+/// runs if cursor is NULL.
+/// If change is NULL, the changes of each interval of columns are counted
+/// at its ends, in count (modulo 2^32, as the totals fit), so that the
+/// prefix sums of count are the changes of each column.
+/// Otherwise, the rows where the columns change are recorded in change,
+/// those of column x from change[start[x] - start[x0]] on, with count[x]
+/// of them already recorded.
+static void SweepColumns(const Image img, int reverse, RunCursor* cursor,
+                         uint32* count, uint32* change, const size_t* start,
+                         uint32 x0, uint32 x1) {
+    uint32 width = img->width;
+    uint32 height = img->height;
+
+    // The runs of the band in the previous row and in the current one
+    int* prev = malloc((x1 - x0) * sizeof(int));
+    int* cur = malloc((x1 - x0) * sizeof(int));
+    uint32* bounds = malloc((x1 - x0 + 1) * sizeof(uint32));
+    check(prev != NULL && cur != NULL && bounds != NULL, "malloc");
+    prev[0] = (int)(x1 - x0);
+    int prev_color = WHITE;
+    for (uint32 y = 0; y < height; y++) {
+        uint32 r = reverse ? height - 1 - y : y;
+        RunCursor c;
+        if (cursor != NULL) {
+            c = cursor[r];
         } else {
-            CopyRLERow(&newRow[numRuns1 + 1], &row2[1]);
+            FirstRun(img, r, &c);
         }
-        
-        newImage->row[i] = newRow;
+        int color;
+        BandRuns(cur, &color, &c, width, x0, x1);
+        if (cursor != NULL && x1 < width) {
+            // The next band starts at x1
+            while (c.end <= x1) NextRun(&c, width);
+            cursor[r] = c;
+        }
+        uint32 n = DiffRuns(bounds, prev, prev_color, cur, color, 0,
+                            x1 - x0);
+        for (uint32 j = 0; j < n; j++) {
+            uint32 from = x0 + bounds[2 * j];
+            uint32 to = x0 + bounds[2 * j + 1];
+            if (change == NULL) {
+                count[from]++;
+                count[to]--;
+                continue;
+            }
+            for (uint32 x = from; x < to; x++) {
+                change[start[x] - start[x0] + count[x]++] = y;
+            }
+        }
+        int* swap = prev;
+        prev = cur;
+        cur = swap;
+        prev_color = color;
+    }
+    free(prev);
+    free(cur);
+    free(bounds);
+}
+
+// A band of columns of an image, see TransposeImage: the rows where
+// column x (from x0 on) changes color (from WHITE, above the image) are
+// change[start[x] - start[x0]] to change[start[x + 1] - start[x0] - 1]
+typedef struct {
+    Image newImage;
+    const size_t* start;
+    const uint32* change;
+    uint32 x0;
+    int flip;  // whether column x is row newImage->height - 1 - x
+} TransposeJob;
+
+/// Compute the row of the transpose of the image of job with its column
+/// x0 + i
+static void TransposeRow(void* job, uint32 i) {
+    const TransposeJob* transpose_job = job;
+    Image newImage = transpose_job->newImage;
+    const size_t* start = transpose_job->start;
+    uint32 x = transpose_job->x0 + i;
+    const uint32* change = transpose_job->change
+                           + (start[x] - start[transpose_job->x0]);
+    uint32 num_changes = (uint32)(start[x + 1] - start[x]);
+    uint32 r = transpose_job->flip ? newImage->height - 1 - x : x;
+
+    // A change at the top only sets the first color
+    uint32 k = num_changes > 0 && change[0] == 0;
+    int* newRow = BeginRLERow(newImage, r, k ? BLACK : WHITE,
+                              num_changes + 1 - k);
+    uint32 num_runs = 0;
+    uint32 pos = 0;
+    for (; k < num_changes; k++) {
+        newRow[num_runs++] = (int)(change[k] - pos);
+        pos = change[k];
+    }
+    newRow[num_runs++] = (int)(newImage->width - pos);
+    EndRLERow(newImage, r, num_runs);
+}
+
+/// Transpose img (rows become columns), taking its rows bottom to top if
+/// reverse (which mirrors the result left-right) and storing the rows of
+/// the result bottom to top if flip (which mirrors it top-bottom).
+///
+/// Implementation note: img is never unpacked into pixels.  A first sweep
+/// over its rows counts the changes of color of each column (see
+/// SweepColumns).  Then, for each band of columns with at most
+/// TRANSPOSE_CHANGES changes (or a single column), another sweep records
+/// their changes, from which the rows of the result are built, in
+/// parallel.  Each sweep of a band goes on from where the previous one
+/// left each row, so every run is read once per sweep of the whole image.
+/// The rows are swept as stored: flipping img top-bottom reverses the
+/// sweep, and flipping it left-right flips the result top-bottom.
+/// The memory needed, besides the result, is O(width + height) for the
+/// sweeps and O(min(runs of the result, TRANSPOSE_CHANGES + height)) for
+/// the changes.
+static Image TransposeImage(const Image img, int reverse, int flip) {
+    uint32 width = img->width;
+    uint32 height = img->height;
+    if (img->view & VIEW_FLIP_TB) reverse = !reverse;
+    if (img->view & VIEW_FLIP_LR) flip = !flip;
+
+    uint32* count = calloc(width + 1, sizeof(uint32));
+    size_t* start = malloc((width + 1) * sizeof(size_t));
+    check(count != NULL && start != NULL, "malloc");
+    SweepColumns(img, reverse, NULL, count, NULL, NULL, 0, width);
+    start[0] = 0;
+    uint32 changes = 0;  // of column x
+    for (uint32 x = 0; x < width; x++) {
+        changes += count[x];
+        start[x + 1] = start[x] + changes;
+    }
+
+    size_t capacity = start[width] < TRANSPOSE_CHANGES ? start[width]
+                                                       : TRANSPOSE_CHANGES;
+    if (capacity < height) capacity = height;  // the most of a column
+    uint32* change = malloc(capacity * sizeof(uint32));
+    check(change != NULL, "malloc");
+
+    RunCursor* cursor = malloc(height * sizeof(RunCursor));
+    check(cursor != NULL, "malloc");
+    for (uint32 r = 0; r < height; r++) FirstRun(img, r, &cursor[r]);
+
+    Image newImage = AllocateImageHeader(height, width);
+    TransposeJob job = {newImage, start, change, 0, flip};
+    for (uint32 x0 = 0, x1; x0 < width; x0 = x1) {
+        for (x1 = x0 + 1; x1 < width; x1++) {
+            if (start[x1 + 1] - start[x0] > capacity) break;
+        }
+        memset(count + x0, 0, (x1 - x0) * sizeof(uint32));
+        SweepColumns(img, reverse, cursor, count, change, start, x0, x1);
+        job.x0 = x0;
+        ParallelRows(x1 - x0, NULL, 0, TransposeRow, &job);
     }
+    free(cursor);
+    free(count);
+    free(start);
+    free(change);
 
     return newImage;
 }
+
+/// Transpose img: column x of img is row x of the result.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTranspose(const Image img) {
+    assert(img != NULL);
+    return TransposeImage(img, 0, 0);
+}
+
+/// Rotate img 90 degrees clockwise: column x of img, bottom to top, is
+/// row x of the result.
+Image ImageRotate90(const Image img) {
+    assert(img != NULL);
+    return TransposeImage(img, 1, 0);
+}
+
+/// Rotate img 90 degrees counterclockwise (270 clockwise): column x of
+/// img is row width - 1 - x of the result.
+Image ImageRotate270(const Image img) {
+    assert(img != NULL);
+    return TransposeImage(img, 0, 1);
+}
+
+/// Morphology
+
+// Operands of the horizontal dilation of an image, see GrowRuns
+typedef struct {
+    Image result;
+    Image img;
+    uint32 before;  // pixels of the window left of each pixel
+    uint32 after;   // and right of it
+} GrowJob;
+
+/// Compute row i of the horizontal dilation of job: each BLACK run
+/// [start, end) of img grows to [start - after, end + before).
+static void GrowRow(void* job, uint32 i) {
+    const GrowJob* grow_job = job;
+    Image result = grow_job->result;
+    const Image img = grow_job->img;
+    uint32 width = img->width;
+    uint32 before = grow_job->before;
+    uint32 after = grow_job->after;
+    uint32 num_runs = RowOf(img, i)->nruns;
+    int color = RowColor(img, i);
+    int* runs = GrowScratch(&DecodeScratch, (size_t)width * sizeof(int));
+    DecodeRLERow(runs, img, i);
+
+    // Runs only grow, or merge, so there are no more of them
+    uint32 first = color == BLACK ? 0 : (uint32)runs[0];  // BLACK pixel
+    int first_color = num_runs > 1 || color == BLACK ?
+                      (first <= after ? BLACK : WHITE) : WHITE;
+    int* newRow = BeginRLERow(result, i, first_color, num_runs);
+    uint32 num_runs_new = 0;
+    uint32 pos = 0;  // end of the runs of newRow
+    uint32 x = 0;
+    for (uint32 k = 0; k < num_runs; k++, color ^= 1) {
+        uint32 end = x + (uint32)runs[k];
+        if (color == BLACK) {
+            uint32 from = x > after ? x - after : 0;
+            uint32 to = end < width - before ? end + before : width;
+            if (num_runs_new == 0 && from == 0) {
+                newRow[num_runs_new++] = (int)to;
+            } else if (from > pos) {
+                newRow[num_runs_new++] = (int)(from - pos);
+                newRow[num_runs_new++] = (int)(to - from);
+            } else {
+                newRow[num_runs_new - 1] += (int)(to - pos);  // joined
+            }
+            pos = to;
+        }
+        x = end;
+    }
+    if (pos < width) newRow[num_runs_new++] = (int)(width - pos);
+    EndRLERow(result, i, num_runs_new);
+}
+
+/// Dilate img horizontally: pixel x of a row of the result is BLACK if
+/// any of the pixels from x - before to x + after of the row of img is.
+/// Takes O(runs), whatever the size of the window.
+static Image GrowRuns(const Image img, uint32 before, uint32 after) {
+    // Larger windows add no pixels
+    if (before >= img->width) before = img->width - 1;
+    if (after >= img->width) after = img->width - 1;
+
+    Image result = AllocateImageHeader(img->width, img->height);
+    GrowJob job = {result, img, before, after};
+    Image operands[] = {img};
+    ParallelRows(img->height, operands, 1, GrowRow, &job);
+    return result;
+}
+
+/// Store in dst the runs of a row of width pixels, with num_runs runs in
+/// src and first color color, shifted left by shift pixels: pixel
+/// x + shift of the row is pixel x of dst, and those outside it are WHITE.
+/// Returns the number of runs of dst (at most width), whose first color
+/// is stored in *dst_color.
+static uint32 ShiftRuns(int* dst, int* dst_color, const int* src,
+                        uint32 num_runs, int color, int64_t shift,
+                        uint32 width) {
+    uint32 n = 0;
+    int last = WHITE;  // color of dst[n - 1]
+    int64_t pos = shift;  // pixel of the row that is the next one of dst
+    int64_t end = shift + width;
+    if (shift < 0) {
+        dst[n++] = (int)(-shift < width ? -shift : width);
+        pos = 0;
+    }
+    int64_t x = 0;
+    for (uint32 k = 0; k < num_runs && pos < end; k++, color ^= 1) {
+        int64_t stop = x + src[k];
+        if (stop > end) stop = end;
+        if (stop > pos) {
+            if (n > 0 && last == color) {
+                dst[n - 1] += (int)(stop - pos);
+            } else {
+                if (n == 0) *dst_color = color;
+                dst[n++] = (int)(stop - pos);
+                last = color;
+            }
+            pos = stop;
+        }
+        x += src[k];
+    }
+    if (n == 0 || shift < 0) *dst_color = WHITE;
+    if (pos < end) {
+        if (last == WHITE && n > 0) {
+            dst[n - 1] += (int)(end - pos);
+        } else {
+            dst[n++] = (int)(end - pos);
+        }
+    }
+    return n;
+}
+
+// Operands of a step of the dilation of an image along a line, see
+// DilateLine: row i of result is the OR of row i + first1 of img, shifted
+// left by shift1 pixels, and row i + first2, shifted by shift2 (rows
+// and pixels outside img are WHITE)
+typedef struct {
+    Image result;
+    Image img;
+    int64_t first1;
+    int64_t first2;
+    int64_t shift1;
+    int64_t shift2;
+} LineJob;
+
+/// Compute row i of the step of job
+static void LineRow(void* job, uint32 i) {
+    const LineJob* line_job = job;
+    Image result = line_job->result;
+    const Image img = line_job->img;
+    uint32 width = result->width;
+    int64_t r1 = i + line_job->first1;
+    int64_t r2 = i + line_job->first2;
+    int in1 = r1 >= 0 && r1 < img->height;
+    int in2 = r2 >= 0 && r2 < img->height;
+    if (in1 && in2 && line_job->shift1 == 0 && line_job->shift2 == 0 &&
+        img->width == width) {
+        BooleanRowsOf(result, i, BOOL_OR, img, (uint32)r1, img, (uint32)r2);
+        return;
+    }
+
+    // Rows decoded, then shifted
+    int* runs = GrowScratch(&DecodeScratch, ((size_t)img->width + 2 * width)
+                                            * sizeof(int));
+    int* rows[2] = {runs + img->width, runs + img->width + width};
+    int64_t r[2] = {r1, r2};
+    int in[2] = {in1, in2};
+    int64_t shift[2] = {line_job->shift1, line_job->shift2};
+    uint32 num_runs[2];
+    int color[2];
+    for (int k = 0; k < 2; k++) {
+        if (!in[k]) {
+            rows[k][0] = (int)width;
+            num_runs[k] = 1;
+            color[k] = WHITE;
+            continue;
+        }
+        uint32 row = (uint32)r[k];
+        DecodeRLERow(runs, img, row);
+        num_runs[k] = ShiftRuns(rows[k], &color[k], runs,
+                                RowOf(img, row)->nruns, RowColor(img, row),
+                                shift[k], width);
+    }
+    BoolMergeRows(result, i, BOOL_OR, rows[0], num_runs[0], color[0],
+                  rows[1], num_runs[1], color[1]);
+}
+
+/// Dilate img along a line: pixel (x, y) of the result is BLACK if any of
+/// the pixels (x + k * dx, y + k) of img is, for k from -before to after.
+/// Requires: before and after differ by at most 1.
+///
+/// Implementation note: as in a sparse table, row t + 2^j - 1 of level j
+/// is the OR of rows t to t + 2^j - 1 of img (each shifted along the
+/// line), computed from two rows of level j - 1.  Then each row of the
+/// result is the OR of two rows of the last level, whose windows overlap
+/// to cover its own.  So the rows are merged O(log(before + after)) times,
+/// two at a time, instead of before + after times.
+/// The rows of the levels of slanted lines have margins, so that no pixel
+/// shifted out of them is needed when shifted back for the result.
+static Image DilateLine(const Image img, int dx, uint32 before,
+                        uint32 after) {
+    assert(before <= after + 1 && after <= before + 1);
+    uint32 width = img->width;
+    uint32 height = img->height;
+    // Rows outside img add no pixels
+    if (before >= height) before = height - 1;
+    if (after >= height) after = height - 1;
+    uint32 n = before + after + 1;
+    uint32 margin = dx == 0 ? 0 : (before > after ? before : after);
+
+    // Rows of level j (of size 2^j), from 2^j - 1 rows above img on
+    Image level = img;
+    uint32 size = 1;
+    int64_t offset = 0;  // pixels of level left of img
+    while (2 * size <= n) {
+        Image next = AllocateImageHeader(width + 2 * margin,
+                                         height + 2 * size - 1);
+        LineJob job = {next, level, -(int64_t)size, 0, offset - margin,
+                       offset - margin + (int64_t)size * dx};
+        ParallelRows(next->height, NULL, 0, LineRow, &job);
+        if (level != img) ImageDestroy(&level);
+        level = next;
+        size *= 2;
+        offset = margin;
+    }
+
+    Image result = AllocateImageHeader(width, height);
+    LineJob job = {result, level, (int64_t)size - 1 - before, after,
+                   offset - (int64_t)before * dx,
+                   offset + ((int64_t)after + 1 - size) * dx};
+    ParallelRows(height, NULL, 0, LineRow, &job);
+    if (level != img) ImageDestroy(&level);
+    return result;
+}
+
+/// Dilate img by each segment of se, one after the other (reflected if
+/// reflect): pixel p of the result is BLACK if any pixel of img in the
+/// window p + se (p - se, if reflect) is.
+static Image DilateBy(const Image img, ImageStructElem se, int reflect) {
+    uint32 lengths[] = {se.width, se.height, se.diagonal, se.antidiagonal};
+    int dx[] = {0, 0, 1, -1};  // of the lines, one row down
+
+    Image result = ShareImage(img);
+    for (int s = 0; s < 4; s++) {
+        if (lengths[s] <= 1) continue;
+        // Pixels of the segment before its origin, which is its middle
+        uint32 before = (lengths[s] - 1) / 2;
+        uint32 after = lengths[s] - 1 - before;
+        if (reflect) {
+            uint32 swap = before;
+            before = after;
+            after = swap;
+        }
+        Image next = s == 0 ? GrowRuns(result, before, after)
+                            : DilateLine(result, dx[s], before, after);
+        ImageDestroy(&result);
+        result = next;
+    }
+    return result;
+}
+
+/// Dilate img by the structuring element se.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+///
+/// Implementation note: horizontal segments grow the runs of each row, in
+/// O(runs), and the others merge rows two at a time, O(log length) times
+/// (see DilateLine), so the cost depends little on the size of se.
+Image ImageDilate(const Image img, ImageStructElem se) {
+    assert(img != NULL);
+    return DilateBy(img, se, 1);
+}
+
+/// Erode img by the structuring element se (pixels outside img count as
+/// BLACK).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageErode(const Image img, ImageStructElem se) {
+    assert(img != NULL);
+    // The negation of the dilation of the negation of img (by se itself),
+    // all of them views
+    Image neg = NewView(img, VIEW_NEG);
+    Image result = DilateBy(neg, se, 0);
+    ImageDestroy(&neg);
+    ImageNEGInPlace(result);
+    return result;
+}
+
+/// Open img by se: dilate its erosion.
+Image ImageOpen(const Image img, ImageStructElem se) {
+    assert(img != NULL);
+    Image eroded = ImageErode(img, se);
+    Image result = ImageDilate(eroded, se);
+    ImageDestroy(&eroded);
+    return result;
+}
+
+/// Close img by se: erode its dilation.
+Image ImageClose(const Image img, ImageStructElem se) {
+    assert(img != NULL);
+    Image dilated = ImageDilate(img, se);
+    Image result = ImageErode(dilated, se);
+    ImageDestroy(&dilated);
+    return result;
+}
+
+/// Lazy expressions
+
+// An expression is a DAG of operations on images, which are evaluated
+// only when its image is needed (see ImageExprEval).
+// Nodes are reference counted: each node counts the handles returned to
+// the caller and the nodes that use it as an operand.
+
+// Kinds of nodes
+enum {
+    EXPR_IMAGE,     // an image (given, or already evaluated)
+    EXPR_FILE,      // the image in a PBM file, read a row at a time
+    EXPR_NEG,
+    EXPR_BOOLEAN,   // op(arg[0], arg[1])
+    EXPR_HMIRROR,
+    EXPR_VMIRROR,
+    EXPR_REPB,      // arg[1] at the bottom of arg[0]
+    EXPR_REPR,      // arg[1] at the right of arg[0]
+    EXPR_CROP       // a window of arg[0], at x, y
+};
+
+struct imageExpr {
+    uint32 refs;
+    uint8 kind;
+    uint8 op;          // truth table, for EXPR_BOOLEAN
+    uint8 copy_left;   // whether evaluating arg[1] may overwrite arg[0]
+    uint32 width;
+    uint32 height;
+    ImageExpr arg[2];  // operands (NULL if not used)
+    Image img;         // the image, for EXPR_IMAGE
+    FILE* file;        // the PBM file, for EXPR_FILE
+    size_t pixels;     // position of its first row of pixels
+    uint32 x;          // position of the window, for EXPR_CROP
+    uint32 y;
+    uint32 stamp;      // last evaluation that visited the node
+    uint32 visit;      // last search that visited the node (see ExprUses)
+    uint32 index;      // position of the node in that evaluation
+};
+
+/// Create a node with the given operands, which get one more reference.
+static ImageExpr NewExpr(uint8 kind, uint32 width, uint32 height,
+                         ImageExpr arg0, ImageExpr arg1) {
+    ImageExpr e = AllocBlock(sizeof(struct imageExpr));
+    e->refs = 1;
+    e->kind = kind;
+    e->op = 0;
+    e->copy_left = 0;
+    e->width = width;
+    e->height = height;
+    e->arg[0] = arg0;
+    e->arg[1] = arg1;
+    if (arg0 != NULL) arg0->refs++;
+    if (arg1 != NULL) arg1->refs++;
+    e->img = NULL;
+    e->file = NULL;
+    e->pixels = 0;
+    e->x = 0;
+    e->y = 0;
+    e->stamp = 0;
+    e->visit = 0;
+    e->index = 0;
+    return e;
+}
+
+/// Drop a reference to e, destroying it (and maybe its operands) if it was
+/// the last one.
+static void ReleaseExpr(ImageExpr e) {
+    if (e == NULL || --e->refs > 0) return;
+    ImageDestroy(&e->img);
+    if (e->file != NULL) fclose(e->file);
+    ReleaseExpr(e->arg[0]);
+    ReleaseExpr(e->arg[1]);
+    FreeBlock(e, sizeof(struct imageExpr));
+}
+
+ImageExpr ImageExprOf(const Image img) {
+    assert(img != NULL);
+    ImageExpr e = NewExpr(EXPR_IMAGE, img->width, img->height, NULL, NULL);
+    e->img = ShareImage(img);  // O(1): the rows are shared
+    return e;
+}
+
+ImageExpr ImageExprOfFile(const char* filename) {
+    PBMFile pbm;
+    FileData file = {NULL, 0, 0};
+    Image img = NULL;
+    if (!OpenPBMFile(filename, &pbm, &file)) {
+        // Mapped at once, with no decoding: nothing to gain by streaming it
+        img = MapRLEImage(file);
+    } else if (pbm.in_order) {
+        // Rows may be needed in any order (or more than once): load it
+        img = LoadPBMFile(&pbm);
+    }
+    if (img != NULL) {
+        ImageExpr e = ImageExprOf(img);
+        ImageDestroy(&img);
+        return e;
+    }
+
+    ImageExpr e = NewExpr(EXPR_FILE, pbm.w, pbm.h, NULL, NULL);
+    e->file = pbm.f;
+    e->pixels = pbm.pixels;
+    free(pbm.head);
+    return e;
+}
+
+ImageExpr ImageExprNEG(ImageExpr e) {
+    assert(e != NULL);
+    return NewExpr(EXPR_NEG, e->width, e->height, e, NULL);
+}
+
+ImageExpr ImageExprBoolean(ImageExpr e1, ImageExpr e2, uint8 op) {
+    assert(e1 != NULL && e2 != NULL);
+    assert(e1->width == e2->width && e1->height == e2->height);
+    assert(op <= 0xF);
+    ImageExpr e = NewExpr(EXPR_BOOLEAN, e1->width, e1->height, e1, e2);
+    e->op = op;
+    return e;
+}
+
+ImageExpr ImageExprHorizontalMirror(ImageExpr e) {
+    assert(e != NULL);
+    return NewExpr(EXPR_HMIRROR, e->width, e->height, e, NULL);
+}
+
+ImageExpr ImageExprVerticalMirror(ImageExpr e) {
+    assert(e != NULL);
+    return NewExpr(EXPR_VMIRROR, e->width, e->height, e, NULL);
+}
+
+ImageExpr ImageExprReplicateAtBottom(ImageExpr e1, ImageExpr e2) {
+    assert(e1 != NULL && e2 != NULL);
+    assert(e1->width == e2->width);
+    return NewExpr(EXPR_REPB, e1->width, e1->height + e2->height, e1, e2);
+}
+
+ImageExpr ImageExprReplicateAtRight(ImageExpr e1, ImageExpr e2) {
+    assert(e1 != NULL && e2 != NULL);
+    assert(e1->height == e2->height);
+    return NewExpr(EXPR_REPR, e1->width + e2->width, e1->height, e1, e2);
+}
+
+ImageExpr ImageExprCrop(ImageExpr e, uint32 x, uint32 y, uint32 width,
+                        uint32 height) {
+    assert(e != NULL);
+    assert(width > 0 && height > 0);
+    assert(x <= e->width - width && y <= e->height - height);
+    ImageExpr crop = NewExpr(EXPR_CROP, width, height, e, NULL);
+    crop->x = x;
+    crop->y = y;
+    return crop;
+}
+
+int ImageExprWidth(const ImageExpr e) {
+    assert(e != NULL);
+    return e->width;
+}
+
+int ImageExprHeight(const ImageExpr e) {
+    assert(e != NULL);
+    return e->height;
+}
+
+void ImageExprDestroy(ImageExpr* ep) {
+    assert(ep != NULL);
+    ReleaseExpr(*ep);
+    *ep = NULL;
+}
+
+/// Fused evaluation
+
+// Nodes are evaluated a row at a time, as packed rows (see PackRow), each
+// node writing its row to its own buffer, so no intermediate images are
+// built.
+// Rows of a single color (blank rows, typically) are not packed: only
+// their color is kept.
+// Nodes that only choose a row (mirroring top-bottom, replicating at the
+// bottom) or keep an operand unchanged return the row of the operand.
+
+// An evaluation of an expression
+typedef struct {
+    Image result;
+    ImageExpr root;
+    ImageExpr* node;   // the nodes, each after its operands
+    size_t* offset;    // first word of the row of each node, in the buffer
+    uint32 count;      // number of nodes
+    size_t words;      // words for the rows of all nodes
+    uint32 serial;     // identifies the evaluation (and stamps its nodes)
+} ExprJob;
+
+// Evaluation state of each thread
+typedef struct {
+    uint64_t* words;         // the rows of the nodes
+    const uint64_t** bits;   // packed row of each node (NULL if uniform)
+    uint32* row;             // row i of each node (UINT32_MAX if none)
+    int* color;              // color of uniform rows
+} ExprState;
+
+static uint32 ExprSerial = 0;     // evaluations started
+static uint32 ExprVisit = 0;      // searches that visited nodes
+static _Thread_local uint32 ExprScratchSerial = 0;
+
+/// Set pixels from to to - 1 of the packed row in bits (to BLACK)
+static void SetBits(uint64_t* bits, uint32 from, uint32 to) {
+    for (uint32 x = from; x < to;) {
+        uint32 shift = x % 64;
+        uint32 n = to - x < 64 - shift ? to - x : 64 - shift;
+        uint64_t ones = n == 64 ? ~(uint64_t)0 : ((uint64_t)1 << n) - 1;
+        bits[x / 64] |= ones << shift;
+        x += n;
+    }
+}
+
+/// OR the packed row of width pixels in src into dst, from pixel x on.
+/// Requires: the padding bits of src are 0.
+static void OrBitsAt(uint64_t* dst, uint32 x, const uint64_t* src,
+                     uint32 width) {
+    size_t first = x / 64;
+    uint32 shift = x % 64;
+    size_t nwords = ROW_WORDS(width);
+    size_t last = (x + width - 1) / 64;  // last word of dst written
+    for (size_t w = 0; w < nwords; w++) {
+        dst[first + w] |= src[w] << shift;
+        if (shift != 0 && first + w + 1 <= last) {
+            dst[first + w + 1] |= src[w] >> (64 - shift);
+        }
+    }
+}
+
+/// Evaluate row i of e, for the evaluation of state.
+/// Returns the packed row, or NULL if it has a single color, stored in
+/// *color.
+static const uint64_t* EvalExprRow(ExprState* state, const ExprJob* job,
+                                   ImageExpr e, uint32 i, int* color) {
+    uint32 k = e->index;
+    if (state->row[k] == i) {
+        *color = state->color[k];
+        return state->bits[k];
+    }
+    uint64_t* dst = state->words + job->offset[k];
+    size_t nwords = ROW_WORDS(e->width);
+    const uint64_t* bits = dst;
+    int c = WHITE;
+    switch (e->kind) {
+        case EXPR_IMAGE:
+            if (RowOf(e->img, i)->nruns == 1) {
+                bits = NULL;
+                c = RowColor(e->img, i);
+            } else {
+                PackRow(dst, e->img, i);
+            }
+            break;
+        case EXPR_FILE: {
+            // Rows have a fixed size, so any row can be read directly
+            size_t nbytes = (e->width + 8 - 1) / 8;
+            ReadAt(e->file, dst, nbytes, e->pixels + i * nbytes);
+            PBMRowToBits(dst, (const uint8*)dst, nbytes);  // in place
+            ClearPadding(dst, e->width);
+            break;
+        }
+        case EXPR_NEG:
+            bits = EvalExprRow(state, job, e->arg[0], i, &c);
+            if (bits == NULL) {
+                c ^= 1;
+            } else {
+                BoolWords(dst, bits, bits, nwords, 0x3);  // not p1
+                BOOL_OP += nwords;
+                ClearPadding(dst, e->width);
+                bits = dst;
+            }
+            break;
+        case EXPR_BOOLEAN: {
+            int c1, c2;
+            const uint64_t* a = EvalExprRow(state, job, e->arg[0], i, &c1);
+            if (a != NULL && e->copy_left) {
+                memcpy(dst, a, nwords * sizeof(uint64_t));
+                a = dst;
+            }
+            const uint64_t* b = EvalExprRow(state, job, e->arg[1], i, &c2);
+            if (a != NULL && b != NULL) {
+                BoolWords(dst, a, b, nwords, e->op);
+                BOOL_OP += nwords;
+                ClearPadding(dst, e->width);
+                break;
+            }
+            if (a == NULL && b == NULL) {
+                bits = NULL;
+                c = BoolValue(e->op, c1, c2);
+                break;
+            }
+            // A single color operand: the result is a single color,
+            // the other operand, or its negation
+            const uint64_t* x = a != NULL ? a : b;
+            int value0 = a != NULL ? BoolValue(e->op, 0, c2)
+                                   : BoolValue(e->op, c1, 0);
+            int value1 = a != NULL ? BoolValue(e->op, 1, c2)
+                                   : BoolValue(e->op, c1, 1);
+            if (value0 == value1) {
+                bits = NULL;
+                c = value0;
+            } else if (value0 == 0) {
+                bits = x;
+            } else {
+                BoolWords(dst, x, x, nwords, 0x3);  // not p1
+                BOOL_OP += nwords;
+                ClearPadding(dst, e->width);
+            }
+            break;
+        }
+        case EXPR_HMIRROR:
+            bits = EvalExprRow(state, job, e->arg[0], e->height - 1 - i, &c);
+            break;
+        case EXPR_VMIRROR:
+            bits = EvalExprRow(state, job, e->arg[0], i, &c);
+            if (bits != NULL) {
+                MirrorBits(dst, bits, e->width);
+                bits = dst;
+            }
+            break;
+        case EXPR_REPB:
+            if (i < e->arg[0]->height) {
+                bits = EvalExprRow(state, job, e->arg[0], i, &c);
+            } else {
+                bits = EvalExprRow(state, job, e->arg[1],
+                                   i - e->arg[0]->height, &c);
+            }
+            break;
+        case EXPR_REPR: {
+            // The left row is consumed before evaluating the right one
+            uint32 width1 = e->arg[0]->width;
+            int c1, c2;
+            const uint64_t* a = EvalExprRow(state, job, e->arg[0], i, &c1);
+            memset(dst, 0, nwords * sizeof(uint64_t));
+            if (a != NULL) {
+                memcpy(dst, a, ROW_WORDS(width1) * sizeof(uint64_t));
+            } else if (c1 == BLACK) {
+                SetBits(dst, 0, width1);
+            }
+            const uint64_t* b = EvalExprRow(state, job, e->arg[1], i, &c2);
+            if (a == NULL && b == NULL && c1 == c2) {
+                bits = NULL;
+                c = c1;
+            } else if (b != NULL) {
+                OrBitsAt(dst, width1, b, e->arg[1]->width);
+            } else if (c2 == BLACK) {
+                SetBits(dst, width1, e->width);
+            }
+            break;
+        }
+        case EXPR_CROP:
+            bits = EvalExprRow(state, job, e->arg[0], e->y + i, &c);
+            if (bits != NULL && e->width != e->arg[0]->width) {
+                ExtractBits(dst, bits, e->x, e->width);
+                bits = dst;
+            }
+            break;
+    }
+
+    // Keep rows that are in the buffer of the node (or a single color):
+    // those of operands may be overwritten later
+    if (bits == NULL || bits == dst) {
+        state->row[k] = i;
+        state->bits[k] = bits;
+        state->color[k] = c;
+    }
+    *color = c;
+    return bits;
+}
+
+/// Get the evaluation state of the calling thread for the evaluation job.
+/// The buffers are set up once per evaluation.
+static ExprState ExprThreadState(const ExprJob* job) {
+    uint32 count = job->count;
+    size_t size = job->words * sizeof(uint64_t) +
+                  count * (sizeof(uint64_t*) + sizeof(uint32) + sizeof(int));
+    uint8* scratch = GrowScratch(&ExprScratch, size);
+    ExprState state;
+    state.words = (uint64_t*)scratch;
+    scratch += job->words * sizeof(uint64_t);
+    state.bits = (const uint64_t**)scratch;
+    scratch += count * sizeof(uint64_t*);
+    state.row = (uint32*)scratch;
+    scratch += count * sizeof(uint32);
+    state.color = (int*)scratch;
+    if (ExprScratchSerial != job->serial) {
+        for (uint32 k = 0; k < count; k++) state.row[k] = UINT32_MAX;
+        ExprScratchSerial = job->serial;
+    }
+    return state;
+}
+
+/// Compute row i of the result of the evaluation job
+static void ExprRow(void* job, uint32 i) {
+    const ExprJob* expr_job = job;
+    ExprState state = ExprThreadState(expr_job);
+
+    Image result = expr_job->result;
+    int color;
+    const uint64_t* bits = EvalExprRow(&state, expr_job, expr_job->root, i,
+                                       &color);
+    if (bits == NULL) {
+        int* runs = BeginRLERow(result, i, color, 1);
+        runs[0] = (int)result->width;
+        EndRLERowMax(result, i, 1, result->width);
+    } else {
+        EndBitmapRow(result, i, bits);
+    }
+}
+
+/// Whether e is, or uses, a node marked with visit mark, visiting each
+/// node once, with visit search.
+static int ExprUses(ImageExpr e, uint32 mark, uint32 search) {
+    if (e == NULL || e->visit == search) return 0;
+    if (e->visit == mark) return 1;
+    e->visit = search;
+    return ExprUses(e->arg[0], mark, search) ||
+           ExprUses(e->arg[1], mark, search);
+}
+
+/// Mark e and the nodes it uses with visit mark
+static void MarkExpr(ImageExpr e, uint32 mark) {
+    if (e == NULL || e->visit == mark) return;
+    e->visit = mark;
+    MarkExpr(e->arg[0], mark);
+    MarkExpr(e->arg[1], mark);
+}
+
+/// Append the nodes of e not yet visited to job, operands first
+static void CollectExpr(ExprJob* job, ImageExpr e, uint32 stamp,
+                        size_t* capacity) {
+    if (e->stamp == stamp) return;
+    e->stamp = stamp;
+    if (e->arg[0] != NULL) CollectExpr(job, e->arg[0], stamp, capacity);
+    if (e->arg[1] != NULL) CollectExpr(job, e->arg[1], stamp, capacity);
+    if (job->count == *capacity) {
+        *capacity = 2 * *capacity + 8;
+        job->node = realloc(job->node, *capacity * sizeof(ImageExpr));
+        check(job->node != NULL, "realloc");
+    }
+    e->index = job->count;
+    job->node[job->count++] = e;
+}
+
+/// Set up job for the evaluation of e (without a result image).
+static void BeginExprJob(ExprJob* job, ImageExpr e) {
+    *job = (ExprJob){NULL, e, NULL, NULL, 0, 0, ++ExprSerial};
+    size_t capacity = 0;
+    CollectExpr(job, e, job->serial, &capacity);
+
+    job->offset = malloc(job->count * sizeof(size_t));
+    check(job->offset != NULL, "malloc");
+    for (uint32 k = 0; k < job->count; k++) {
+        ImageExpr node = job->node[k];
+        job->offset[k] = job->words;
+        job->words += ROW_WORDS(node->width);
+    }
+    // The row of the left operand of a boolean node must be copied if the
+    // right operand shares nodes with it (and may evaluate them for other
+    // rows)
+    for (uint32 k = 0; k < job->count; k++) {
+        ImageExpr node = job->node[k];
+        if (node->kind == EXPR_BOOLEAN) {
+            uint32 mark = ++ExprVisit;
+            MarkExpr(node->arg[0], mark);
+            uint32 search = ++ExprVisit;
+            node->copy_left = (uint8)ExprUses(node->arg[1], mark, search);
+        }
+    }
+}
+
+/// Free what was allocated by BeginExprJob
+static void EndExprJob(ExprJob* job) {
+    free(job->offset);
+    free(job->node);
+}
+
+/// Compute the image of e in a single pass over its rows, with all its
+/// operations fused.
+static Image EvalFused(ImageExpr e) {
+    ExprJob job;
+    BeginExprJob(&job, e);
+    job.result = AllocateImageHeader(e->width, e->height);
+    ParallelRows(e->height, NULL, 0, ExprRow, &job);
+    EndExprJob(&job);
+    return job.result;
+}
+
+// Rows of the image of an expression being saved, see ImageExprSave
+typedef struct {
+    const ExprJob* expr;
+    uint8* buffer;   // PBM rows
+    size_t nbytes;   // bytes of each row
+    uint32 first;    // row of the image in buffer[0]
+} SaveJob;
+
+/// Compute row first + i of the image of job and write it to the buffer
+static void SaveRow(void* job, uint32 i) {
+    const SaveJob* save_job = job;
+    ExprState state = ExprThreadState(save_job->expr);
+    uint8* bytes = save_job->buffer + i * save_job->nbytes;
+    int color;
+    const uint64_t* bits = EvalExprRow(&state, save_job->expr,
+                                       save_job->expr->root,
+                                       save_job->first + i, &color);
+    if (bits != NULL) {
+        BitsToPBMRow(bytes, bits, save_job->nbytes);
+        return;
+    }
+    memset(bytes, color == BLACK ? 0xFF : 0, save_job->nbytes);
+    uint32 width = save_job->expr->root->width;
+    if (width % 8 != 0) {
+        bytes[save_job->nbytes - 1] &= 0xFF << (8 - width % 8);  // padding
+    }
+}
+
+int ImageExprSave(ImageExpr e, const char* filename) {
+    assert(e != NULL);
+    if (e->kind == EXPR_IMAGE) return ImageSave(e->img, filename);
+
+    int w = e->width;
+    int h = e->height;
+    SaveFile save = OpenSaveFile(filename);
+    FILE* f = save.f;
+
+    check(fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed");
+
+    // Write pixels
+    // Rows are computed a buffer at a time (in parallel, if there are
+    // threads) and written, as in ImageSave.
+    ExprJob expr;
+    BeginExprJob(&expr, e);
+    size_t nbytes = ((size_t)w + 8 - 1) / 8;  // number of bytes for each row
+    size_t buffer_rows = nbytes > 0 && SAVE_BUFFER_SIZE / nbytes > 0
+                         ? SAVE_BUFFER_SIZE / nbytes : 1;
+    uint8* buffer = malloc(buffer_rows * nbytes + 1);  // (+1: no 0 size)
+    check(buffer != NULL, "malloc");
+    SaveJob job = {&expr, buffer, nbytes, 0};
+    for (; job.first < e->height; job.first += buffer_rows) {
+        uint32 rows = e->height - job.first < buffer_rows
+                      ? e->height - job.first : (uint32)buffer_rows;
+        ParallelRows(rows, NULL, 0, SaveRow, &job);
+        size_t written = fwrite(buffer, nbytes, rows, f);
+        check(written == rows || nbytes == 0, "Writing pixels failed");
+    }
+    free(buffer);
+    EndExprJob(&expr);
+
+    // Cleanup
+    CloseSaveFile(&save, "Writing pixels failed");
+    return 0;
+}
+
+/// Compute the image of e, whose operands are images, with the operation
+/// itself.
+static Image EvalDirect(ImageExpr e) {
+    Image img1 = e->arg[0]->img;
+    Image img2 = e->arg[1] != NULL ? e->arg[1]->img : NULL;
+    if (e->arg[0]->refs == 1 && e->arg[1] != e->arg[0]) {
+        // No one else uses img1 (it is released next): operate in place
+        switch (e->kind) {
+            case EXPR_NEG:
+                ImageNEGInPlace(img1);
+                break;
+            case EXPR_BOOLEAN:
+                ImageBooleanInPlace(img1, img2, e->op);
+                break;
+            case EXPR_HMIRROR:
+                ImageHorizontalMirrorInPlace(img1);
+                break;
+            case EXPR_VMIRROR:
+                ImageVerticalMirrorInPlace(img1);
+                break;
+            default:
+                img1 = NULL;
+                break;
+        }
+        if (img1 != NULL) {
+            e->arg[0]->img = NULL;  // now the image of e
+            return img1;
+        }
+        img1 = e->arg[0]->img;
+    }
+    switch (e->kind) {
+        case EXPR_NEG:
+            return ImageNEG(img1);
+        case EXPR_BOOLEAN:
+            return ImageBoolean(img1, img2, e->op);
+        case EXPR_HMIRROR:
+            return ImageHorizontalMirror(img1);
+        case EXPR_VMIRROR:
+            return ImageVerticalMirror(img1);
+        case EXPR_REPB:
+            return ImageReplicateAtBottom(img1, img2);
+        case EXPR_CROP:
+            return ImageCrop(img1, e->x, e->y, e->width, e->height);
+        default:
+            return ImageReplicateAtRight(img1, img2);
+    }
+}
+
+/// Whether e only negates or mirrors an image (any number of times)
+static int IsViewExpr(const ImageExpr e) {
+    if (e->kind == EXPR_IMAGE) return 1;
+    if (e->kind != EXPR_NEG && e->kind != EXPR_HMIRROR &&
+        e->kind != EXPR_VMIRROR) {
+        return 0;
+    }
+    return IsViewExpr(e->arg[0]);
+}
+
+Image ImageExprEval(ImageExpr e) {
+    assert(e != NULL);
+    if (e->kind != EXPR_IMAGE && IsViewExpr(e)) {
+        // Views of an image are made in O(1) each: one at a time
+        Image view = ImageExprEval(e->arg[0]);
+        ImageDestroy(&view);
+    }
+    if (e->kind != EXPR_IMAGE) {
+        // A single operation on images is done directly (in the best way
+        // for it), otherwise all are fused
+        int direct = e->kind != EXPR_FILE &&
+                     e->arg[0]->kind == EXPR_IMAGE &&
+                     (e->arg[1] == NULL || e->arg[1]->kind == EXPR_IMAGE);
+        Image img = direct ? EvalDirect(e) : EvalFused(e);
+
+        // Keep the image, in place of the operations (or file)
+        e->kind = EXPR_IMAGE;
+        e->img = img;
+        if (e->file != NULL) fclose(e->file);
+        e->file = NULL;
+        ReleaseExpr(e->arg[0]);
+        ReleaseExpr(e->arg[1]);
+        e->arg[0] = e->arg[1] = NULL;
+    }
+    return ShareImage(e->img);
+}
@@ -28,9 +28,27 @@ typedef struct image* Image;
 #define WHITE 0  // White pixel value
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters and choose the
+/// allocator of images: blocks are pooled in size classes and recycled,
+/// unless environment variable IMAGEBW_ALLOC is "malloc" (to compare).
 void ImageInit(void);
 
+/// Set the number of threads used to compute the rows of images.
+/// Boolean operations, vertical mirroring, replication at the right and
+/// loading split their rows among nthreads threads (the caller included),
+/// balanced by the number of runs of the rows.
+/// Requires: nthreads >= 1.  (Initially, 1: no threads are created.)
+/// The library itself must still be called from a single thread.
+void ImageSetThreads(int nthreads);
+
+/// Get the number of threads used to compute the rows of images.
+int ImageGetThreads(void);
+
+/// Release all the memory kept by the library for reuse (pooled blocks,
+/// interned rows and buffers), at once.
+/// Requires: no images or expressions exist.
+void ImageReleaseMemory(void);
+
 /// Image management functions
 
 /// Create a new BW image, either BLACK or WHITE.
@@ -77,16 +95,44 @@ void ImageRLEPrint(const Image img);
 /// PBM BW image file operations
 
 /// Load a PBM BW image file.
-/// Only binary PBM files are accepted.
+/// Only binary PBM files (or native RLE files) are accepted.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 Image ImageLoad(const char* filename);
 
 /// Save image to PBM file.
+/// An existing file is replaced (with a new file, written beside it and
+/// renamed over it), so it may be the file of an image in use (e.g., the
+/// image saved), and a failed save leaves it as it was.  The new file
+/// keeps the permissions of the old one, but not its hard links (they
+/// keep the old contents), owner or ACLs.  In a directory where no file
+/// can be created, an existing file is written in place instead: then it
+/// must not be the file of an image in use.
 /// On success, returns unspecified integer. (No need to check!)
 /// On failure, does not return, EXITS program!
 int ImageSave(const Image img, const char* filename);
 
+/// Native RLE BW image file operations
+
+/// Save image to a file in the native RLE format of this module: the rows
+/// as they are in memory, each distinct row only once.
+/// The file can only be read on machines with the same byte order.
+/// An existing file is replaced, as in ImageSave.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageSaveRLE(const Image img, const char* filename);
+
+/// Load a file in the native RLE format (ImageLoad also accepts them).
+/// The file is mapped into memory and its rows are used where they are,
+/// so loading takes O(height) time, with no copies of the runs.
+/// Only the row table is validated: the runs are trusted, so the file must
+/// have been written by ImageSaveRLE, and must not be modified in place
+/// while any image loaded from it (or sharing its rows) exists (saving
+/// over it, which replaces it, is safe).
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageLoadRLE(const char* filename);
+
 /// Information queries
 
 /// Get image width
@@ -95,11 +141,49 @@ int ImageWidth(const Image img);
 /// Get image height
 int ImageHeight(const Image img);
 
+/// Get the number of runs of all rows of img
+/// (kept up to date as images are built: O(1), as the queries below)
+uint64_t ImageRuns(const Image img);
+
+/// Get the number of BLACK pixels of img
+uint64_t ImageBlackPixels(const Image img);
+
 /// Get size in bytes occupied by img
 int ImageSize(const Image img);
 
+/// Pixel access
+
+/// Get the pixel of img at column x, row y (BLACK or WHITE).
+/// Requires: x < width and y < height.
+///
+/// Rows with many runs are indexed the first time one of their pixels is
+/// read (a position per run, taking as much memory as runs of 4 bytes),
+/// so each pixel is found in O(log runs) time.
+/// The index is kept in img, counted in ImageSize (and ImageIndexSize),
+/// and dropped when img changes or is destroyed.
+uint8 ImageGetPixel(const Image img, uint32 x, uint32 y);
+
+/// Get the n pixels of img at columns x[j], rows y[j] into pixels[j]
+/// (as ImageGetPixel).
+void ImageGetPixels(const Image img, int n, const uint32 x[],
+                    const uint32 y[], uint8 pixels[]);
+
+/// Get size in bytes of the pixel index of img
+int ImageIndexSize(const Image img);
+
 /// Image comparison
 
+/// Get a 64-bit fingerprint of the pixels of img (and of its size).
+/// Equal images have equal fingerprints, and different images almost
+/// always have different ones, so they can key hash tables of images
+/// (confirming matches with ImageIsEqual).
+/// Computed in O(height) time, from hashes of the rows kept since they
+/// were built, then kept in img: ImageIsEqual rejects most different
+/// images in O(1).
+/// Fingerprints depend on the machine (byte order) and may change between
+/// versions of this module: they are not meant to be stored.
+uint64_t ImageFingerprint(const Image img);
+
 int ImageIsEqual(const Image img1, const Image img2);
 
 int ImageIsDifferent(const Image img1, const Image img2);
@@ -114,6 +198,8 @@ int ImageIsDifferent(const Image img1, const Image img2);
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 
+/// Negation (like the mirrors) takes O(1): the result is a view that
+/// shares the rows of img and is only materialized when needed.
 Image ImageNEG(const Image img);
 
 Image ImageAND(const Image img1, const Image img2);
@@ -124,6 +210,61 @@ Image ImageOR(const Image img1, const Image img2);
 
 Image ImageXOR(const Image img1, const Image img2);
 
+/// img1 and not img2
+Image ImageANDNOT(const Image img1, const Image img2);
+
+Image ImageNAND(const Image img1, const Image img2);
+
+Image ImageNOR(const Image img1, const Image img2);
+
+Image ImageXNOR(const Image img1, const Image img2);
+
+/// Truth tables of boolean functions of two pixels p1, p2:
+/// bit (2*p1 + p2) is the value of the function.
+/// Any of the 16 values 0x0..0xF is a valid function.
+#define BOOL_AND 0x8
+#define BOOL_OR 0xE
+#define BOOL_XOR 0x6
+#define BOOL_ANDNOT 0x4  // p1 and not p2
+#define BOOL_NAND 0x7
+#define BOOL_NOR 0x1
+#define BOOL_XNOR 0x9
+
+/// Apply the boolean function with truth table op to img1 and img2.
+Image ImageBoolean(const Image img1, const Image img2, uint8 op);
+
+/// In-place variants: the result replaces img1 (or img), reusing its
+/// header and row table, instead of being a new image.
+/// Negating (like mirroring) takes O(1), with no allocations.
+/// img2 is left untouched (unless it is img1 itself).
+
+void ImageNEGInPlace(Image img);
+
+void ImageANDInPlace(Image img1, const Image img2);
+
+void ImageORInPlace(Image img1, const Image img2);
+
+void ImageXORInPlace(Image img1, const Image img2);
+
+void ImageBooleanInPlace(Image img1, const Image img2, uint8 op);
+
+/// N-ary operations on the n images in imgs (n >= 1), all of the same size.
+/// The rows of all the images are merged at once, without intermediate
+/// images.
+
+/// imgs[0] and imgs[1] and ... imgs[n-1]
+Image ImageANDN(const Image imgs[], int n);
+
+/// imgs[0] or imgs[1] or ... imgs[n-1]
+Image ImageORN(const Image imgs[], int n);
+
+/// imgs[0] xor imgs[1] xor ... imgs[n-1]
+Image ImageXORN(const Image imgs[], int n);
+
+/// BLACK where at least k of the n images are BLACK (0 <= k <= n).
+/// (k = n / 2 + 1 gives the majority.)
+Image ImageThreshold(const Image imgs[], int n, int k);
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -148,6 +289,11 @@ Image ImageHorizontalMirror(const Image img);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageVerticalMirror(const Image img);
 
+/// Mirror img itself, top-bottom or left-right (in O(1), with no
+/// allocations, as ImageNEGInPlace).
+void ImageHorizontalMirrorInPlace(Image img);
+void ImageVerticalMirrorInPlace(Image img);
+
 /// Replicate img2 at the bottom of imag1, creating a larger image
 /// Requires: the width of the two images must be the same.
 /// Returns the new larger image.
@@ -166,4 +312,147 @@ Image ImageReplicateAtBottom(const Image img1, const Image img2);
 /// (The caller is responsible for destroying the returned image!)
 Image ImageReplicateAtRight(const Image img1, const Image img2);
 
+/// Crop img: get its width x height pixels from column x, row y on.
+/// Requires: x + width <= width of img, y + height <= height of img, and
+/// width, height > 0.
+/// Returns the new smaller image.
+/// Ensures: The original img is not modified.
+/// Rows with many runs are indexed (as by ImageGetPixel), so further crops
+/// of the same rows only go through the runs inside their window.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageCrop(const Image img, uint32 x, uint32 y, uint32 width,
+                uint32 height);
+
+/// Transpose img: column x of img becomes row x of the result, which is
+/// height x width pixels.
+/// Ensures: The original img is not modified.
+/// The result is built from the runs of img, swept a row at a time,
+/// without unpacking it into pixels: besides the result, it takes
+/// O(width + runs of the result) memory.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageTranspose(const Image img);
+
+/// Rotate img 90 degrees clockwise (as ImageTranspose, whose result is
+/// then mirrored left-right).
+Image ImageRotate90(const Image img);
+
+/// Rotate img 270 degrees clockwise (as ImageTranspose, whose result is
+/// then mirrored top-bottom).
+Image ImageRotate270(const Image img);
+
+/// Morphology
+
+/// A structuring element: the dilation of up to four line segments,
+/// each given by its length in pixels (0 or 1 if there is none).
+/// The origin of a segment is its middle pixel (the first of the two, if
+/// its length is even).
+/// A rectangle of width x height pixels is {width, height, 0, 0}, and
+/// adding diagonals to it gives an octagon.
+/// Segments are applied one after the other, in that order, to the whole
+/// image: so pixels dilated out of it by a segment are lost, even if the
+/// next one would bring them back (which only happens near the border,
+/// with diagonal segments).
+typedef struct {
+    uint32 width;         // horizontal segment
+    uint32 height;        // vertical segment
+    uint32 diagonal;      // from top left to bottom right
+    uint32 antidiagonal;  // from top right to bottom left
+} ImageStructElem;
+
+/// These functions apply morphological operations to img with the
+/// structuring element se, one segment at a time, working on the runs of
+/// the rows: their cost grows with the runs of img, and only
+/// logarithmically with the length of the segments (not at all, for
+/// horizontal ones).
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+
+/// Dilate: a pixel is BLACK if any pixel of img under se (reflected, with
+/// its origin on the pixel) is.
+Image ImageDilate(const Image img, ImageStructElem se);
+
+/// Erode: a pixel is BLACK if all pixels of img under se (with its origin
+/// on the pixel) are.  Pixels outside img count as BLACK.
+Image ImageErode(const Image img, ImageStructElem se);
+
+/// Open: dilate the erosion of img (removing BLACK details smaller than
+/// se).
+Image ImageOpen(const Image img, ImageStructElem se);
+
+/// Close: erode the dilation of img (filling WHITE details smaller than
+/// se).
+Image ImageClose(const Image img, ImageStructElem se);
+
+/// Lazy expressions
+
+/// An expression describes operations on images without doing them:
+/// its image is only computed when needed, by ImageExprEval, in a single
+/// pass over its rows, with all its operations fused (so intermediate
+/// images are never built).
+/// Expressions can be operands of several others (forming a DAG).
+typedef struct imageExpr* ImageExpr;
+
+/// Create an expression with the image img.
+/// img is not modified, and may be destroyed afterwards.
+ImageExpr ImageExprOf(const Image img);
+
+/// Create an expression with the image in the PBM file named filename.
+/// (Native RLE files are accepted too, and mapped at once.)
+/// Only the header is read: rows are read when needed, one at a time, so
+/// with ImageExprSave, images larger than memory can be processed.
+/// (Files that can only be read in order, like pipes, are loaded at once.)
+/// The file must not be modified in place while the expression is in use
+/// (saving over it, which replaces it, is safe).
+ImageExpr ImageExprOfFile(const char* filename);
+
+/// Create expressions applying an operation to other expressions,
+/// with the same requirements as the operation on images.
+/// The operands are not modified, and may be destroyed afterwards.
+ImageExpr ImageExprNEG(ImageExpr e);
+
+/// op is a truth table, as in ImageBoolean.
+ImageExpr ImageExprBoolean(ImageExpr e1, ImageExpr e2, uint8 op);
+
+ImageExpr ImageExprHorizontalMirror(ImageExpr e);
+
+ImageExpr ImageExprVerticalMirror(ImageExpr e);
+
+ImageExpr ImageExprReplicateAtBottom(ImageExpr e1, ImageExpr e2);
+
+ImageExpr ImageExprReplicateAtRight(ImageExpr e1, ImageExpr e2);
+
+ImageExpr ImageExprCrop(ImageExpr e, uint32 x, uint32 y, uint32 width,
+                        uint32 height);
+
+/// Get the width and height of the image of e (without computing it)
+int ImageExprWidth(const ImageExpr e);
+
+int ImageExprHeight(const ImageExpr e);
+
+/// Compute the image of e.
+/// The image is kept in e, so it is computed only once.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+Image ImageExprEval(ImageExpr e);
+
+/// Save the image of e to a PBM file.
+/// Rows are computed and written a block at a time, so the image is never
+/// all in memory (and it is not kept in e).
+/// An existing file is replaced, as in ImageSave.
+/// On success, returns unspecified integer. (No need to check!)
+/// On failure, does not return, EXITS program!
+int ImageExprSave(ImageExpr e, const char* filename);
+
+/// Destroy the expression pointed to by (*ep).
+/// Expressions using it as an operand are not affected.
+/// Ensures: (*ep)==NULL.
+void ImageExprDestroy(ImageExpr* ep);
+
 #endif
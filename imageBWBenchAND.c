@@ -0,0 +1,58 @@
+#include "imageBW.h"
+#include "instrumentation.h"
+#include "stdlib.h"
+#include "stdio.h"
+
+/// Benchmark of the AND operations on chessboards, the worst case for RLE
+/// (edge 1, a run per pixel) and the average case (edge 2) used in
+/// imageBWTestAND.
+/// ImageAND2 merges the runs of the rows, while ImageAND operates on
+/// packed bitmaps when rows have many short runs.
+/// Prints the best time, in seconds, of REPEAT runs of each operation.
+
+#define REPEAT 5
+
+static double BestTime(Image (*and)(const Image, const Image),
+                       Image img1, Image img2) {
+    double best = 0.0;
+    for (int r = 0; r < REPEAT; r++) {
+        double time = cpu_time();
+        Image result = and(img1, img2);
+        time = cpu_time() - time;
+        ImageDestroy(&result);
+        if (r == 0 || time < best) best = time;
+    }
+    return best;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("INVALID SINTAX");
+        return EXIT_FAILURE;
+    }
+
+    int edge = atoi(argv[1]);
+    if (edge != 1 && edge != 2) {
+        printf("INVALID MODE\n");
+        return EXIT_FAILURE;
+    }
+
+    ImageInit();
+
+    printf("# edge = %d\n", edge);
+    printf("#%9s\t%12s\t%12s\t%8s\n", "side", "AND2 (s)", "AND (s)",
+           "speedup");
+    for (int side = 64; side <= 4096; side *= 2) {
+        Image img = ImageCreateChessboard(side, side, edge, BLACK);
+
+        double and2 = BestTime(ImageAND2, img, img);
+        double and = BestTime(ImageAND, img, img);
+        printf("%10d\t%12.6f\t%12.6f\t%8.1f\n", side, and2, and,
+               and2 / and);
+
+        ImageDestroy(&img);
+    }
+
+    return EXIT_SUCCESS;
+}
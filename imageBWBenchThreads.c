@@ -0,0 +1,94 @@
+#include "imageBW.h"
+#include "instrumentation.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "time.h"
+
+/// Benchmark of operations run with 1 to MAX_THREADS threads.
+/// The operands are the PBM file given as argument, and its negation, or,
+/// by default, an image whose top half is blank and whose bottom half is a
+/// chessboard with edge 2, so that splitting the rows evenly by count
+/// would leave half of the threads with almost nothing to do.
+/// Prints the best wall time, in seconds, of REPEAT runs of each operation,
+/// and its speedup over a single thread.
+
+#define REPEAT 5
+#define MAX_THREADS 64
+#define SIDE 4096
+
+/// Wall time in seconds (cpu_time adds up the time of all threads)
+static double WallTime(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + 1.0e-9 * (double)now.tv_nsec;
+}
+
+static double BestTime(Image (*op)(const Image, const Image),
+                       Image img1, Image img2) {
+    double best = 0.0;
+    for (int r = 0; r < REPEAT; r++) {
+        double time = WallTime();
+        Image result = op(img1, img2);
+        time = WallTime() - time;
+        ImageDestroy(&result);
+        if (r == 0 || time < best) best = time;
+    }
+    return best;
+}
+
+static Image VerticalMirror(const Image img1, const Image img2) {
+    (void)img2;
+    return ImageVerticalMirror(img1);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 2) {
+        printf("INVALID SINTAX");
+        return EXIT_FAILURE;
+    }
+
+    ImageInit();
+
+    Image img1;
+    if (argc == 2) {
+        img1 = ImageLoad(argv[1]);
+    } else {
+        Image blank = ImageCreate(SIDE, SIDE / 2, WHITE);
+        Image chess = ImageCreateChessboard(SIDE, SIDE / 2, 2, BLACK);
+        img1 = ImageReplicateAtBottom(blank, chess);
+        ImageDestroy(&blank);
+        ImageDestroy(&chess);
+    }
+    Image img2 = ImageNEG(img1);
+
+    struct {
+        const char* name;
+        Image (*op)(const Image, const Image);
+    } ops[] = {{"AND", ImageAND}, {"AND2", ImageAND2}, {"XOR", ImageXOR},
+               {"vmirror", VerticalMirror}};
+    int nops = sizeof(ops) / sizeof(ops[0]);
+
+    printf("# %dx%d\n", ImageWidth(img1), ImageHeight(img1));
+    printf("#%9s", "threads");
+    for (int k = 0; k < nops; k++) {
+        printf("\t%10s (s)\t%8s", ops[k].name, "speedup");
+    }
+    printf("\n");
+    double single[sizeof(ops) / sizeof(ops[0])];
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        ImageSetThreads(threads);
+        printf("%10d", threads);
+        for (int k = 0; k < nops; k++) {
+            double time = BestTime(ops[k].op, img1, img2);
+            if (threads == 1) single[k] = time;
+            printf("\t%14.6f\t%8.2f", time, single[k] / time);
+        }
+        printf("\n");
+    }
+    ImageSetThreads(1);
+
+    ImageDestroy(&img2);
+    ImageDestroy(&img1);
+    return EXIT_SUCCESS;
+}
@@ -21,7 +21,6 @@
 extern unsigned long InstrCount[];  // Declaração para acessar os contadores
 #define PIXMEM InstrCount[0]
 #define BOOL_OP InstrCount[1]
-#define RLEMEM InstrCount[2]
 
 typedef struct image* Image; 
 
@@ -179,11 +178,10 @@ void WORSTCASE2() {
 
         PIXMEM = 0; // Reset pixel memory accesses counter
         BOOL_OP = 0; // Reset boolean operations counter
-        RLEMEM =0;
 
         Image and_result = ImageAND2(img1, img2);
 
-        printf("| %4dx%-6d   | %25lu | %25lu \n", size, size2,RLEMEM, BOOL_OP);
+        printf("| %4dx%-6d   | %25lu | %25lu \n", size, size2,PIXMEM, BOOL_OP);
 
         ImageDestroy(&img1);
         ImageDestroy(&img2);
@@ -208,11 +206,10 @@ void BestCASE2() {
 
         PIXMEM = 0; // Reset pixel memory accesses counter
         BOOL_OP = 0; // Reset boolean operations counter
-        RLEMEM =0;
 
         Image and_result = ImageAND2(img1, img2);
 
-        printf("| %4dx%-6d   | %25lu | %25lu \n", size, size2,RLEMEM, BOOL_OP);
+        printf("| %4dx%-6d   | %25lu | %25lu \n", size, size2,PIXMEM, BOOL_OP);
 
         ImageDestroy(&img1);
         ImageDestroy(&img2);
@@ -237,11 +234,10 @@ void AverageCASE2() {
 
         PIXMEM = 0; // Reset pixel memory accesses counter
         BOOL_OP = 0; // Reset boolean operations counter
-        RLEMEM =0;
 
         Image and_result = ImageAND2(img1, img2);
 
-        printf("| %4dx%-6d   | %25lu | %25lu \n", size, size2,RLEMEM, BOOL_OP);
+        printf("| %4dx%-6d   | %25lu | %25lu \n", size, size2,PIXMEM, BOOL_OP);
 
         ImageDestroy(&img1);
         ImageDestroy(&img2);
@@ -3,29 +3,6 @@
 #include <stdio.h>
 #include <assert.h>
 
-/// The following code was taken from imageBW.c
-
-typedef struct image* Image;
-
-struct image {
-    uint32 width;
-    uint32 height;
-    int** row; 
-};
-
-static uint32 getNumRuns(const int* RLE_row) {
-    assert(RLE_row != NULL);
-    
-    uint32 num_runs = 0;
-    uint32 i = 1;
-    while (RLE_row[i] != -1) {
-        num_runs++;
-        i++;
-    }
-
-    return num_runs;
-}
-
 /// Original code for testing space used by chessboard pattern images, 
 /// and their number of runs
 int main(void)
@@ -38,10 +15,10 @@ int main(void)
     while (size <= 16384) {
         img = ImageCreateChessboard(size, size, edge, BLACK);
 
-        printf("|%13d|%12d|%10d|%10d|\n",
+        printf("|%13d|%12llu|%10d|%10d|\n",
         ImageSize(img),
-        getNumRuns(img->row[0]) * img->height,
-        img->height,
+        (unsigned long long)ImageRuns(img),
+        ImageHeight(img),
         edge
         );
 
@@ -56,10 +33,10 @@ int main(void)
     while (edge <= 2048) {
         img = ImageCreateChessboard(size, size, edge, BLACK);
 
-        printf("|%13d|%12d|%10d|%10d|\n",
+        printf("|%13d|%12llu|%10d|%10d|\n",
         ImageSize(img),
-        getNumRuns(img->row[0]) * img->height,
-        img->height,
+        (unsigned long long)ImageRuns(img),
+        ImageHeight(img),
         edge
         );
 
@@ -75,12 +52,15 @@ int main(void)
     printf("       edge - edge of the squares in chess patern\n");
     printf("\nNote: In this case we have width == height == 'Side'\n\n");
     
-    printf("Size = (Runs + 2 * height) * sizeof(int) (B)");
+    printf("Size = Runs * runsize + height * 16 + header (B)");
     printf("Where: height - height of image\n");
     printf("       Runs - num of runs per RLE row\n");
-    printf("       sizeof(int) - constant of value 4B\n");
-    printf("\nNote: Adding 2 * height to the num of runs acounts for space\n");
-    printf("used by first value and EOR\n\n");
+    printf("       runsize - 1B for edges below 256, 2B below 65536, else 4B\n");
+    printf("\nNote: each row has a 16B descriptor holding its first value\n");
+    printf("and its num of runs, so no EOR is stored\n");
+    printf("(rows are interned, so only the 2 distinct rows are actually stored)\n");
+    printf("Rows are stored as bitmaps when smaller, so Runs * runsize is at most\n");
+    printf("height * 8 * ceil(width/64) (edges 1 to 8 above)\n\n");
 
     printf("Theoretically the max number of runs in a chessboard pattern would be\n");
     printf("when the edge of each square is 1, in that case the number of runs\n");
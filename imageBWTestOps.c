@@ -0,0 +1,1442 @@
+// imageBWTestOps - Checks of the operations of the imageBW module against
+// a plain pixel reference.
+//
+// This program is an example use of the imageBW module,
+// a programming project for the course AED, DETI / UA.PT
+//
+// You may freely use and modify this code, NO WARRANTY, blah blah,
+// as long as you give proper credit to the original and subsequent authors.
+//
+// The AED Team <jmadeira@ua.pt, jmr@ua.pt, ...>
+// 2024
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imageBW.h"
+
+// Every image is compared with a reference: an array of pixels, one byte
+// each, built directly from the definition of each operation.
+// Images are turned into pixels by saving them to PBM files (and pixels
+// into images by loading them), so each check goes through the operation,
+// the statistics of the result and the PBM writer at once.
+
+#define TMP_PBM "testops.pbm"
+
+typedef struct {
+    uint32 width;
+    uint32 height;
+    uint8* pixel;  // pixel[y * width + x]
+} Pixels;
+
+static int failures = 0;
+
+static void Expect(int condition, const char* what) {
+    if (!condition) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static Pixels NewPixels(uint32 width, uint32 height) {
+    Pixels p = {width, height, calloc((size_t)width * height, 1)};
+    assert(p.pixel != NULL);
+    return p;
+}
+
+static void FreePixels(Pixels* p) {
+    free(p->pixel);
+    p->pixel = NULL;
+}
+
+static inline uint8* At(Pixels p, uint32 x, uint32 y) {
+    return &p.pixel[(size_t)y * p.width + x];
+}
+
+// Kinds of random pixels
+enum { NOISE, RECTANGLES, STRIPES, SLANTED_STRIPES, KINDS };
+
+/// Random pixels of the given kind: noise of any density (short runs,
+/// stored as bitmaps), overlapping rectangles (long runs), or stripes.
+static Pixels RandomPixelsOf(uint32 width, uint32 height, int kind) {
+    Pixels p = NewPixels(width, height);
+    if (kind == NOISE) {
+        int density = rand() % 101;
+        for (size_t k = 0; k < (size_t)width * height; k++) {
+            p.pixel[k] = rand() % 100 < density;
+        }
+    } else if (kind == RECTANGLES) {
+        for (int r = rand() % 8; r > 0; r--) {
+            uint32 x0 = rand() % width, y0 = rand() % height;
+            uint32 x1 = x0 + rand() % (width - x0 + 1);
+            uint32 y1 = y0 + rand() % (height - y0 + 1);
+            for (uint32 y = y0; y < y1; y++) {
+                for (uint32 x = x0; x < x1; x++) *At(p, x, y) ^= 1;
+            }
+        }
+    } else {
+        uint32 period = 1 + rand() % 9;
+        for (uint32 y = 0; y < height; y++) {
+            for (uint32 x = 0; x < width; x++) {
+                *At(p, x, y) = (kind == STRIPES ? x : x + y) / period % 2;
+            }
+        }
+    }
+    return p;
+}
+
+/// Random pixels of any kind
+static Pixels RandomPixels(uint32 width, uint32 height) {
+    return RandomPixelsOf(width, height, rand() % KINDS);
+}
+
+/// Save p to a PBM file, with a comment of comment bytes in the header if
+/// comment > 0.
+static void SavePixels(Pixels p, const char* filename, size_t comment) {
+    FILE* f = fopen(filename, "wb");
+    assert(f != NULL);
+    fprintf(f, "P4\n");
+    if (comment > 0) {
+        fputc('#', f);
+        for (size_t k = 1; k < comment; k++) fputc('a' + k % 26, f);
+        fputc('\n', f);
+    }
+    fprintf(f, "%u %u\n", p.width, p.height);
+    for (uint32 y = 0; y < p.height; y++) {
+        for (uint32 x = 0; x < p.width; x += 8) {
+            int byte = 0;
+            for (uint32 b = 0; b < 8; b++) {
+                byte = byte << 1 | (x + b < p.width && *At(p, x + b, y));
+            }
+            fputc(byte, f);
+        }
+    }
+    fclose(f);
+}
+
+static Image ImageOfPixels(Pixels p) {
+    SavePixels(p, TMP_PBM, 0);
+    Image img = ImageLoad(TMP_PBM);
+    assert(img != NULL);
+    return img;
+}
+
+static Pixels PixelsOfFile(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    assert(f != NULL);
+    uint32 width, height;
+    int ok = fscanf(f, "P4 %u %u", &width, &height) == 2;
+    assert(ok);
+    (void)ok;
+    fgetc(f);  // the single white space after the header
+    Pixels p = NewPixels(width, height);
+    for (uint32 y = 0; y < height; y++) {
+        for (uint32 x = 0; x < width; x += 8) {
+            int byte = fgetc(f);
+            for (uint32 b = 0; b < 8 && x + b < width; b++) {
+                *At(p, x + b, y) = byte >> (7 - b) & 1;
+            }
+        }
+    }
+    fclose(f);
+    return p;
+}
+
+static Pixels PixelsOfImage(const Image img) {
+    ImageSave(img, TMP_PBM);
+    return PixelsOfFile(TMP_PBM);
+}
+
+/// Check that img has the pixels of ref, and that its statistics (black
+/// pixels and runs) are those of ref.
+static void ExpectPixels(const Image img, Pixels ref, const char* what) {
+    char message[200];
+    snprintf(message, sizeof(message), "%s: size", what);
+    Expect((uint32)ImageWidth(img) == ref.width &&
+           (uint32)ImageHeight(img) == ref.height, message);
+    if ((uint32)ImageWidth(img) != ref.width ||
+        (uint32)ImageHeight(img) != ref.height) return;
+
+    Pixels p = PixelsOfImage(img);
+    snprintf(message, sizeof(message), "%s: pixels", what);
+    Expect(memcmp(p.pixel, ref.pixel, (size_t)ref.width * ref.height) == 0,
+           message);
+    FreePixels(&p);
+
+    uint64_t black = 0, runs = 0;
+    for (uint32 y = 0; y < ref.height; y++) {
+        for (uint32 x = 0; x < ref.width; x++) {
+            black += *At(ref, x, y);
+            runs += x == 0 || *At(ref, x, y) != *At(ref, x - 1, y);
+        }
+    }
+    snprintf(message, sizeof(message), "%s: black pixels", what);
+    Expect(ImageBlackPixels(img) == black, message);
+    snprintf(message, sizeof(message), "%s: runs", what);
+    Expect(ImageRuns(img) == runs, message);
+}
+
+/// Pixels of a picture given as a string of width x height characters,
+/// row by row: '#' is BLACK, anything else WHITE.
+static Pixels Picture(uint32 width, uint32 height, const char* picture) {
+    assert(strlen(picture) == (size_t)width * height);
+    Pixels p = NewPixels(width, height);
+    for (size_t k = 0; k < (size_t)width * height; k++) {
+        p.pixel[k] = picture[k] == '#';
+    }
+    return p;
+}
+
+/// Reference operations
+
+static Pixels RefNEG(Pixels a) {
+    Pixels p = NewPixels(a.width, a.height);
+    for (size_t k = 0; k < (size_t)a.width * a.height; k++) {
+        p.pixel[k] = !a.pixel[k];
+    }
+    return p;
+}
+
+static Pixels RefBoolean(Pixels a, Pixels b, uint8 op) {
+    Pixels p = NewPixels(a.width, a.height);
+    for (size_t k = 0; k < (size_t)a.width * a.height; k++) {
+        p.pixel[k] = op >> (a.pixel[k] << 1 | b.pixel[k]) & 1;
+    }
+    return p;
+}
+
+static Pixels RefCrop(Pixels a, uint32 x0, uint32 y0, uint32 width,
+                      uint32 height) {
+    Pixels p = NewPixels(width, height);
+    for (uint32 y = 0; y < height; y++) {
+        for (uint32 x = 0; x < width; x++) {
+            *At(p, x, y) = *At(a, x0 + x, y0 + y);
+        }
+    }
+    return p;
+}
+
+/// a (width wa) with b at its right, or below it
+static Pixels RefReplicate(Pixels a, Pixels b, int right) {
+    Pixels p = right ? NewPixels(a.width + b.width, a.height)
+                     : NewPixels(a.width, a.height + b.height);
+    for (uint32 y = 0; y < p.height; y++) {
+        for (uint32 x = 0; x < p.width; x++) {
+            if (x < a.width && y < a.height) {
+                *At(p, x, y) = *At(a, x, y);
+            } else {
+                *At(p, x, y) = right ? *At(b, x - a.width, y)
+                                     : *At(b, x, y - a.height);
+            }
+        }
+    }
+    return p;
+}
+
+/// Mirror a top-bottom (hmirror) or left-right
+static Pixels RefMirror(Pixels a, int hmirror) {
+    Pixels p = NewPixels(a.width, a.height);
+    for (uint32 y = 0; y < a.height; y++) {
+        for (uint32 x = 0; x < a.width; x++) {
+            *At(p, x, y) = hmirror ? *At(a, x, a.height - 1 - y)
+                                   : *At(a, a.width - 1 - x, y);
+        }
+    }
+    return p;
+}
+
+static Pixels RefTranspose(Pixels a) {
+    Pixels p = NewPixels(a.height, a.width);
+    for (uint32 y = 0; y < p.height; y++) {
+        for (uint32 x = 0; x < p.width; x++) *At(p, x, y) = *At(a, y, x);
+    }
+    return p;
+}
+
+/// Segment of length n along (dx, dy) of a structuring element: a pixel
+/// is BLACK if any (dilate) or all (erode) of the pixels at k * (dx, dy)
+/// from it are, for k from -before to after.
+static Pixels RefSegment(Pixels a, int dx, int dy, int before, int after,
+                         int erode) {
+    Pixels p = NewPixels(a.width, a.height);
+    for (int y = 0; y < (int)a.height; y++) {
+        for (int x = 0; x < (int)a.width; x++) {
+            int value = erode;
+            for (int k = -before; k <= after; k++) {
+                int xx = x + k * dx, yy = y + k * dy;
+                int pixel = xx >= 0 && xx < (int)a.width && yy >= 0 &&
+                            yy < (int)a.height ? *At(a, xx, yy) : erode;
+                value = erode ? value && pixel : value || pixel;
+            }
+            *At(p, x, y) = value;
+        }
+    }
+    return p;
+}
+
+/// Dilate (or erode) a with se, one segment at a time
+static Pixels RefMorph(Pixels a, ImageStructElem se, int erode) {
+    const uint32 length[4] = {se.width, se.height, se.diagonal,
+                              se.antidiagonal};
+    const int dx[4] = {1, 0, 1, -1};
+    const int dy[4] = {0, 1, 1, 1};
+    Pixels p = NewPixels(a.width, a.height);
+    memcpy(p.pixel, a.pixel, (size_t)a.width * a.height);
+    for (int s = 0; s < 4; s++) {
+        if (length[s] <= 1) continue;
+        int origin = (length[s] - 1) / 2;  // the first middle pixel
+        int rest = length[s] - 1 - origin;
+        // Dilation uses the segment reflected
+        Pixels q = erode ? RefSegment(p, dx[s], dy[s], origin, rest, 1)
+                         : RefSegment(p, dx[s], dy[s], rest, origin, 0);
+        FreePixels(&p);
+        p = q;
+    }
+    return p;
+}
+
+/// Make an image of the pixels *a, or a view of it (negated, mirrored or
+/// both, at random), whose pixels are then left in *a.
+static Image RandomImageOrView(Pixels* a) {
+    Image img = ImageOfPixels(*a);
+    int view = rand() % 8;  // a flag for each view: NEG, hmirror, vmirror
+    for (int flag = 0; flag < 3; flag++) {
+        if ((view >> flag & 1) == 0) continue;
+        Image v = flag == 0 ? ImageNEG(img)
+                : flag == 1 ? ImageHorizontalMirror(img)
+                            : ImageVerticalMirror(img);
+        Pixels b = flag == 0 ? RefNEG(*a) : RefMirror(*a, flag == 1);
+        ImageDestroy(&img);  // (v keeps its rows)
+        FreePixels(a);
+        *a = b;
+        img = v;
+    }
+    return img;
+}
+
+/// Statistics
+
+// Images of different widths share identical rows (and packed bitmap
+// rows with the same bytes), so the black pixels and runs of each image
+// must be counted with its own width.
+static void TestStatistics(void) {
+    Image chess = ImageCreateChessboard(9, 1, 1, BLACK);
+    Image ones = ImageCreate(3, 1, BLACK);
+    Image both = ImageReplicateAtRight(chess, ones);
+    Pixels ref = NewPixels(12, 1);
+    for (uint32 x = 0; x < 12; x++) *At(ref, x, 0) = x >= 9 || x % 2 == 0;
+    ExpectPixels(both, ref, "chess 9,1,1,1 repr create 3,1,1");
+    FreePixels(&ref);
+    ImageDestroy(&both);
+    ImageDestroy(&ones);
+    ImageDestroy(&chess);
+
+    const uint32 widths[] = {1, 9, 10, 12, 63, 64, 65, 127, 128, 129, 200};
+    const int nwidths = sizeof(widths) / sizeof(widths[0]);
+    for (int t = 0; t < 60; t++) {
+        uint32 w1 = widths[rand() % nwidths], w2 = widths[rand() % nwidths];
+        uint32 height = 1 + rand() % 20;
+        Pixels a = RandomPixels(w1, height), b = RandomPixels(w1, height);
+        Pixels c = RandomPixels(w2, height);
+        Image ia = ImageOfPixels(a), ib = ImageOfPixels(b);
+        Image ic = ImageOfPixels(c);
+        ExpectPixels(ia, a, "load");
+
+        uint8 op = rand() % 16;
+        Image r = ImageBoolean(ia, ib, op);
+        Pixels ref = RefBoolean(a, b, op);
+        ExpectPixels(r, ref, "boolean");
+        FreePixels(&ref);
+        ImageDestroy(&r);
+
+        r = ImageNEG(ia);
+        ref = RefNEG(a);
+        ExpectPixels(r, ref, "neg");
+        FreePixels(&ref);
+        ImageDestroy(&r);
+
+        r = ImageReplicateAtRight(ia, ic);
+        ref = RefReplicate(a, c, 1);
+        ExpectPixels(r, ref, "repr");
+        FreePixels(&ref);
+        ImageDestroy(&r);
+
+        r = ImageReplicateAtBottom(ia, ib);
+        ref = RefReplicate(a, b, 0);
+        ExpectPixels(r, ref, "repb");
+        FreePixels(&ref);
+        ImageDestroy(&r);
+
+        uint32 x = rand() % w1, width = 1 + rand() % (w1 - x);
+        r = ImageCrop(ia, x, 0, width, height);
+        ref = RefCrop(a, x, 0, width, height);
+        ExpectPixels(r, ref, "crop");
+        FreePixels(&ref);
+        ImageDestroy(&r);
+
+        r = ImageVerticalMirror(ic);
+        ref = RefMirror(c, 0);
+        ExpectPixels(r, ref, "vmirror");
+        FreePixels(&ref);
+        ImageDestroy(&r);
+
+        ImageDestroy(&ia);
+        ImageDestroy(&ib);
+        ImageDestroy(&ic);
+        FreePixels(&a);
+        FreePixels(&b);
+        FreePixels(&c);
+    }
+}
+
+/// Pixel access
+
+static void TestPixels(void) {
+    for (int t = 0; t < 30; t++) {
+        uint32 width = 1 + rand() % 3000, height = 1 + rand() % 8;
+        Pixels a;
+        int runs = t % 2;
+        if (runs) {
+            // Rows of runs too long for bitmaps, and indexed if they have
+            // many (as the first one, most times)
+            a = NewPixels(width, height);
+            for (uint32 y = 0; y < height; y++) {
+                for (uint32 x = 0, color = rand() % 2; x < width;) {
+                    for (uint32 n = 9 + rand() % 32; n > 0 && x < width; n--) {
+                        *At(a, x++, y) = color;
+                    }
+                    color = !color;
+                }
+            }
+        } else {
+            a = RandomPixels(width, height);
+        }
+        Image img = RandomImageOrView(&a);
+
+        int n = 2000;
+        uint32* x = malloc(n * sizeof(uint32));
+        uint32* y = malloc(n * sizeof(uint32));
+        uint8* pixels = malloc(n);
+        assert(x != NULL && y != NULL && pixels != NULL);
+        for (int round = 0; round < 2; round++) {
+            // Random pixels, the first and last of each row
+            for (int j = 0; j < n; j++) {
+                x[j] = j % 4 == 0 ? 0
+                     : j % 4 == 1 ? width - 1 : (uint32)rand() % width;
+                y[j] = rand() % height;
+            }
+            int bad = 0;
+            for (int j = 0; j < n; j++) {
+                bad += ImageGetPixel(img, x[j], y[j]) != *At(a, x[j], y[j]);
+            }
+            Expect(bad == 0, "ImageGetPixel");
+            ImageGetPixels(img, n, x, y, pixels);
+            bad = 0;
+            for (int j = 0; j < n; j++) {
+                bad += pixels[j] != *At(a, x[j], y[j]);
+            }
+            Expect(bad == 0, "ImageGetPixels");
+            if (runs && width > 40 * 16) {
+                Expect(ImageIndexSize(img) > 0, "index");
+            }
+
+            // The pixels are read through the view (or the index) after
+            // img changes
+            ImageNEGInPlace(img);
+            for (size_t k = 0; k < (size_t)width * height; k++) {
+                a.pixel[k] = !a.pixel[k];
+            }
+        }
+        free(x);
+        free(y);
+        free(pixels);
+        ImageDestroy(&img);
+        FreePixels(&a);
+    }
+}
+
+/// Crop
+
+static void TestCrop(void) {
+    for (int t = 0; t < 12; t++) {
+        uint32 width = 1 + rand() % 200, height = 1 + rand() % 6;
+        Pixels a = RandomPixels(width, height);
+        Image img = RandomImageOrView(&a);
+        // Every first column, with every last column next to a word
+        // boundary (or at the end of the row)
+        for (uint32 x0 = 0; x0 < width; x0++) {
+            for (uint32 end = x0 + 1; end <= width; end++) {
+                if (end != width && end != x0 + 1 &&
+                    (end + 1) % 64 > 2) continue;
+                uint32 y0 = rand() % height;
+                uint32 h = 1 + rand() % (height - y0);
+                Image r = ImageCrop(img, x0, y0, end - x0, h);
+                Pixels ref = RefCrop(a, x0, y0, end - x0, h);
+                ExpectPixels(r, ref, "crop");
+
+                // A crop of a view of the crop
+                if (rand() % 8 == 0) {
+                    Image v = ImageNEG(r);
+                    uint32 x1 = rand() % (end - x0);
+                    uint32 w1 = 1 + rand() % (end - x0 - x1);
+                    Image r2 = ImageCrop(v, x1, 0, w1, h);
+                    Pixels neg = RefNEG(ref);
+                    Pixels ref2 = RefCrop(neg, x1, 0, w1, h);
+                    ExpectPixels(r2, ref2, "crop of a view of a crop");
+                    ImageDestroy(&r2);
+                    ImageDestroy(&v);
+                    FreePixels(&neg);
+                    FreePixels(&ref2);
+                }
+                ImageDestroy(&r);
+                FreePixels(&ref);
+            }
+        }
+        ImageDestroy(&img);
+        FreePixels(&a);
+    }
+}
+
+/// Fingerprints and equality
+
+#define TMP_RLE "testops.rle"
+
+static void TestFingerprint(void) {
+    for (int t = 0; t < 40; t++) {
+        uint32 width = 1 + rand() % 150, height = 1 + rand() % 10;
+        Pixels a = RandomPixels(width, height);
+        Image img = ImageOfPixels(a);
+
+        // Images of the same size, built in different ways, with their
+        // pixels
+        enum { N = 15 };
+        Image imgs[N];
+        Pixels pixels[N];
+        int n = 0;
+        imgs[n] = ImageCrop(img, 0, 0, width, height);  // shares the rows
+        pixels[n++] = RefCrop(a, 0, 0, width, height);
+        Image neg = ImageNEG(img);
+        imgs[n] = ImageNEG(neg);  // a view of a view
+        pixels[n++] = RefCrop(a, 0, 0, width, height);
+        imgs[n] = neg;
+        pixels[n++] = RefNEG(a);
+        imgs[n] = ImageOfPixels(pixels[n - 1]);  // loaded negated
+        pixels[n] = RefNEG(a);
+        n++;
+        imgs[n] = ImageCrop(img, 0, 0, width, height);
+        ImageNEGInPlace(imgs[n]);
+        ImageNEGInPlace(imgs[n]);
+        pixels[n++] = RefCrop(a, 0, 0, width, height);
+        imgs[n] = ImageVerticalMirror(img);
+        pixels[n++] = RefMirror(a, 0);
+        Image hmirror = imgs[n] = ImageHorizontalMirror(img);
+        pixels[n++] = RefMirror(a, 1);
+        imgs[n] = ImageCrop(img, 0, 0, width, height);
+        ImageHorizontalMirrorInPlace(imgs[n]);
+        ImageHorizontalMirrorInPlace(imgs[n]);
+        pixels[n++] = RefCrop(a, 0, 0, width, height);
+        Image transposed = ImageTranspose(img);
+        imgs[n] = ImageTranspose(transposed);
+        ImageDestroy(&transposed);
+        pixels[n++] = RefCrop(a, 0, 0, width, height);
+        imgs[n] = ImageAND(img, img);
+        pixels[n++] = RefCrop(a, 0, 0, width, height);
+        imgs[n] = ImageXOR(img, img);
+        pixels[n++] = NewPixels(width, height);
+        imgs[n] = ImageCreate(width, height, WHITE);
+        pixels[n++] = NewPixels(width, height);
+        // Saved and loaded again, as PBM and as RLE
+        ImageSave(neg, TMP_PBM);
+        imgs[n] = ImageLoad(TMP_PBM);
+        pixels[n++] = RefNEG(a);
+        ImageSaveRLE(hmirror, TMP_RLE);
+        imgs[n] = ImageLoadRLE(TMP_RLE);
+        pixels[n++] = RefMirror(a, 1);
+        // A pixel changed
+        pixels[n] = RefCrop(a, 0, 0, width, height);
+        uint32 x = rand() % width, y = rand() % height;
+        *At(pixels[n], x, y) = !*At(pixels[n], x, y);
+        imgs[n] = ImageOfPixels(pixels[n]);
+        n++;
+        assert(n == N);
+
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < n; k++) {
+                int equal = memcmp(pixels[j].pixel, pixels[k].pixel,
+                                   (size_t)width * height) == 0;
+                char what[64];
+                snprintf(what, sizeof(what), "fingerprint %d, %d", j, k);
+                Expect((ImageFingerprint(imgs[j]) ==
+                        ImageFingerprint(imgs[k])) == equal, what);
+                snprintf(what, sizeof(what), "equal %d, %d", j, k);
+                Expect(ImageIsEqual(imgs[j], imgs[k]) == equal, what);
+            }
+        }
+
+        for (int j = 0; j < n; j++) {
+            ImageDestroy(&imgs[j]);
+            FreePixels(&pixels[j]);
+        }
+        ImageDestroy(&img);
+        FreePixels(&a);
+    }
+    remove(TMP_RLE);
+}
+
+/// In-place operations
+
+static void TestInPlace(void) {
+    for (int t = 0; t < 40; t++) {
+        uint32 width = 1 + rand() % 150, height = 1 + rand() % 10;
+        Pixels a = RandomPixels(width, height);
+        Pixels b = RandomPixels(width, height);
+        Image img1 = RandomImageOrView(&a);
+        Image img2 = RandomImageOrView(&b);
+        // A view sharing the rows of img1, which must not change with it
+        Image sibling = ImageNEG(img1);
+        Pixels c = RefNEG(a);
+
+        for (int step = 0; step < 6; step++) {
+            Pixels ref;
+            int op = rand() % 16;
+            switch (rand() % 8) {
+                case 0:
+                    ImageNEGInPlace(img1);
+                    ref = RefNEG(a);
+                    break;
+                case 1:
+                    ImageANDInPlace(img1, img2);
+                    ref = RefBoolean(a, b, 0x8);
+                    break;
+                case 2:
+                    ImageORInPlace(img1, img2);
+                    ref = RefBoolean(a, b, 0xE);
+                    break;
+                case 3:
+                    ImageXORInPlace(img1, img2);
+                    ref = RefBoolean(a, b, 0x6);
+                    break;
+                case 4:
+                    ImageBooleanInPlace(img1, img2, op);
+                    ref = RefBoolean(a, b, op);
+                    break;
+                case 5:
+                    // img1 is both operands
+                    ImageBooleanInPlace(img1, img1, op);
+                    ref = RefBoolean(a, a, op);
+                    break;
+                case 6:
+                    ImageHorizontalMirrorInPlace(img1);
+                    ref = RefMirror(a, 1);
+                    break;
+                default:
+                    ImageVerticalMirrorInPlace(img1);
+                    ref = RefMirror(a, 0);
+                    break;
+            }
+            FreePixels(&a);
+            a = ref;
+            ExpectPixels(img1, a, "in place");
+        }
+        ExpectPixels(img2, b, "operand of in place");
+        ExpectPixels(sibling, c, "view of in place");
+
+        // Each operation with an image as both operands
+        for (int op = 0; op < 16; op++) {
+            Image copy = ImageCrop(img2, 0, 0, width, height);
+            ImageBooleanInPlace(copy, copy, op);
+            Pixels ref = RefBoolean(b, b, op);
+            ExpectPixels(copy, ref, "in place with itself");
+            ImageDestroy(&copy);
+            FreePixels(&ref);
+        }
+
+        ImageDestroy(&sibling);
+        ImageDestroy(&img1);
+        ImageDestroy(&img2);
+        FreePixels(&a);
+        FreePixels(&b);
+        FreePixels(&c);
+    }
+}
+
+/// Views
+
+static void TestViews(void) {
+    for (int t = 0; t < 40; t++) {
+        uint32 width = 1 + rand() % 150, height = 1 + rand() % 10;
+        Pixels a = RandomPixels(width, height);
+        Image img = ImageOfPixels(a);
+        // Several views of img (views of views, too), destroying the image
+        // each one is made from, or not
+        Image view = img;
+        Pixels p = RefCrop(a, 0, 0, width, height);
+        for (int k = 0; k < 3; k++) {
+            int kind = rand() % 3;
+            Image v = kind == 0 ? ImageNEG(view)
+                    : kind == 1 ? ImageHorizontalMirror(view)
+                                : ImageVerticalMirror(view);
+            Pixels q = kind == 0 ? RefNEG(p) : RefMirror(p, kind == 1);
+            if (view != img) {
+                ImageDestroy(&view);
+            } else if (rand() % 2) {
+                ImageDestroy(&img);  // img is NULL then
+            }
+            FreePixels(&p);
+            view = v;
+            p = q;
+        }
+        ExpectPixels(view, p, "view saved");
+
+        // Saved in the native format
+        ImageSaveRLE(view, TMP_RLE);
+        Image loaded = ImageLoadRLE(TMP_RLE);
+        ExpectPixels(loaded, p, "view saved as RLE");
+        ImageDestroy(&loaded);
+
+        // Operands of other operations
+        uint32 x = rand() % width, w = 1 + rand() % (width - x);
+        Image r = ImageCrop(view, x, 0, w, height);
+        Pixels ref = RefCrop(p, x, 0, w, height);
+        ExpectPixels(r, ref, "crop of a view");
+        ImageDestroy(&r);
+        FreePixels(&ref);
+
+        r = ImageTranspose(view);
+        ref = RefTranspose(p);
+        ExpectPixels(r, ref, "transpose of a view");
+        ImageDestroy(&r);
+        FreePixels(&ref);
+
+        r = ImageReplicateAtBottom(view, view);
+        ref = RefReplicate(p, p, 0);
+        ExpectPixels(r, ref, "repb of a view");
+        ImageDestroy(&r);
+        FreePixels(&ref);
+
+        if (img != NULL) {
+            // Operands seen through different views
+            r = ImageReplicateAtBottom(img, view);
+            ref = RefReplicate(a, p, 0);
+            ExpectPixels(r, ref, "repb of an image and a view");
+            ImageDestroy(&r);
+            FreePixels(&ref);
+        }
+
+        // Compared with an image of the same pixels, not a view
+        r = ImageOfPixels(p);
+        Expect(ImageIsEqual(view, r) && ImageIsEqual(r, view) &&
+               ImageFingerprint(view) == ImageFingerprint(r),
+               "view equal to its pixels");
+        ImageDestroy(&r);
+
+        uint8 op = rand() % 16;
+        r = ImageBoolean(view, img != NULL ? img : view, op);
+        ref = RefBoolean(p, img != NULL ? a : p, op);
+        ExpectPixels(r, ref, "boolean of a view");
+        ImageDestroy(&r);
+        FreePixels(&ref);
+
+        // A view whose row table is shared, changed in place (it gets a
+        // table of its own), and the images sharing it
+        Image other = ImageNEG(view);
+        Pixels negated = RefNEG(p);
+        ImageXORInPlace(other, view);
+        Pixels ones = RefBoolean(negated, p, 0x6);
+        ExpectPixels(other, ones, "view changed in place");
+        ExpectPixels(view, p, "view of the view changed in place");
+        if (img != NULL) ExpectPixels(img, a, "image of the views");
+        ImageDestroy(&other);
+        FreePixels(&negated);
+        FreePixels(&ones);
+
+        ImageDestroy(&view);
+        if (img != NULL) ImageDestroy(&img);
+        FreePixels(&p);
+        FreePixels(&a);
+    }
+    remove(TMP_RLE);
+}
+
+/// Lazy expressions
+
+// A node of an expression DAG, with its image computed directly
+typedef struct {
+    ImageExpr e;
+    Image img;
+} Node;
+
+/// Check the image of node, computed by evaluating its expression (or
+/// saving it), against the one computed directly
+static void ExpectNode(Node node, const char* what) {
+    char message[100];
+    if (rand() % 2) {
+        Image r = ImageExprEval(node.e);
+        snprintf(message, sizeof(message), "%s: evaluated", what);
+        Expect(ImageIsEqual(r, node.img), message);
+        ImageDestroy(&r);
+    } else {
+        ImageExprSave(node.e, TMP_PBM);
+        Image r = ImageLoad(TMP_PBM);
+        snprintf(message, sizeof(message), "%s: saved", what);
+        Expect(ImageIsEqual(r, node.img), message);
+        ImageDestroy(&r);
+    }
+}
+
+static void TestExpressions(void) {
+    for (int t = 0; t < 60; t++) {
+        uint32 width = 1 + rand() % 150, height = 1 + rand() % 10;
+        enum { N = 16 };
+        Node node[N];
+        int n = 0;
+        for (; n < 3; n++) {
+            Pixels a = RandomPixels(width, height);
+            node[n].img = RandomImageOrView(&a);
+            node[n].e = ImageExprOf(node[n].img);
+            FreePixels(&a);
+        }
+        // Random operations on random nodes (used several times, forming
+        // a DAG)
+        for (; n < N; n++) {
+            Node a = node[rand() % n], b = node[rand() % n];
+            int same = ImageWidth(a.img) == ImageWidth(b.img) &&
+                       ImageHeight(a.img) == ImageHeight(b.img);
+            uint8 op = rand() % 16;
+            switch (rand() % 7) {
+                case 0:
+                    node[n].e = ImageExprNEG(a.e);
+                    node[n].img = ImageNEG(a.img);
+                    break;
+                case 1:
+                    node[n].e = ImageExprHorizontalMirror(a.e);
+                    node[n].img = ImageHorizontalMirror(a.img);
+                    break;
+                case 2:
+                    node[n].e = ImageExprVerticalMirror(a.e);
+                    node[n].img = ImageVerticalMirror(a.img);
+                    break;
+                case 3:
+                    if (ImageWidth(a.img) == ImageWidth(b.img)) {
+                        node[n].e = ImageExprReplicateAtBottom(a.e, b.e);
+                        node[n].img = ImageReplicateAtBottom(a.img, b.img);
+                        break;
+                    }
+                    // Fall through
+                case 4:
+                    if (ImageHeight(a.img) == ImageHeight(b.img)) {
+                        node[n].e = ImageExprReplicateAtRight(a.e, b.e);
+                        node[n].img = ImageReplicateAtRight(a.img, b.img);
+                        break;
+                    }
+                    // Fall through
+                default:
+                    if (!same) b = a;
+                    node[n].e = ImageExprBoolean(a.e, b.e, op);
+                    node[n].img = ImageBoolean(a.img, b.img, op);
+                    break;
+            }
+        }
+
+        // Crops of the DAG, made before anything is evaluated (so that
+        // their rows are computed with all the operations fused)
+        Node crop[4];
+        for (int k = 0; k < 4; k++) {
+            Node a = node[N - 1 - rand() % 4];
+            uint32 w = ImageWidth(a.img), h = ImageHeight(a.img);
+            uint32 x = rand() % w, y = rand() % h;
+            uint32 cw = 1 + rand() % (w - x), ch = 1 + rand() % (h - y);
+            crop[k].e = ImageExprCrop(a.e, x, y, cw, ch);
+            crop[k].img = ImageCrop(a.img, x, y, cw, ch);
+        }
+        for (int k = 0; k < 4; k++) ExpectNode(crop[k], "crop of a DAG");
+        for (int j = N - 1; j >= 0; j--) ExpectNode(node[j], "DAG");
+
+        for (int k = 0; k < 4; k++) {
+            ImageExprDestroy(&crop[k].e);
+            ImageDestroy(&crop[k].img);
+        }
+        for (int j = 0; j < N; j++) {
+            ImageExprDestroy(&node[j].e);
+            ImageDestroy(&node[j].img);
+        }
+    }
+}
+
+/// Whether the files named name1 and name2 have the same bytes
+static int SameFiles(const char* name1, const char* name2) {
+    FILE* f1 = fopen(name1, "rb");
+    FILE* f2 = fopen(name2, "rb");
+    assert(f1 != NULL && f2 != NULL);
+    int c;
+    while ((c = fgetc(f1)) == fgetc(f2) && c != EOF) continue;
+    fclose(f1);
+    fclose(f2);
+    return c == EOF;
+}
+
+#define TMP_IN "testops-in.pbm"
+
+static void TestStream(void) {
+    for (int t = 0; t < 30; t++) {
+        uint32 width = 1 + rand() % 150, height = 1 + rand() % 10;
+        Pixels a = RandomPixels(width, height);
+        // Headers longer than a read, sometimes
+        size_t comment = rand() % 3 == 0 ? 5000 + rand() % 10000 : 0;
+        SavePixels(a, TMP_IN, comment);
+        Image img = ImageLoad(TMP_IN);
+
+        // Streamed and saved again
+        ImageExpr e = ImageExprOfFile(TMP_IN);
+        ImageExprSave(e, TMP_PBM);
+        ImageExprDestroy(&e);
+        Image loaded = ImageLoad(TMP_PBM);
+        Expect(ImageIsEqual(loaded, img), "stream round trip");
+        ImageDestroy(&loaded);
+        if (comment == 0) {
+            Expect(SameFiles(TMP_PBM, TMP_IN), "stream round trip file");
+        }
+
+        // With operations (reading rows of the file several times)
+        Pixels b = RandomPixels(width, height);
+        Image other = RandomImageOrView(&b);
+        uint8 op = rand() % 16;
+        uint32 x = rand() % width, w = 1 + rand() % (width - x);
+        e = ImageExprOfFile(TMP_IN);
+        ImageExpr o = ImageExprOf(other);
+        ImageExpr ne = ImageExprNEG(e);
+        ImageExpr r1 = ImageExprBoolean(ne, o, op);
+        ImageExpr me = ImageExprHorizontalMirror(e);
+        ImageExpr ce = ImageExprCrop(me, x, 0, w, height);
+        ImageExpr r2 = ImageExprReplicateAtRight(r1, ce);
+        Image neg = ImageNEG(img);
+        Image d1 = ImageBoolean(neg, other, op);
+        Image mirror = ImageHorizontalMirror(img);
+        Image cropped = ImageCrop(mirror, x, 0, w, height);
+        Image d2 = ImageReplicateAtRight(d1, cropped);
+        ImageExprSave(r2, TMP_PBM);
+        loaded = ImageLoad(TMP_PBM);
+        Expect(ImageIsEqual(loaded, d2), "stream with operations");
+        ImageDestroy(&loaded);
+        ImageExprDestroy(&r2);
+        ImageExprDestroy(&ce);
+        ImageExprDestroy(&me);
+        ImageExprDestroy(&r1);
+        ImageExprDestroy(&ne);
+        ImageExprDestroy(&o);
+        ImageExprDestroy(&e);
+        ImageDestroy(&d2);
+        ImageDestroy(&cropped);
+        ImageDestroy(&mirror);
+        ImageDestroy(&d1);
+
+        // Saved over the file streamed
+        e = ImageExprOfFile(TMP_IN);
+        o = ImageExprNEG(e);
+        ImageExprSave(o, TMP_IN);
+        ImageExprDestroy(&o);
+        ImageExprDestroy(&e);
+        loaded = ImageLoad(TMP_IN);
+        Expect(ImageIsEqual(loaded, neg), "stream saved over its file");
+        ImageDestroy(&loaded);
+
+        // Native RLE files, which are mapped
+        ImageSaveRLE(neg, TMP_RLE);
+        e = ImageExprOfFile(TMP_RLE);
+        ImageExprSave(e, TMP_PBM);
+        ImageExprDestroy(&e);
+        loaded = ImageLoad(TMP_PBM);
+        Expect(ImageIsEqual(loaded, neg), "stream of a RLE file");
+        ImageDestroy(&loaded);
+
+        ImageDestroy(&neg);
+        ImageDestroy(&other);
+        ImageDestroy(&img);
+        FreePixels(&a);
+        FreePixels(&b);
+    }
+    remove(TMP_IN);
+    remove(TMP_RLE);
+}
+
+/// N-ary operations
+
+static void TestNary(void) {
+    const char* name[4] = {"ANDN", "ORN", "XORN", "Threshold"};
+    for (int t = 0; t < 80; t++) {
+        const int counts[] = {1, 2, 3, 5, 8, 17};
+        int n = counts[rand() % (sizeof(counts) / sizeof(counts[0]))];
+        // Rows are merged with a heap when they have few runs, and counted
+        // 64 pixels at a time otherwise: operands with long runs (wide, so
+        // that they count as few), with short runs, or mixed
+        int rows = rand() % 3;
+        uint32 width = rows == 0 ? 300 + rand() % 700 : 1 + rand() % 200;
+        uint32 height = 1 + rand() % 10;
+        Image imgs[17];
+        Pixels pixels[17];
+        for (int j = 0; j < n; j++) {
+            if (j > 0 && rand() % 8 == 0) {
+                // A copy of an earlier operand (sharing its rows)
+                int other = rand() % j;
+                imgs[j] = ImageCrop(imgs[other], 0, 0, width, height);
+                pixels[j] = RefCrop(pixels[other], 0, 0, width, height);
+                continue;
+            }
+            int kind = rows == 0 ? RECTANGLES
+                     : rows == 1 ? NOISE : rand() % KINDS;
+            pixels[j] = RandomPixelsOf(width, height, kind);
+            imgs[j] = RandomImageOrView(&pixels[j]);
+        }
+
+        Pixels count = NewPixels(width, height);
+        for (int j = 0; j < n; j++) {
+            for (size_t k = 0; k < (size_t)width * height; k++) {
+                count.pixel[k] += pixels[j].pixel[k];
+            }
+        }
+        const int ks[] = {0, 1, n / 2 + 1, n, rand() % (n + 1)};
+        // ANDN, ORN, XORN, and Threshold with each k of ks
+        for (int op = 0; op < 8; op++) {
+            int k = op < 3 ? 0 : ks[op - 3];
+            Image r = op == 0 ? ImageANDN(imgs, n)
+                    : op == 1 ? ImageORN(imgs, n)
+                    : op == 2 ? ImageXORN(imgs, n)
+                              : ImageThreshold(imgs, n, k);
+            Pixels ref = NewPixels(width, height);
+            for (size_t p = 0; p < (size_t)width * height; p++) {
+                int c = count.pixel[p];
+                ref.pixel[p] = op == 0 ? c == n
+                             : op == 1 ? c >= 1
+                             : op == 2 ? c % 2 : c >= k;
+            }
+            char what[64];
+            snprintf(what, sizeof(what), "%s of %d (k = %d)",
+                     name[op < 3 ? op : 3], n, k);
+            ExpectPixels(r, ref, what);
+            ImageDestroy(&r);
+            FreePixels(&ref);
+        }
+        FreePixels(&count);
+
+        for (int j = 0; j < n; j++) {
+            ImageDestroy(&imgs[j]);
+            FreePixels(&pixels[j]);
+        }
+    }
+}
+
+/// Transposition and rotations
+
+static void TestTranspose(void) {
+    Pixels a = Picture(3, 2, "##."
+                             "..#");
+    Pixels ref = Picture(2, 3, "#."
+                               "#."
+                               ".#");
+    Image img = ImageOfPixels(a);
+    Image r = ImageTranspose(img);
+    ExpectPixels(r, ref, "transpose 3x2");
+    ImageDestroy(&r);
+    FreePixels(&ref);
+    ref = Picture(2, 3, ".#"
+                        ".#"
+                        "#.");
+    r = ImageRotate90(img);
+    ExpectPixels(r, ref, "rotate90 3x2");
+    ImageDestroy(&r);
+    FreePixels(&ref);
+    ref = Picture(2, 3, ".#"
+                        "#."
+                        "#.");
+    r = ImageRotate270(img);
+    ExpectPixels(r, ref, "rotate270 3x2");
+    ImageDestroy(&r);
+    FreePixels(&ref);
+    ImageDestroy(&img);
+    FreePixels(&a);
+
+    // Random images, with one pixel rows or columns, of operands that are
+    // views (negated or mirrored) too
+    const uint32 sizes[] = {1, 2, 7, 63, 64, 65, 129, 300};
+    const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    for (int t = 0; t < 120; t++) {
+        uint32 width = sizes[rand() % nsizes], height = sizes[rand() % nsizes];
+        a = RandomPixels(width, height);
+        img = ImageOfPixels(a);
+        for (int view = rand() % 4; view > 0; view = rand() % 4) {
+            Image v;
+            Pixels b;
+            if (view == 1) {
+                v = ImageNEG(img);
+                b = RefNEG(a);
+            } else {
+                v = view == 2 ? ImageHorizontalMirror(img)
+                              : ImageVerticalMirror(img);
+                b = RefMirror(a, view == 2);
+            }
+            ImageDestroy(&img);
+            FreePixels(&a);
+            img = v;
+            a = b;
+        }
+
+        ref = RefTranspose(a);
+        r = ImageTranspose(img);
+        ExpectPixels(r, ref, "transpose");
+        Image back = ImageTranspose(r);
+        Expect(ImageIsEqual(back, img), "transpose twice");
+        ImageDestroy(&back);
+        ImageDestroy(&r);
+
+        Pixels rotated = RefMirror(ref, 0);
+        r = ImageRotate90(img);
+        ExpectPixels(r, rotated, "rotate90");
+        ImageDestroy(&r);
+        FreePixels(&rotated);
+
+        rotated = RefMirror(ref, 1);
+        r = ImageRotate270(img);
+        ExpectPixels(r, rotated, "rotate270");
+        ImageDestroy(&r);
+        FreePixels(&rotated);
+
+        FreePixels(&ref);
+        ImageDestroy(&img);
+        FreePixels(&a);
+    }
+
+    // Columns with more changes than fit at once, so they are done in
+    // bands (see TransposeImage), of a view of noise
+    a = NewPixels(3000, 3000);
+    for (size_t k = 0; k < (size_t)a.width * a.height; k++) {
+        a.pixel[k] = rand() % 2;
+    }
+    img = RandomImageOrView(&a);
+    ref = RefTranspose(a);
+    r = ImageTranspose(img);
+    ExpectPixels(r, ref, "transpose in bands");
+    ImageDestroy(&r);
+    FreePixels(&ref);
+    ImageDestroy(&img);
+    FreePixels(&a);
+}
+
+/// Morphology
+
+static void ExpectMorph(Image (*op)(const Image, ImageStructElem),
+                        const char* picture, ImageStructElem se,
+                        const char* expected, const char* what) {
+    Pixels a = Picture(7, 7, picture), ref = Picture(7, 7, expected);
+    Image img = ImageOfPixels(a);
+    Image r = op(img, se);
+    ExpectPixels(r, ref, what);
+    ImageDestroy(&r);
+    ImageDestroy(&img);
+    FreePixels(&a);
+    FreePixels(&ref);
+}
+
+static void TestMorphology(void) {
+    const char* point = "......."
+                        "......."
+                        "......."
+                        "...#..."
+                        "......."
+                        "......."
+                        ".......";
+    // Dilating a point gives the structuring element, with its origin
+    // there: the first of the two middle pixels, for even lengths
+    const char* width4 = "......."
+                         "......."
+                         "......."
+                         "..####."
+                         "......."
+                         "......."
+                         ".......";
+    const char* height2 = "......."
+                          "......."
+                          "......."
+                          "...#..."
+                          "...#..."
+                          "......."
+                          ".......";
+    const char* diagonal4 = "......."
+                            "......."
+                            "..#...."
+                            "...#..."
+                            "....#.."
+                            ".....#."
+                            ".......";
+    const char* antidiagonal4 = "......."
+                                "......."
+                                "....#.."
+                                "...#..."
+                                "..#...."
+                                ".#....."
+                                ".......";
+    const ImageStructElem line[4] = {
+        {4, 1, 0, 0}, {0, 2, 0, 0}, {0, 0, 4, 0}, {0, 0, 0, 4}};
+    const char* const element[4] = {width4, height2, diagonal4,
+                                    antidiagonal4};
+    for (int s = 0; s < 4; s++) {
+        ExpectMorph(ImageDilate, point, line[s], element[s], "dilate point");
+        // Eroding it gives the point back (only if the element is
+        // reflected when dilating, as it is not symmetric)
+        ExpectMorph(ImageErode, element[s], line[s], point, "erode element");
+    }
+
+    // Pixels outside the image are BLACK when eroding
+    ExpectMorph(ImageErode,
+                "##....."
+                "##....."
+                "......."
+                "......."
+                "......."
+                ".....##"
+                ".....##",
+                (ImageStructElem){3, 3, 0, 0},
+                "#......"
+                "......."
+                "......."
+                "......."
+                "......."
+                "......."
+                "......#",
+                "erode at the borders");
+
+    // Pixels dilated out of the image by a segment are lost, even if the
+    // next one would bring them back: (-1, 1) is lost with the diagonal,
+    // so (0, 0) is not BLACK after the antidiagonal
+    ExpectMorph(ImageDilate,
+                "......."
+                "......."
+                "#......"
+                "......."
+                "......."
+                "......."
+                ".......",
+                (ImageStructElem){0, 0, 3, 3},
+                "......."
+                ".#....."
+                "#.#...."
+                ".#....."
+                "#......"
+                "......."
+                ".......",
+                "dilate across the border");
+
+    // Random images (and views), against the reference
+    for (int t = 0; t < 100; t++) {
+        uint32 width = 1 + rand() % 100, height = 1 + rand() % 40;
+        Pixels a = RandomPixels(width, height);
+        Image img = RandomImageOrView(&a);
+        const uint32 lengths[] = {0, 1, 2, 3, 4, 5, 8, 9, 17, 70};
+        const int nlengths = sizeof(lengths) / sizeof(lengths[0]);
+        ImageStructElem se = {lengths[rand() % nlengths],
+                              lengths[rand() % nlengths], 0, 0};
+        if (rand() % 2) {
+            se.diagonal = lengths[rand() % nlengths];
+            se.antidiagonal = lengths[rand() % nlengths];
+        }
+
+        Image r = ImageDilate(img, se);
+        Pixels ref = RefMorph(a, se, 0);
+        ExpectPixels(r, ref, "dilate");
+        ImageDestroy(&r);
+        r = ImageClose(img, se);
+        Pixels ref2 = RefMorph(ref, se, 1);
+        ExpectPixels(r, ref2, "close");
+        ImageDestroy(&r);
+        FreePixels(&ref);
+        FreePixels(&ref2);
+
+        r = ImageErode(img, se);
+        ref = RefMorph(a, se, 1);
+        ExpectPixels(r, ref, "erode");
+        ImageDestroy(&r);
+        r = ImageOpen(img, se);
+        ref2 = RefMorph(ref, se, 0);
+        ExpectPixels(r, ref2, "open");
+        ImageDestroy(&r);
+        FreePixels(&ref);
+        FreePixels(&ref2);
+
+        ImageDestroy(&img);
+        FreePixels(&a);
+    }
+}
+
+/// Threads
+
+#define THREAD_OPS 14
+
+#define THREAD_PBM "testops_threads.pbm"
+
+/// Operation op of TestThreads on a and b (of the same size)
+static Image ThreadOp(int op, const Image a, const Image b) {
+    uint32 width = ImageWidth(a), height = ImageHeight(a);
+    const Image both[2] = {a, b};
+    ImageStructElem se = {3, 3, 0, 0};
+    switch (op) {
+        case 0: return ImageNEG(a);
+        case 1: return ImageXOR(a, b);
+        case 2: return ImageAND2(a, b);
+        case 3: return ImageORN(both, 2);
+        case 4: return ImageThreshold(both, 2, 2);
+        case 5: return ImageVerticalMirror(a);
+        case 6: return ImageReplicateAtRight(a, b);
+        case 7: return ImageReplicateAtBottom(a, b);
+        case 8:
+            return ImageCrop(a, width / 4, height / 4, width - width / 4 * 2,
+                             height - height / 4 * 2);
+        case 9: return ImageTranspose(a);
+        case 10: return ImageDilate(a, se);
+        case 11: return ImageErode(b, se);
+        case 12: {
+            ImageExpr ea = ImageExprOf(a), eb = ImageExprOf(b);
+            ImageExpr em = ImageExprVerticalMirror(ea);
+            ImageExpr e = ImageExprBoolean(em, eb, 0x6);
+            Image r = ImageExprEval(e);
+            ImageExprDestroy(&e);
+            ImageExprDestroy(&em);
+            ImageExprDestroy(&ea);
+            ImageExprDestroy(&eb);
+            return r;
+        }
+        default:
+            ImageSave(a, THREAD_PBM);
+            return ImageLoad(THREAD_PBM);
+    }
+}
+
+// Results must not depend on the number of threads: rows are split
+// between them by estimated cost, and threads that finish early steal
+// rows from the others.  Images with all their runs in their first rows
+// unbalance operations whose rows are estimated to cost the same (crops,
+// transposes, expressions and loads), so that rows are stolen, and images
+// with fewer rows than threads leave some threads without any.
+static void TestThreads(void) {
+    const uint32 size[][2] = {{300, 200}, {1000, 64}, {70, 3}, {1, 1},
+                              {5000, 2}};
+    const int threads[] = {3, 8, 16};
+    int saved = ImageGetThreads();
+    for (size_t s = 0; s < sizeof(size) / sizeof(size[0]); s++) {
+        for (int skewed = 0; skewed <= 1; skewed++) {
+            uint32 width = size[s][0], height = size[s][1];
+            Pixels pa = RandomPixels(width, height);
+            if (skewed) {
+                for (uint32 y = 0; y < height; y++) {
+                    for (uint32 x = 0; x < width; x++) {
+                        *At(pa, x, y) = y <= height / 8 && rand() % 2;
+                    }
+                }
+            }
+            Pixels pb = RandomPixels(width, height);
+            Image a = ImageOfPixels(pa);
+            Image b = RandomImageOrView(&pb);
+
+            Image result[THREAD_OPS];
+            ImageSetThreads(1);
+            for (int op = 0; op < THREAD_OPS; op++) {
+                result[op] = ThreadOp(op, a, b);
+            }
+            for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]);
+                 t++) {
+                ImageSetThreads(threads[t]);
+                for (int op = 0; op < THREAD_OPS; op++) {
+                    Image r = ThreadOp(op, a, b);
+                    char message[100];
+                    snprintf(message, sizeof(message),
+                             "operation %d on %ux%u%s, %d threads", op,
+                             width, height, skewed ? " (skewed)" : "",
+                             threads[t]);
+                    Expect(ImageIsEqual(r, result[op]) &&
+                           ImageFingerprint(r) ==
+                               ImageFingerprint(result[op]) &&
+                           ImageBlackPixels(r) ==
+                               ImageBlackPixels(result[op]) &&
+                           ImageRuns(r) == ImageRuns(result[op]), message);
+                    ImageDestroy(&r);
+                }
+            }
+            // The single-threaded results are checked too
+            Pixels ref = RefBoolean(pa, pb, 0x6);
+            ExpectPixels(result[1], ref, "xor, 1 thread");
+            FreePixels(&ref);
+
+            for (int op = 0; op < THREAD_OPS; op++) {
+                ImageDestroy(&result[op]);
+            }
+            ImageDestroy(&a);
+            ImageDestroy(&b);
+            FreePixels(&pa);
+            FreePixels(&pb);
+        }
+    }
+    ImageSetThreads(saved);
+    remove(THREAD_PBM);
+}
+
+// Blocks of images are allocated by the threads building their rows and
+// freed by the one destroying them: freed blocks go to its free lists, and
+// then to those shared by all threads, from which the others reuse them.
+// Each round builds 2 MiB of new rows (two intern chunks) in several
+// threads, loading a noise image and xoring it with the previous one,
+// and destroys the images of the round before, so that blocks of every
+// thread are reused by the others, also after the workers are replaced.
+static void TestThreadBlocks(void) {
+    int saved = ImageGetThreads();
+    Pixels prev = RandomPixelsOf(4096, 2048, NOISE);
+    Image prev_img = ImageOfPixels(prev);
+    for (int round = 0; round < 8; round++) {
+        ImageSetThreads(round % 4 == 3 ? 2 : 4);
+        Pixels p = NewPixels(4096, 2048);
+        for (size_t k = 0; k < (size_t)4096 * 2048; k++) {
+            p.pixel[k] = rand() % 2;
+        }
+        Image img = ImageOfPixels(p);
+        Image r = ImageXOR(img, prev_img);
+        Pixels ref = RefBoolean(p, prev, 0x6);
+        ExpectPixels(r, ref, "xor of blocks reused across threads");
+        FreePixels(&ref);
+        ImageDestroy(&r);
+        ImageDestroy(&prev_img);
+        FreePixels(&prev);
+        prev_img = img;
+        prev = p;
+    }
+    ImageDestroy(&prev_img);
+    FreePixels(&prev);
+    ImageSetThreads(saved);
+}
+
+int main(int argc, char* argv[]) {
+    ImageInit();
+    srand(argc > 1 ? (unsigned)atoi(argv[1]) : 2024);
+    ImageSetThreads(argc > 2 ? atoi(argv[2]) : 2);
+
+    TestStatistics();
+    TestPixels();
+    TestCrop();
+    TestFingerprint();
+    TestInPlace();
+    TestViews();
+    TestExpressions();
+    TestStream();
+    TestNary();
+    TestTranspose();
+    TestMorphology();
+    TestThreads();
+    TestThreadBlocks();
+
+    remove(TMP_PBM);
+    ImageReleaseMemory();
+    if (failures > 0) {
+        printf("%d checks FAILED\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All checks passed\n");
+    return EXIT_SUCCESS;
+}
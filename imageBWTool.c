@@ -29,17 +29,28 @@ static const char* USAGE =
     "  The last image in the buffer is called the current image CURR and its\n"
     "  predecessor is PRED.\n"
     "  Most operations apply to CURR and some also use PRED.\n"
+    "  Operations on images are only evaluated when their result is saved,\n"
+    "  printed or compared (or with eval), all at once, a row at a time.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in binary PBM format are accepted.\n"
+    "  Image files in binary PBM format or in native RLE format (see saverle)\n"
+    "  are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load image from PBM file named FILE.\n"
     "  save FILE       Save CURR to PBM file named FILE.\n"
-    "  info            Show information on CURR (size).\n"
+    "  saverle FILE    Save CURR to native RLE file named FILE (loaded at\n"
+    "                  once, by mapping it, as any input FILE).\n"
+    "  info            Show information on CURR (size, runs, black pixels\n"
+    "                  and bytes).\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  eval            Evaluate CURR now (e.g., to time it with tic/toc).\n"
+    "  stream          Read the following FILEs a row at a time, only when\n"
+    "                  needed: with save, there is no limit on image size.\n"
+    "                  (An input FILE must not be saved to.)\n"
+    "  threads N       Use N threads in the following operations.\n"
     "\n"              
     "  create W,H,C    Create new image with WxH pixels, color C.\n"
     "  chess W,H,E,C   Create new chessboard image with WxH pixels,"
@@ -49,22 +60,45 @@ static const char* USAGE =
     "  rle             Print RLE representation of CURR.\n"
     "\n"              
     "  equal           PREV == CURR?\n"
+    "  pixel X,Y       Pixel of CURR at column X, row Y.\n"
     "\n"              
     "  neg             Neg CURR.\n"
     "  and             PREV and CURR.\n"
     "  or              PREV or CURR.\n"
     "  xor             PREV xor CURR.\n"
+    "  andnot          PREV and not CURR.\n"
+    "  nand            PREV nand CURR.\n"
+    "  nor             PREV nor CURR.\n"
+    "  xnor            PREV xnor CURR.\n"
+    "  andn N          And of the last N images (CURR and its predecessors).\n"
+    "  orn N           Or of the last N images.\n"
+    "  xorn N          Xor of the last N images.\n"
+    "  thresh N,K      BLACK where at least K of the last N images are.\n"
     "\n"              
     "  hmirror         Horizontal mirror CURR (flip top-bottom).\n"
     "  vmirror         Vertical mirror CURR (flip left-right).\n"
     "  repb            Replicate CURR at the bottom of PREV.\n"
     "  repr            Replicate CURR at the right of PREV.\n"
+    "  crop X,Y,W,H    Crop WxH pixels of CURR, from column X, row Y on.\n"
+    "  transpose       Transpose CURR (columns become rows).\n"
+    "  rot90           Rotate CURR 90 degrees clockwise.\n"
+    "  rot270          Rotate CURR 90 degrees counterclockwise.\n"
+    "\n"
+    "  dilate W,H[,D,A]  Dilate CURR by a WxH rectangle (plus diagonal\n"
+    "                  segments of length D and A, top left to bottom right\n"
+    "                  and top right to bottom left).\n"
+    "  erode W,H[,D,A]   Erode CURR by the same structuring elements.\n"
+    "  open W,H[,D,A]    Open CURR (erode, then dilate).\n"
+    "  close W,H[,D,A]   Close CURR (dilate, then erode).\n"
     "\n"              
     "OPERANDS:\n"
     "  FILE            A filename\n"
     "  W,H             Width and height of image or rectangular region.\n"
     "  C               Color (0 = WHITE, 1 = BLACK).\n"
     "  E               Edge length.\n"
+    "  D,A             Lengths of diagonal segments (0 = none).\n"
+    "  N               Number of threads or images.\n"
+    "  K               Number of images.\n"
     "\n"
 ;
 
@@ -77,6 +111,82 @@ static char* errors[] = {
 };
 
 
+// Make an expression with img, which is destroyed.
+static ImageExpr ExprOf(Image img) {
+    ImageExpr e = ImageExprOf(img);
+    ImageDestroy(&img);
+    return e;
+}
+
+// Whether arg is one of the operations in ops (ended by NULL).
+static int IsOp(const char* arg, const char* const ops[]) {
+    for (int j = 0; ops[j] != NULL; j++) {
+        if (strcmp(arg, ops[j]) == 0) return 1;
+    }
+    return 0;
+}
+
+// Find, for each image that the arguments av[1..ac-1] create in a buffer of
+// capacity N, the argument of the last operation that uses it: the image is
+// destroyed right after it, so that operation may be done in place.
+// (Images never used are last used where they are created.)
+// If the arguments are invalid, all images are kept until the end.
+static void FindLastUses(int ac, char* av[], int last[], int N) {
+    static const char* const none[] = {"tic", "toc", "stream", NULL};
+    static const char* const show[] = {"info", "eval", "raw", "rle", NULL};
+    static const char* const showarg[] = {"pixel", "save", "saverle", NULL};
+    static const char* const unary[] = {"neg", "hmirror", "vmirror",
+                                        "transpose", "rot90", "rot270",
+                                        NULL};
+    static const char* const unaryarg[] = {"crop", "dilate", "erode",
+                                           "open", "close", NULL};
+    static const char* const binary[] = {"and", "or", "xor", "andnot",
+                                         "nand", "nor", "xnor", "repb",
+                                         "repr", NULL};
+    static const char* const nary[] = {"andn", "orn", "xorn", "thresh", NULL};
+    static const char* const create[] = {"create", "chess", NULL};
+
+    for (int j = 0; j < N; j++) last[j] = ac;
+    int n = 0;          // number of images created
+    int valid = 1;
+    for (int k = 1; k < ac && valid; k++) {
+        const char* op = av[k];
+        int uses = 0;     // number of images used (the last ones)
+        int creates = 1;  // whether an image is created
+        if (IsOp(op, none)) {
+            creates = 0;
+        } else if (strcmp(op, "threads") == 0) {
+            creates = 0; k++;
+        } else if (IsOp(op, show)) {
+            uses = 1; creates = 0;
+        } else if (IsOp(op, showarg)) {
+            uses = 1; creates = 0; k++;
+        } else if (strcmp(op, "equal") == 0) {
+            uses = 2; creates = 0;
+        } else if (IsOp(op, unary)) {
+            uses = 1;
+        } else if (IsOp(op, unaryarg)) {
+            uses = 1; k++;
+        } else if (IsOp(op, binary)) {
+            uses = 2;
+        } else if (IsOp(op, nary)) {
+            k++;
+            if (k >= ac || sscanf(av[k], "%d", &uses) != 1) uses = -1;
+        } else if (IsOp(op, create)) {
+            k++;
+        }  // otherwise, an image file
+        if (k >= ac || uses < 0 || uses > n || n + creates > N) {
+            valid = 0;
+            break;
+        }
+        for (int j = n - uses; j < n; j++) last[j] = k;
+        if (creates) last[n++] = k;
+    }
+    if (!valid) {
+        for (int j = 0; j < n; j++) last[j] = ac;
+    }
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations,
@@ -96,25 +206,48 @@ int main(int ac, char* av[]) {
     ImageInit();
 
     int err = 0;
+    int stream = 0;     // whether files are read as streams
     uint32 w, h;
 
     // The image buffer
     const int N = 10;   // buffer capacity
-    Image img[N];       // the images
+    ImageExpr img[N];   // the images (evaluated only when needed)
+    Image res;          // an evaluated image
     int n = 0;          // number of images created
+    int last[N];        // argument where each image is last used
+    FindLastUses(ac, av, last, N);
 
     int k = 1;
     while (k < ac) {
         if (strcmp(av[k], "info") == 0) {
             if (n < 1) { err = 2; break; }  // enough input images?
             fprintf(log, "Info on I%d\n", n-1);
-            w = ImageWidth(img[n-1]);
-            h = ImageHeight(img[n-1]);
+            w = ImageExprWidth(img[n-1]);
+            h = ImageExprHeight(img[n-1]);
             fprintf(log, "# Size: %ux%u\n", w, h);
+            res = ImageExprEval(img[n-1]);
+            fprintf(log, "# Runs: %" PRIu64 ", black pixels: %" PRIu64
+                    ", bytes: %d\n", ImageRuns(res), ImageBlackPixels(res),
+                    ImageSize(res));
+            ImageDestroy(&res);
         } else if (strcmp(av[k], "tic") == 0) {
             InstrReset();
         } else if (strcmp(av[k], "toc") == 0) {
             InstrPrint();
+        } else if (strcmp(av[k], "threads") == 0) {
+            if (++k >= ac) { err = 1; break; }  // enough arguments?
+            uint t;  // number of threads
+            if (sscanf(av[k], "%u", &t) != 1) { err = 4; break; }
+            if (t < 1) { err = 4; break; }   // precondition check!
+            fprintf(log, "ImageSetThreads(%u)\n", t);
+            ImageSetThreads((int)t);
+        } else if (strcmp(av[k], "stream") == 0) {
+            stream = 1;
+        } else if (strcmp(av[k], "eval") == 0) {
+            if (n < 1) { err = 2; break; }  // enough input images?
+            fprintf(log, "ImageExprEval(I%d)\n", n-1);
+            res = ImageExprEval(img[n-1]);
+            ImageDestroy(&res);
         } else if (strcmp(av[k], "create") == 0) {
             if (++k >= ac) { err = 1; break; }  // enough arguments?
             if (n >= N) { err = 3; break; } // enough space for output?
@@ -122,7 +255,7 @@ int main(int ac, char* av[]) {
             if (sscanf(av[k], "%u,%u,%u", &w, &h, &c) != 3) { err = 4; break; }
             if (c > 1) { err = 4; break; }   // precondition check!
             fprintf(log, "ImageCreate(%u, %u, %u) -> I%d\n", w, h, c, n);
-            img[n] = ImageCreate(w, h, (uint8)c);
+            img[n] = ExprOf(ImageCreate(w, h, (uint8)c));
             //x if (img[n] == NULL) { err = 999; break; }
             n++;
         } else if (strcmp(av[k], "chess") == 0) {
@@ -133,89 +266,258 @@ int main(int ac, char* av[]) {
             if (sscanf(av[k], "%u,%u,%u,%u", &w, &h, &edge, &c) != 4) { err = 4; break; }
             if (c > 1) { err = 4; break; }   // precondition check!
             fprintf(log, "ImageCreateChessBoard(%u, %u, %u, %u) -> I%d\n", w, h, edge, c, n);
-            img[n] = ImageCreateChessboard(w, h, edge, (uint8)c);;
+            img[n] = ExprOf(ImageCreateChessboard(w, h, edge, (uint8)c));
             n++;
         } else if (strcmp(av[k], "raw") == 0) {
             if (n < 1) { err = 2; break; }  // enough input images?
             fprintf(log, "ImageRAWPrint(I%d)\n", n-1);
-            ImageRAWPrint(img[n-1]);
+            res = ImageExprEval(img[n-1]);
+            ImageRAWPrint(res);
+            ImageDestroy(&res);
         } else if (strcmp(av[k], "rle") == 0) {
             if (n < 1) { err = 2; break; }  // enough input images?
             fprintf(log, "ImageRLEPrint(I%d)\n", n-1);
-            ImageRLEPrint(img[n-1]);
+            res = ImageExprEval(img[n-1]);
+            ImageRLEPrint(res);
+            ImageDestroy(&res);
         } else if (strcmp(av[k], "equal") == 0) {
             if (n < 2) { err = 2; break; }  // enough input images?
             fprintf(log, "ImageIsEqual(I%d, I%d) -> ", n-2, n-1);
-            int eq = ImageIsEqual(img[n-2], img[n-1]);
+            res = ImageExprEval(img[n-2]);
+            Image res2 = ImageExprEval(img[n-1]);
+            int eq = ImageIsEqual(res, res2);
+            ImageDestroy(&res);
+            ImageDestroy(&res2);
             fprintf(log, "%d\n", eq);
+        } else if (strcmp(av[k], "pixel") == 0) {
+            if (++k >= ac) { err = 1; break; }  // enough arguments?
+            if (n < 1) { err = 2; break; }  // enough input images?
+            uint x, y;
+            if (sscanf(av[k], "%u,%u", &x, &y) != 2) { err = 4; break; }
+            if (x >= (uint)ImageExprWidth(img[n-1]) ||
+                y >= (uint)ImageExprHeight(img[n-1])) { err = 4; break; }
+            fprintf(log, "ImageGetPixel(I%d, %u, %u) -> ", n-1, x, y);
+            res = ImageExprEval(img[n-1]);
+            fprintf(log, "%u\n", ImageGetPixel(res, x, y));
+            ImageDestroy(&res);
         } else if (strcmp(av[k], "neg") == 0) {
             if (n < 1) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageNEG(I%d) -> I%d\n", n-1, n);
-            img[n] = ImageNEG(img[n-1]);
+            img[n] = ImageExprNEG(img[n-1]);
             n++;
         } else if (strcmp(av[k], "and") == 0) {
             if (n < 2) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
-            img[n] = ImageAND(img[n-2], img[n-1]);
+            img[n] = ImageExprBoolean(img[n-2], img[n-1], BOOL_AND);
             n++;
         } else if (strcmp(av[k], "or") == 0) {
             if (n < 2) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-            img[n] = ImageOR(img[n-2], img[n-1]);
+            img[n] = ImageExprBoolean(img[n-2], img[n-1], BOOL_OR);
             n++;
         } else if (strcmp(av[k], "xor") == 0) {
             if (n < 2) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageXOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
-            img[n] = ImageXOR(img[n-2], img[n-1]);
+            img[n] = ImageExprBoolean(img[n-2], img[n-1], BOOL_XOR);
+            n++;
+        } else if (strcmp(av[k], "andnot") == 0) {
+            if (n < 2) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            fprintf(log, "ImageANDNOT(I%d, I%d) -> I%d\n", n-2, n-1, n);
+            img[n] = ImageExprBoolean(img[n-2], img[n-1], BOOL_ANDNOT);
+            n++;
+        } else if (strcmp(av[k], "nand") == 0) {
+            if (n < 2) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            fprintf(log, "ImageNAND(I%d, I%d) -> I%d\n", n-2, n-1, n);
+            img[n] = ImageExprBoolean(img[n-2], img[n-1], BOOL_NAND);
+            n++;
+        } else if (strcmp(av[k], "nor") == 0) {
+            if (n < 2) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            fprintf(log, "ImageNOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+            img[n] = ImageExprBoolean(img[n-2], img[n-1], BOOL_NOR);
+            n++;
+        } else if (strcmp(av[k], "xnor") == 0) {
+            if (n < 2) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            fprintf(log, "ImageXNOR(I%d, I%d) -> I%d\n", n-2, n-1, n);
+            img[n] = ImageExprBoolean(img[n-2], img[n-1], BOOL_XNOR);
+            n++;
+        } else if (strcmp(av[k], "andn") == 0 || strcmp(av[k], "orn") == 0 ||
+                   strcmp(av[k], "xorn") == 0 ||
+                   strcmp(av[k], "thresh") == 0) {
+            const char* op = av[k];
+            if (++k >= ac) { err = 1; break; }  // enough arguments?
+            uint m, t = 0;  // number of images, threshold
+            if (strcmp(op, "thresh") == 0) {
+                if (sscanf(av[k], "%u,%u", &m, &t) != 2) { err = 4; break; }
+            } else {
+                if (sscanf(av[k], "%u", &m) != 1) { err = 4; break; }
+            }
+            if (m < 1 || t > m) { err = 4; break; }   // precondition check!
+            if (n < (int)m) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            fprintf(log, "Image%s(I%d..I%d) -> I%d\n",
+                    strcmp(op, "andn") == 0 ? "ANDN" :
+                    strcmp(op, "orn") == 0 ? "ORN" :
+                    strcmp(op, "xorn") == 0 ? "XORN" : "Threshold",
+                    n-(int)m, n-1, n);
+            Image operands[N];
+            for (uint j = 0; j < m; j++) {
+                operands[j] = ImageExprEval(img[n-(int)m+j]);
+            }
+            if (strcmp(op, "andn") == 0) {
+                res = ImageANDN(operands, m);
+            } else if (strcmp(op, "orn") == 0) {
+                res = ImageORN(operands, m);
+            } else if (strcmp(op, "xorn") == 0) {
+                res = ImageXORN(operands, m);
+            } else {
+                res = ImageThreshold(operands, m, t);
+            }
+            for (uint j = 0; j < m; j++) ImageDestroy(&operands[j]);
+            img[n] = ExprOf(res);
             n++;
         } else if (strcmp(av[k], "hmirror") == 0) {
             if (n < 1) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageHorizontalMirror(I%d) -> I%d\n", n-1, n);
-            img[n] = ImageHorizontalMirror(img[n-1]);
+            img[n] = ImageExprHorizontalMirror(img[n-1]);
             n++;
         } else if (strcmp(av[k], "vmirror") == 0) {
             if (n < 1) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageVerticalMirror(I%d) -> I%d\n", n-1, n);
-            img[n] = ImageVerticalMirror(img[n-1]);
+            img[n] = ImageExprVerticalMirror(img[n-1]);
             n++;
         } else if (strcmp(av[k], "repb") == 0) {
             if (n < 2) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageReplicateAtBottom(I%d, I%d) -> I%d\n", n-2, n-1, n);
-            img[n] = ImageReplicateAtBottom(img[n-2], img[n-1]);
+            img[n] = ImageExprReplicateAtBottom(img[n-2], img[n-1]);
             n++;
         } else if (strcmp(av[k], "repr") == 0) {
             if (n < 2) { err = 2; break; }  // enough input images?
             if (n >= N) { err = 3; break; } // enough space for output?
             fprintf(log, "ImageReplicateAtRight(I%d, I%d) -> I%d\n", n-2, n-1, n);
-            img[n] = ImageReplicateAtRight(img[n-2], img[n-1]);
+            img[n] = ImageExprReplicateAtRight(img[n-2], img[n-1]);
+            n++;
+        } else if (strcmp(av[k], "crop") == 0) {
+            if (++k >= ac) { err = 1; break; }  // enough arguments?
+            if (n < 1) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            uint x, y;
+            if (sscanf(av[k], "%u,%u,%u,%u", &x, &y, &w, &h) != 4) {
+                err = 4; break;
+            }
+            // precondition check!
+            uint width = (uint)ImageExprWidth(img[n-1]);
+            uint height = (uint)ImageExprHeight(img[n-1]);
+            if (w == 0 || w > width || x > width - w) { err = 4; break; }
+            if (h == 0 || h > height || y > height - h) { err = 4; break; }
+            fprintf(log, "ImageCrop(I%d, %u, %u, %u, %u) -> I%d\n",
+                    n-1, x, y, w, h, n);
+            img[n] = ImageExprCrop(img[n-1], x, y, w, h);
+            n++;
+        } else if (strcmp(av[k], "transpose") == 0 ||
+                   strcmp(av[k], "rot90") == 0 ||
+                   strcmp(av[k], "rot270") == 0) {
+            const char* op = av[k];
+            if (n < 1) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            fprintf(log, "Image%s(I%d) -> I%d\n",
+                    strcmp(op, "transpose") == 0 ? "Transpose" :
+                    strcmp(op, "rot90") == 0 ? "Rotate90" : "Rotate270",
+                    n-1, n);
+            Image operand = ImageExprEval(img[n-1]);
+            if (strcmp(op, "transpose") == 0) {
+                res = ImageTranspose(operand);
+            } else if (strcmp(op, "rot90") == 0) {
+                res = ImageRotate90(operand);
+            } else {
+                res = ImageRotate270(operand);
+            }
+            ImageDestroy(&operand);
+            img[n] = ExprOf(res);
+            n++;
+        } else if (strcmp(av[k], "dilate") == 0 ||
+                   strcmp(av[k], "erode") == 0 ||
+                   strcmp(av[k], "open") == 0 ||
+                   strcmp(av[k], "close") == 0) {
+            const char* op = av[k];
+            if (++k >= ac) { err = 1; break; }  // enough arguments?
+            if (n < 1) { err = 2; break; }  // enough input images?
+            if (n >= N) { err = 3; break; } // enough space for output?
+            ImageStructElem se = {0, 0, 0, 0};
+            int m = sscanf(av[k], "%u,%u,%u,%u", &se.width, &se.height,
+                           &se.diagonal, &se.antidiagonal);
+            if (m != 2 && m != 4) { err = 4; break; }
+            fprintf(log, "Image%s(I%d, %u, %u, %u, %u) -> I%d\n",
+                    strcmp(op, "dilate") == 0 ? "Dilate" :
+                    strcmp(op, "erode") == 0 ? "Erode" :
+                    strcmp(op, "open") == 0 ? "Open" : "Close",
+                    n-1, se.width, se.height, se.diagonal, se.antidiagonal,
+                    n);
+            Image operand = ImageExprEval(img[n-1]);
+            if (strcmp(op, "dilate") == 0) {
+                res = ImageDilate(operand, se);
+            } else if (strcmp(op, "erode") == 0) {
+                res = ImageErode(operand, se);
+            } else if (strcmp(op, "open") == 0) {
+                res = ImageOpen(operand, se);
+            } else {
+                res = ImageClose(operand, se);
+            }
+            ImageDestroy(&operand);
+            img[n] = ExprOf(res);
             n++;
         } else if (strcmp(av[k], "save") == 0) {
             if (++k >= ac) { err = 1; break; }
             if (n < 1) { err = 2; break; }  // enough input images?
             fprintf(log, "ImageSave(I%d, \"%s\")\n", n-1, av[k]);
-            ImageSave(img[n-1], av[k]);
+            ImageExprSave(img[n-1], av[k]);
+        } else if (strcmp(av[k], "saverle") == 0) {
+            if (++k >= ac) { err = 1; break; }
+            if (n < 1) { err = 2; break; }  // enough input images?
+            fprintf(log, "ImageSaveRLE(I%d, \"%s\")\n", n-1, av[k]);
+            res = ImageExprEval(img[n-1]);
+            ImageSaveRLE(res, av[k]);
+            ImageDestroy(&res);
         } else {  // image file
             if (n >= N) { err = 3; break; }
-            fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
-            img[n] = ImageLoad(av[k]);
+            if (stream) {
+                fprintf(log, "ImageExprOfFile(\"%s\") -> I%d\n", av[k], n);
+                img[n] = ImageExprOfFile(av[k]);
+            } else {
+                fprintf(log, "ImageLoad(\"%s\") -> I%d\n", av[k], n);
+                img[n] = ExprOf(ImageLoad(av[k]));
+            }
             //x if (img[n] == NULL) { err = 999; break; }
             n++;
         }
+
+        // Destroy the images no longer used
+        for (int j = 0; j < n; j++) {
+            if (img[j] != NULL && last[j] <= k) {
+                fprintf(log, "ImageDestroy(I%d)\n", j);
+                ImageExprDestroy(&img[j]);
+            }
+        }
         k++;
     }
 
     // Destroy remaining images
     while (n > 0) {
-        fprintf(log, "ImageDestroy(I%d)\n", n-1);
-        ImageDestroy(&img[--n]);
+        if (img[--n] == NULL) continue;
+        fprintf(log, "ImageDestroy(I%d)\n", n);
+        ImageExprDestroy(&img[n]);
     }
+    ImageReleaseMemory();
 
     if (err > 0) {
         fprintf(stderr, "%s\n", errors[err]);